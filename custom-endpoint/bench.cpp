@@ -0,0 +1,469 @@
+#include <systemc.h>
+#include <tlm>
+#include <tlm_utils/simple_initiator_socket.h>
+#include <tlm_utils/simple_target_socket.h>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "matrix_multiplier_pcie.h"
+
+using namespace sc_core;
+using namespace std;
+
+/**
+ * Benchmark suite for the endpoint model.
+ *
+ *   pcie_bench [--sizes=4,16,...] [--jobs=1,16] [--engines=1,4]
+ *              [--timing=at,lt] [--max-gflop=200] [--csv=FILE] [--json=FILE]
+ *
+ * Every combination of matrix size, job count, engine count and timing
+ * model is one point. Each point runs in its own forked process, since a
+ * SystemC kernel elaborates only once, and that also gives each point its
+ * own peak RSS. A driver pushes the jobs through submission queue 0 with
+ * INTx completion interrupts, like the guest driver.
+ *
+ * Results are checked against a reference GEMM: the device's default
+ * numerical mode is bit-exact with the naive ascending-k loop, so C must
+ * match exactly. Above VERIFY_FULL_N only VERIFY_ROWS rows per job are
+ * recomputed. Reported per point:
+ *   - simulated throughput, GFLOP/s at the model's clock
+ *   - host throughput, GFLOP/s of wall-clock time spent in sc_start()
+ *   - peak RSS of the point's process
+ *
+ * The exit status is non-zero if any point failed, so the suite can gate
+ * a release.
+ */
+
+#define BENCH_SQ_BASE 0x0
+#define BENCH_CQ_BASE 0x10000
+#define BENCH_DATA_BASE 0x100000
+#define BENCH_MAX_DEPTH 256
+#define VERIFY_FULL_N 512
+#define VERIFY_ROWS 16
+
+struct bench_point
+{
+    uint32_t n;
+    uint32_t jobs;
+    uint32_t engines;
+    bool lt;
+};
+
+// Written by the child process through a pipe
+struct bench_result
+{
+    int ok;
+    uint32_t mismatches;
+    uint32_t failed_jobs;
+    uint64_t verified;
+    uint64_t sim_ps;
+    double host_seconds;
+};
+
+static double point_gflop(const bench_point &p)
+{
+    return 2.0 * p.n * p.n * p.n * p.jobs / 1e9;
+}
+
+static uint64_t matrix_bytes(uint32_t n)
+{
+    return ((uint64_t)n * n * sizeof(float) + 4095) & ~4095ULL;
+}
+
+static uint64_t job_base(const bench_point &p, uint32_t j)
+{
+    return BENCH_DATA_BASE + 3 * matrix_bytes(p.n) * j;
+}
+
+// Flat host memory with one DMI region, sized to the point
+SC_MODULE(bench_memory)
+{
+public:
+    tlm_utils::simple_target_socket<bench_memory> target_socket;
+    vector<unsigned char> memory;
+
+    SC_CTOR(bench_memory) : target_socket("target_socket")
+    {
+        target_socket.register_b_transport(this, &bench_memory::b_transport);
+        target_socket.register_get_direct_mem_ptr(this, &bench_memory::get_direct_mem_ptr);
+    }
+
+    bool get_direct_mem_ptr(tlm::tlm_generic_payload & /*trans*/, tlm::tlm_dmi & dmi)
+    {
+        dmi.set_dmi_ptr(memory.data());
+        dmi.set_start_address(0);
+        dmi.set_end_address(memory.size() - 1);
+        dmi.allow_read_write();
+        dmi.set_read_latency(sc_time(20, SC_NS));
+        dmi.set_write_latency(sc_time(20, SC_NS));
+        return true;
+    }
+
+    void b_transport(tlm::tlm_generic_payload & trans, sc_time & delay)
+    {
+        uint64_t addr = trans.get_address();
+        unsigned int len = trans.get_data_length();
+
+        if (addr + len > memory.size())
+        {
+            trans.set_response_status(tlm::TLM_ADDRESS_ERROR_RESPONSE);
+            return;
+        }
+        if (trans.get_command() == tlm::TLM_READ_COMMAND)
+            memcpy(trans.get_data_ptr(), &memory[addr], len);
+        else if (trans.get_command() == tlm::TLM_WRITE_COMMAND)
+            memcpy(&memory[addr], trans.get_data_ptr(), len);
+
+        trans.set_dmi_allowed(true);
+        trans.set_response_status(tlm::TLM_OK_RESPONSE);
+        delay += sc_time(20, SC_NS);
+    }
+
+    float *matrix(uint64_t addr)
+    {
+        return (float *)&memory[addr];
+    }
+};
+
+SC_MODULE(bench_driver)
+{
+public:
+    tlm_utils::simple_initiator_socket<bench_driver> bar0_socket;
+    sc_in<bool> interrupt_in;
+
+    uint32_t failed_jobs = 0;
+    sc_time finished;
+
+    SC_HAS_PROCESS(bench_driver);
+
+    bench_driver(sc_module_name name, const bench_point &point, bench_memory &mem)
+        : sc_module(name), bar0_socket("bar0_socket"), interrupt_in("interrupt_in"), p(point), memory(mem)
+    {
+        SC_THREAD(run);
+    }
+
+private:
+    bench_point p;
+    bench_memory &memory;
+
+    void write_reg(uint64_t addr, uint64_t value, unsigned len = 4)
+    {
+        tlm::tlm_generic_payload trans;
+        sc_time delay = SC_ZERO_TIME;
+
+        trans.set_command(tlm::TLM_WRITE_COMMAND);
+        trans.set_address(addr);
+        trans.set_data_ptr((unsigned char *)&value);
+        trans.set_data_length(len);
+        trans.set_streaming_width(len);
+        trans.set_byte_enable_ptr(0);
+        trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+        bar0_socket->b_transport(trans, delay);
+        wait(delay);
+    }
+
+    const mm_cq_entry *cq_slot(uint32_t i)
+    {
+        return (const mm_cq_entry *)&memory.memory[BENCH_CQ_BASE + i * sizeof(mm_cq_entry)];
+    }
+
+    void run()
+    {
+        uint64_t q = REG_QUEUE_BASE;
+        uint32_t depth = min<uint32_t>(p.jobs + 1, BENCH_MAX_DEPTH);
+        uint32_t tail = 0, sq_head = 0, cq_head = 0, submitted = 0, completed = 0;
+        uint16_t phase = 1;
+
+        write_reg(q + QREG_SQ_BASE, BENCH_SQ_BASE, 8);
+        write_reg(q + QREG_CQ_BASE, BENCH_CQ_BASE, 8);
+        write_reg(q + QREG_SIZE, depth | (depth << 16));
+        write_reg(REG_INT_ENABLE, INT_CQ);
+
+        sc_time start = sc_time_stamp();
+        while (completed < p.jobs)
+        {
+            uint32_t queued = 0;
+            while (submitted < p.jobs && (tail + 1) % depth != sq_head)
+            {
+                uint64_t base = job_base(p, submitted);
+                mm_sq_entry e = {base, base + matrix_bytes(p.n), base + 2 * matrix_bytes(p.n),
+                                 p.n, (uint16_t)submitted, 0};
+                memcpy(&memory.memory[BENCH_SQ_BASE + tail * sizeof(e)], &e, sizeof(e));
+                tail = (tail + 1) % depth;
+                submitted++;
+                queued++;
+            }
+            if (queued)
+                write_reg(q + QREG_SQ_TAIL, tail);
+
+            // INT_STATUS is cleared before the CQ is checked, so a
+            // completion that lands in between is seen either way
+            while ((cq_slot(cq_head)->status & 1) != phase)
+                wait(interrupt_in.value_changed_event());
+
+            while ((cq_slot(cq_head)->status & 1) == phase)
+            {
+                const mm_cq_entry *c = cq_slot(cq_head);
+                if (c->status >> 1)
+                    failed_jobs++;
+                sq_head = c->sq_head;
+                completed++;
+                cq_head = (cq_head + 1) % depth;
+                if (cq_head == 0)
+                    phase ^= 1;
+            }
+            write_reg(q + QREG_CQ_HEAD, cq_head);
+            write_reg(REG_INT_STATUS, INT_CQ);
+        }
+
+        finished = sc_time_stamp() - start;
+        sc_stop();
+    }
+};
+
+// Deterministic operands in [-1, 1)
+static void fill_matrix(float *m, uint64_t count, uint32_t seed)
+{
+    uint32_t x = seed * 2654435761u + 1;
+    for (uint64_t i = 0; i < count; i++)
+    {
+        x = x * 1664525u + 1013904223u;
+        m[i] = (float)(int32_t)x / 2147483648.0f;
+    }
+}
+
+// Recompute rows of C in ascending k order; returns mismatching elements
+static uint32_t verify_rows(const float *a, const float *b, const float *c, uint32_t n,
+                            uint32_t row_begin, uint32_t row_step, uint64_t &verified)
+{
+    uint32_t mismatches = 0;
+    vector<float> row(n);
+
+    for (uint32_t i = row_begin; i < n; i += row_step)
+    {
+        fill(row.begin(), row.end(), 0.0f);
+        for (uint32_t k = 0; k < n; k++)
+        {
+            float aik = a[(uint64_t)i * n + k];
+            const float *brow = b + (uint64_t)k * n;
+            for (uint32_t j = 0; j < n; j++)
+                row[j] += aik * brow[j];
+        }
+        for (uint32_t j = 0; j < n; j++)
+        {
+            if (memcmp(&row[j], &c[(uint64_t)i * n + j], sizeof(float)) != 0)
+                mismatches++;
+        }
+        verified += n;
+    }
+    return mismatches;
+}
+
+// Child process: one simulation, result through the pipe
+static bench_result run_point(const bench_point &p)
+{
+    bench_result r = bench_result();
+
+    if (!getenv("MM_LOG_LEVEL"))
+        mm_log::set_level(MM_LOG_WARN);
+
+    matrix_multiplier_pcie device("matrix_device");
+    bench_memory memory("bench_memory");
+    bench_driver driver("bench_driver", p, memory);
+    sc_signal<bool> irq;
+
+    driver.bar0_socket.bind(device.bar0_target_socket);
+    device.dma_initiator_socket.bind(memory.target_socket);
+    device.interrupt(irq);
+    driver.interrupt_in(irq);
+
+    device.set_engine_count(p.engines);
+    if (p.lt)
+        device.set_timing_mode(TIMING_LT);
+    if (const char *link = getenv("MM_PCIE_LINK"))
+    {
+        pcie_link_config link_cfg;
+        if (pcie_link_config::parse(link, link_cfg))
+            device.set_link_config(link_cfg);
+    }
+    if (const char *tags = getenv("MM_DMA_TAGS"))
+        device.set_dma_tags(atoi(tags));
+
+    memory.memory.resize(job_base(p, p.jobs));
+    uint64_t elems = (uint64_t)p.n * p.n;
+    for (uint32_t j = 0; j < p.jobs; j++)
+    {
+        fill_matrix(memory.matrix(job_base(p, j)), elems, 2 * j);
+        fill_matrix(memory.matrix(job_base(p, j) + matrix_bytes(p.n)), elems, 2 * j + 1);
+    }
+
+    auto wall_start = chrono::steady_clock::now();
+    sc_start();
+    r.host_seconds = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count();
+    r.sim_ps = (uint64_t)(driver.finished.to_seconds() * 1e12 + 0.5);
+    r.failed_jobs = driver.failed_jobs;
+
+    uint32_t step = p.n <= VERIFY_FULL_N ? 1 : max<uint32_t>(1, p.n / VERIFY_ROWS);
+    for (uint32_t j = 0; j < p.jobs; j++)
+    {
+        uint64_t base = job_base(p, j);
+        r.mismatches += verify_rows(memory.matrix(base), memory.matrix(base + matrix_bytes(p.n)),
+                                    memory.matrix(base + 2 * matrix_bytes(p.n)), p.n, j % step, step,
+                                    r.verified);
+    }
+
+    r.ok = r.mismatches == 0 && r.failed_jobs == 0 && r.sim_ps > 0;
+    mm_log::flush();
+    return r;
+}
+
+static vector<uint32_t> parse_list(const string &s)
+{
+    vector<uint32_t> v;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ','))
+    {
+        if (!item.empty())
+            v.push_back(strtoul(item.c_str(), nullptr, 0));
+    }
+    return v;
+}
+
+static bool option(const char *arg, const char *name, string &value)
+{
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=')
+        return false;
+    value = arg + len + 1;
+    return true;
+}
+
+int sc_main(int argc, char *argv[])
+{
+    vector<uint32_t> sizes = {4, 16, 64, 256, 1024, 4096};
+    vector<uint32_t> job_counts = {1, 16};
+    vector<uint32_t> engine_counts = {1, 4};
+    vector<bool> timings = {false, true};
+    double max_gflop = 200;
+    string csv_path, json_path;
+
+    for (int i = 1; i < argc; i++)
+    {
+        string v;
+        if (option(argv[i], "--sizes", v))
+            sizes = parse_list(v);
+        else if (option(argv[i], "--jobs", v))
+            job_counts = parse_list(v);
+        else if (option(argv[i], "--engines", v))
+            engine_counts = parse_list(v);
+        else if (option(argv[i], "--timing", v))
+        {
+            timings.clear();
+            if (v.find("at") != string::npos)
+                timings.push_back(false);
+            if (v.find("lt") != string::npos)
+                timings.push_back(true);
+        }
+        else if (option(argv[i], "--max-gflop", v))
+            max_gflop = atof(v.c_str());
+        else if (option(argv[i], "--csv", v))
+            csv_path = v;
+        else if (option(argv[i], "--json", v))
+            json_path = v;
+        else
+        {
+            cerr << "Usage: " << argv[0] << " [--sizes=4,16,...] [--jobs=1,16] [--engines=1,4]"
+                 << " [--timing=at,lt] [--max-gflop=200] [--csv=FILE] [--json=FILE]" << endl;
+            return 1;
+        }
+    }
+
+    vector<bench_point> points;
+    for (uint32_t n : sizes)
+        for (uint32_t jobs : job_counts)
+            for (uint32_t engines : engine_counts)
+                for (bool lt : timings)
+                {
+                    bench_point p = {n, jobs, engines, lt};
+                    if (n == 0 || n > MAX_DIM_N || jobs == 0 || engines == 0 || point_gflop(p) > max_gflop)
+                        continue;
+                    points.push_back(p);
+                }
+
+    ostringstream csv, json;
+    csv << "n,jobs,engines,timing,status,sim_ns,sim_gflops,host_s,host_gflops,peak_rss_kb,verified,mismatches\n";
+    json << "[";
+    int failures = 0;
+
+    printf("%6s %5s %7s %6s %6s %14s %10s %10s %10s %10s\n", "N", "jobs", "engines", "timing", "status",
+           "sim time ns", "sim GF/s", "host s", "host GF/s", "RSS MB");
+
+    // The parent never elaborates; it only forks, collects and reports
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        const bench_point &p = points[i];
+        bench_result r = bench_result();
+        struct rusage usage;
+        memset(&usage, 0, sizeof(usage));
+        int fds[2];
+
+        fflush(stdout);
+        if (pipe(fds) != 0)
+        {
+            perror("pipe");
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            close(fds[0]);
+            bench_result child = run_point(p);
+            ssize_t n = write(fds[1], &child, sizeof(child));
+            _exit(n == (ssize_t)sizeof(child) ? 0 : 1);
+        }
+        close(fds[1]);
+        bool got = pid > 0 && read(fds[0], &r, sizeof(r)) == (ssize_t)sizeof(r);
+        close(fds[0]);
+        int status = 0;
+        if (pid > 0)
+            wait4(pid, &status, 0, &usage);
+        if (!got)
+            r.ok = 0;
+
+        double flop = point_gflop(p) * 1e9;
+        double sim_ns = r.sim_ps / 1e3;
+        double sim_gflops = sim_ns > 0 ? flop / sim_ns : 0.0;
+        double host_gflops = r.host_seconds > 0 ? flop / r.host_seconds / 1e9 : 0.0;
+        const char *timing = p.lt ? "lt" : "at";
+        const char *verdict = !got ? "crash" : r.ok ? "ok" : "FAIL";
+        if (!r.ok)
+            failures++;
+
+        printf("%6u %5u %7u %6s %6s %14.0f %10.3f %10.3f %10.3f %10.1f\n", p.n, p.jobs, p.engines, timing,
+               verdict, sim_ns, sim_gflops, r.host_seconds, host_gflops, usage.ru_maxrss / 1024.0);
+
+        csv << p.n << "," << p.jobs << "," << p.engines << "," << timing << "," << verdict << ","
+            << (uint64_t)sim_ns << "," << sim_gflops << "," << r.host_seconds << "," << host_gflops << ","
+            << usage.ru_maxrss << "," << r.verified << "," << r.mismatches << "\n";
+        json << (i ? ",\n " : "\n ") << "{\"n\": " << p.n << ", \"jobs\": " << p.jobs
+             << ", \"engines\": " << p.engines << ", \"timing\": \"" << timing << "\", \"status\": \""
+             << verdict << "\", \"sim_ns\": " << (uint64_t)sim_ns << ", \"sim_gflops\": " << sim_gflops
+             << ", \"host_s\": " << r.host_seconds << ", \"host_gflops\": " << host_gflops
+             << ", \"peak_rss_kb\": " << usage.ru_maxrss << ", \"verified\": " << r.verified
+             << ", \"mismatches\": " << r.mismatches << "}";
+    }
+    json << "\n]\n";
+
+    if (!csv_path.empty())
+        ofstream(csv_path) << csv.str();
+    if (!json_path.empty())
+        ofstream(json_path) << json.str();
+
+    printf("%zu points, %d failed\n", points.size(), failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,354 @@
+#ifndef GEMM_KERNEL_H
+#define GEMM_KERNEL_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_HAVE_X86 1
+#endif
+
+/**
+ * Host-side GEMM kernels used by the matrix multiplier model.
+ *
+ * All kernels compute C[M x N] += A[M x K] * B[K x N] on row-major float
+ * matrices with explicit leading dimensions, so callers can run them on
+ * whole matrices or on sub-blocks of larger buffers.
+ *
+ * Two numerical modes are offered:
+ *   GEMM_MODE_REFERENCE - every C element is accumulated in ascending k
+ *                         order with a separately rounded multiply and add,
+ *                         which is bit-exact with the naive i-j-k loop
+ *                         (sum starting at 0.0f) the model used to run.
+ *   GEMM_MODE_FAST      - same blocking, but uses fused multiply-add where
+ *                         the host supports it. Results may differ from the
+ *                         reference in the last bits.
+ *
+ * The instruction set is picked once at runtime from the host CPU and can
+ * be forced with MM_GEMM_ISA=scalar|avx2|avx512 for debugging.
+ */
+
+enum gemm_mode
+{
+    GEMM_MODE_REFERENCE = 0,
+    GEMM_MODE_FAST = 1
+};
+
+enum gemm_isa
+{
+    GEMM_ISA_SCALAR = 0,
+    GEMM_ISA_AVX2 = 1,
+    GEMM_ISA_AVX512 = 2
+};
+
+// Cache blocking: a KC x NC panel of B (256 KB) stays in L2 while MC rows
+// of A stream through it.
+#define GEMM_BLOCK_M 64
+#define GEMM_BLOCK_N 256
+#define GEMM_BLOCK_K 256
+
+inline const char *gemm_isa_name(gemm_isa isa)
+{
+    switch (isa)
+    {
+    case GEMM_ISA_AVX512:
+        return "avx512";
+    case GEMM_ISA_AVX2:
+        return "avx2";
+    default:
+        return "scalar";
+    }
+}
+
+inline gemm_isa gemm_detect_isa()
+{
+    gemm_isa isa = GEMM_ISA_SCALAR;
+
+#ifdef GEMM_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        isa = GEMM_ISA_AVX2;
+    if (isa == GEMM_ISA_AVX2 && __builtin_cpu_supports("avx512f"))
+        isa = GEMM_ISA_AVX512;
+#endif
+
+    const char *env = getenv("MM_GEMM_ISA");
+    if (env)
+    {
+        gemm_isa wanted = isa;
+        if (strcmp(env, "scalar") == 0)
+            wanted = GEMM_ISA_SCALAR;
+        else if (strcmp(env, "avx2") == 0)
+            wanted = GEMM_ISA_AVX2;
+        else if (strcmp(env, "avx512") == 0)
+            wanted = GEMM_ISA_AVX512;
+        // Never go above what the host can execute
+        if (wanted < isa)
+            isa = wanted;
+    }
+
+    return isa;
+}
+
+inline gemm_isa gemm_host_isa()
+{
+    static const gemm_isa isa = gemm_detect_isa();
+    return isa;
+}
+
+/* ----------------------------------------------------------------------------
+ * Scalar kernel
+ *
+ * i-k-j order: B and C are walked row-wise and every C element still sees
+ * its k terms in ascending order, so this is also the reference kernel.
+ * -------------------------------------------------------------------------- */
+inline void gemm_block_scalar(uint32_t m, uint32_t n, uint32_t k,
+                              const float *a, uint32_t lda,
+                              const float *b, uint32_t ldb,
+                              float *c, uint32_t ldc)
+{
+    for (uint32_t i = 0; i < m; i++)
+    {
+        float *c_row = c + (size_t)i * ldc;
+        for (uint32_t p = 0; p < k; p++)
+        {
+            const float a_ip = a[(size_t)i * lda + p];
+            const float *b_row = b + (size_t)p * ldb;
+            for (uint32_t j = 0; j < n; j++)
+            {
+                float prod = a_ip * b_row[j];
+                c_row[j] = c_row[j] + prod;
+            }
+        }
+    }
+}
+
+// Column tail shared by the SIMD kernels: per element, ascending k.
+inline void gemm_tail_scalar(uint32_t m, uint32_t j0, uint32_t n, uint32_t k,
+                             const float *a, uint32_t lda,
+                             const float *b, uint32_t ldb,
+                             float *c, uint32_t ldc)
+{
+    for (uint32_t i = 0; i < m; i++)
+    {
+        for (uint32_t j = j0; j < n; j++)
+        {
+            float sum = c[(size_t)i * ldc + j];
+            for (uint32_t p = 0; p < k; p++)
+            {
+                float prod = a[(size_t)i * lda + p] * b[(size_t)p * ldb + j];
+                sum = sum + prod;
+            }
+            c[(size_t)i * ldc + j] = sum;
+        }
+    }
+}
+
+#ifdef GEMM_HAVE_X86
+
+/* ----------------------------------------------------------------------------
+ * AVX2 kernels: R x 16 register tile (2 ymm per row)
+ *
+ * The reference variant is compiled without FMA so the compiler cannot fuse
+ * the multiply and add behind our back.
+ * -------------------------------------------------------------------------- */
+template <int R>
+__attribute__((target("avx2"))) inline void gemm_tile_avx2_ref(uint32_t k,
+                                                                 const float *a, uint32_t lda,
+                                                                 const float *b, uint32_t ldb,
+                                                                 float *c, uint32_t ldc)
+{
+    __m256 acc[R][2];
+    for (int r = 0; r < R; r++)
+    {
+        acc[r][0] = _mm256_loadu_ps(c + (size_t)r * ldc);
+        acc[r][1] = _mm256_loadu_ps(c + (size_t)r * ldc + 8);
+    }
+    for (uint32_t p = 0; p < k; p++)
+    {
+        __m256 b0 = _mm256_loadu_ps(b + (size_t)p * ldb);
+        __m256 b1 = _mm256_loadu_ps(b + (size_t)p * ldb + 8);
+        for (int r = 0; r < R; r++)
+        {
+            __m256 av = _mm256_broadcast_ss(a + (size_t)r * lda + p);
+            acc[r][0] = _mm256_add_ps(acc[r][0], _mm256_mul_ps(av, b0));
+            acc[r][1] = _mm256_add_ps(acc[r][1], _mm256_mul_ps(av, b1));
+        }
+    }
+    for (int r = 0; r < R; r++)
+    {
+        _mm256_storeu_ps(c + (size_t)r * ldc, acc[r][0]);
+        _mm256_storeu_ps(c + (size_t)r * ldc + 8, acc[r][1]);
+    }
+}
+
+template <int R>
+__attribute__((target("avx2,fma"))) inline void gemm_tile_avx2_fast(uint32_t k,
+                                                                      const float *a, uint32_t lda,
+                                                                      const float *b, uint32_t ldb,
+                                                                      float *c, uint32_t ldc)
+{
+    __m256 acc[R][2];
+    for (int r = 0; r < R; r++)
+    {
+        acc[r][0] = _mm256_loadu_ps(c + (size_t)r * ldc);
+        acc[r][1] = _mm256_loadu_ps(c + (size_t)r * ldc + 8);
+    }
+    for (uint32_t p = 0; p < k; p++)
+    {
+        __m256 b0 = _mm256_loadu_ps(b + (size_t)p * ldb);
+        __m256 b1 = _mm256_loadu_ps(b + (size_t)p * ldb + 8);
+        for (int r = 0; r < R; r++)
+        {
+            __m256 av = _mm256_broadcast_ss(a + (size_t)r * lda + p);
+            acc[r][0] = _mm256_fmadd_ps(av, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(av, b1, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < R; r++)
+    {
+        _mm256_storeu_ps(c + (size_t)r * ldc, acc[r][0]);
+        _mm256_storeu_ps(c + (size_t)r * ldc + 8, acc[r][1]);
+    }
+}
+
+template <int R>
+inline void gemm_rows_avx2(gemm_mode mode, uint32_t n, uint32_t k,
+                           const float *a, uint32_t lda,
+                           const float *b, uint32_t ldb,
+                           float *c, uint32_t ldc)
+{
+    uint32_t j = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        if (mode == GEMM_MODE_FAST)
+            gemm_tile_avx2_fast<R>(k, a, lda, b + j, ldb, c + j, ldc);
+        else
+            gemm_tile_avx2_ref<R>(k, a, lda, b + j, ldb, c + j, ldc);
+    }
+    if (j < n)
+        gemm_tail_scalar(R, j, n, k, a, lda, b, ldb, c, ldc);
+}
+
+inline void gemm_block_avx2(gemm_mode mode, uint32_t m, uint32_t n, uint32_t k,
+                            const float *a, uint32_t lda,
+                            const float *b, uint32_t ldb,
+                            float *c, uint32_t ldc)
+{
+    uint32_t i = 0;
+    for (; i + 4 <= m; i += 4)
+        gemm_rows_avx2<4>(mode, n, k, a + (size_t)i * lda, lda, b, ldb, c + (size_t)i * ldc, ldc);
+    for (; i < m; i++)
+        gemm_rows_avx2<1>(mode, n, k, a + (size_t)i * lda, lda, b, ldb, c + (size_t)i * ldc, ldc);
+}
+
+/* ----------------------------------------------------------------------------
+ * AVX-512 kernel: 4 x 32 register tile (2 zmm per row), fast mode only.
+ * AVX-512F carries its own FMA forms, so reference mode stays on AVX2.
+ * -------------------------------------------------------------------------- */
+template <int R>
+__attribute__((target("avx512f"))) inline void gemm_tile_avx512_fast(uint32_t k,
+                                                                       const float *a, uint32_t lda,
+                                                                       const float *b, uint32_t ldb,
+                                                                       float *c, uint32_t ldc)
+{
+    __m512 acc[R][2];
+    for (int r = 0; r < R; r++)
+    {
+        acc[r][0] = _mm512_loadu_ps(c + (size_t)r * ldc);
+        acc[r][1] = _mm512_loadu_ps(c + (size_t)r * ldc + 16);
+    }
+    for (uint32_t p = 0; p < k; p++)
+    {
+        __m512 b0 = _mm512_loadu_ps(b + (size_t)p * ldb);
+        __m512 b1 = _mm512_loadu_ps(b + (size_t)p * ldb + 16);
+        for (int r = 0; r < R; r++)
+        {
+            __m512 av = _mm512_set1_ps(a[(size_t)r * lda + p]);
+            acc[r][0] = _mm512_fmadd_ps(av, b0, acc[r][0]);
+            acc[r][1] = _mm512_fmadd_ps(av, b1, acc[r][1]);
+        }
+    }
+    for (int r = 0; r < R; r++)
+    {
+        _mm512_storeu_ps(c + (size_t)r * ldc, acc[r][0]);
+        _mm512_storeu_ps(c + (size_t)r * ldc + 16, acc[r][1]);
+    }
+}
+
+template <int R>
+inline void gemm_rows_avx512(uint32_t n, uint32_t k,
+                             const float *a, uint32_t lda,
+                             const float *b, uint32_t ldb,
+                             float *c, uint32_t ldc)
+{
+    uint32_t j = 0;
+    for (; j + 32 <= n; j += 32)
+        gemm_tile_avx512_fast<R>(k, a, lda, b + j, ldb, c + j, ldc);
+    for (; j + 16 <= n; j += 16)
+        gemm_tile_avx2_fast<R>(k, a, lda, b + j, ldb, c + j, ldc);
+    if (j < n)
+        gemm_tail_scalar(R, j, n, k, a, lda, b, ldb, c, ldc);
+}
+
+inline void gemm_block_avx512(uint32_t m, uint32_t n, uint32_t k,
+                              const float *a, uint32_t lda,
+                              const float *b, uint32_t ldb,
+                              float *c, uint32_t ldc)
+{
+    uint32_t i = 0;
+    for (; i + 4 <= m; i += 4)
+        gemm_rows_avx512<4>(n, k, a + (size_t)i * lda, lda, b, ldb, c + (size_t)i * ldc, ldc);
+    for (; i < m; i++)
+        gemm_rows_avx512<1>(n, k, a + (size_t)i * lda, lda, b, ldb, c + (size_t)i * ldc, ldc);
+}
+
+#endif // GEMM_HAVE_X86
+
+/**
+ * C[M x N] += A[M x K] * B[K x N]
+ *
+ * The k blocks are visited in ascending order for every C tile, so the
+ * blocking never changes the accumulation order in reference mode.
+ */
+inline void gemm_accumulate(gemm_mode mode, uint32_t m, uint32_t n, uint32_t k,
+                            const float *a, uint32_t lda,
+                            const float *b, uint32_t ldb,
+                            float *c, uint32_t ldc)
+{
+    gemm_isa isa = gemm_host_isa();
+
+    for (uint32_t k0 = 0; k0 < k; k0 += GEMM_BLOCK_K)
+    {
+        uint32_t kb = (k - k0 < GEMM_BLOCK_K) ? k - k0 : GEMM_BLOCK_K;
+        for (uint32_t j0 = 0; j0 < n; j0 += GEMM_BLOCK_N)
+        {
+            uint32_t nb = (n - j0 < GEMM_BLOCK_N) ? n - j0 : GEMM_BLOCK_N;
+            for (uint32_t i0 = 0; i0 < m; i0 += GEMM_BLOCK_M)
+            {
+                uint32_t mb = (m - i0 < GEMM_BLOCK_M) ? m - i0 : GEMM_BLOCK_M;
+                const float *a_blk = a + (size_t)i0 * lda + k0;
+                const float *b_blk = b + (size_t)k0 * ldb + j0;
+                float *c_blk = c + (size_t)i0 * ldc + j0;
+
+#ifdef GEMM_HAVE_X86
+                if (isa == GEMM_ISA_AVX512 && mode == GEMM_MODE_FAST)
+                {
+                    gemm_block_avx512(mb, nb, kb, a_blk, lda, b_blk, ldb, c_blk, ldc);
+                    continue;
+                }
+                if (isa >= GEMM_ISA_AVX2)
+                {
+                    gemm_block_avx2(mode, mb, nb, kb, a_blk, lda, b_blk, ldb, c_blk, ldc);
+                    continue;
+                }
+#endif
+                gemm_block_scalar(mb, nb, kb, a_blk, lda, b_blk, ldb, c_blk, ldc);
+            }
+        }
+    }
+}
+
+#endif // GEMM_KERNEL_H
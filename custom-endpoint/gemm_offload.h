@@ -0,0 +1,206 @@
+#ifndef GEMM_OFFLOAD_H
+#define GEMM_OFFLOAD_H
+
+#include <systemc>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "gemm_kernel.h"
+
+using namespace sc_core;
+
+/**
+ * Host-side parallel GEMM for the matrix multiplier model.
+ *
+ * gemm_thread_pool runs kernel calls on plain host threads, outside the
+ * SystemC kernel. gemm_offload lets an SC_THREAD hand one C += A * B to
+ * the pool, split into output row blocks, and keep simulated time moving
+ * while the host computes. Completion comes back through
+ * async_request_update(), the only thread-safe way into the kernel.
+ *
+ * Row blocks write disjoint rows of C and every element still sees its k
+ * terms in the same order, so results are bit-identical to a single
+ * gemm_accumulate() call.
+ */
+
+// Below this many multiply-adds the call runs inline; a hand-off costs more
+#define GEMM_OFFLOAD_MIN_WORK (32 * 32 * 32)
+
+// Row blocks are multiples of the 4-row SIMD register tile
+#define GEMM_OFFLOAD_ROW_ALIGN 4
+
+class gemm_thread_pool
+{
+public:
+    explicit gemm_thread_pool(unsigned threads) : stopping(false)
+    {
+        for (unsigned i = 0; i < threads; i++)
+            workers.push_back(std::thread(&gemm_thread_pool::worker, this));
+    }
+
+    ~gemm_thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    unsigned size() const
+    {
+        return (unsigned)workers.size();
+    }
+
+    void submit(const std::function<void()> &task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            tasks.push_back(task);
+        }
+        cv.notify_one();
+    }
+
+private:
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping;
+
+    void worker()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                if (tasks.empty())
+                    return;
+                task = tasks.front();
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+};
+
+/**
+ * One outstanding offloaded GEMM per instance (one per compute engine).
+ *
+ * start() submits the row blocks and returns; the caller then lets the
+ * simulated datapath time pass and calls finish(), which only waits for
+ * the host, so the simulated time of a job is the same whether the host
+ * was fast or slow. If the host is still busy, the kernel is held at the
+ * current time with sc_suspend_all(): delta cycles and other async events
+ * (remote-port traffic) are still serviced, but no process can move time
+ * forward past the job's end.
+ */
+class gemm_offload : public sc_prim_channel
+{
+public:
+    explicit gemm_offload(const char *name)
+        : sc_prim_channel(name), pool(nullptr), blocks_left(0), in_flight(false), offloads(0), host_waits(0)
+    {
+    }
+
+    // nullptr or a one-thread pool runs everything inline
+    void set_pool(gemm_thread_pool *p)
+    {
+        pool = p;
+    }
+
+    /**
+     * Begin C[M x N] += A[M x K] * B[K x N]. Small calls and calls without
+     * a pool complete before this returns. The buffers must stay untouched
+     * until finish().
+     */
+    void start(gemm_mode mode, uint32_t m, uint32_t n, uint32_t k,
+               const float *a, uint32_t lda,
+               const float *b, uint32_t ldb,
+               float *c, uint32_t ldc)
+    {
+        if (!pool || pool->size() < 2 || (uint64_t)m * n * k < GEMM_OFFLOAD_MIN_WORK)
+        {
+            gemm_accumulate(mode, m, n, k, a, lda, b, ldb, c, ldc);
+            return;
+        }
+
+        uint32_t rows = (m + pool->size() - 1) / pool->size();
+        rows = (rows + GEMM_OFFLOAD_ROW_ALIGN - 1) / GEMM_OFFLOAD_ROW_ALIGN * GEMM_OFFLOAD_ROW_ALIGN;
+
+        blocks_left = (m + rows - 1) / rows;
+        in_flight = true;
+        offloads++;
+        async_attach_suspending();
+
+        for (uint32_t i0 = 0; i0 < m; i0 += rows)
+        {
+            uint32_t mb = std::min(rows, m - i0);
+            const float *a_blk = a + (size_t)i0 * lda;
+            float *c_blk = c + (size_t)i0 * ldc;
+
+            pool->submit([=]() {
+                gemm_accumulate(mode, mb, n, k, a_blk, lda, b, ldb, c_blk, ldc);
+                if (--blocks_left == 0)
+                    async_request_update();
+            });
+        }
+    }
+
+    // Wait, without advancing simulated time, until the started call is done
+    void finish()
+    {
+        if (!in_flight)
+            return;
+
+        if (blocks_left)
+        {
+            host_waits++;
+            sc_suspend_all();
+            while (blocks_left)
+                wait(done_event);
+            sc_unsuspend_all();
+        }
+
+        in_flight = false;
+        async_detach_suspending();
+    }
+
+    // Calls handed to the pool, and how many outlasted their simulated time
+    uint64_t offload_count() const
+    {
+        return offloads;
+    }
+
+    uint64_t host_wait_count() const
+    {
+        return host_waits;
+    }
+
+private:
+    gemm_thread_pool *pool;
+    std::atomic<unsigned> blocks_left;
+    bool in_flight;
+    sc_event done_event;
+    uint64_t offloads;
+    uint64_t host_waits;
+
+    // Runs in the kernel's update phase after the last block finished
+    void update()
+    {
+        done_event.notify(SC_ZERO_TIME);
+    }
+};
+
+#endif // GEMM_OFFLOAD_H
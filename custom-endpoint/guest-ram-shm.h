@@ -0,0 +1,141 @@
+#ifndef GUEST_RAM_SHM_H
+#define GUEST_RAM_SHM_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * GuestRamShm - QEMU guest RAM mapped into the SystemC process
+ *
+ * QEMU started with a shared file-backed RAM object, e.g.
+ *
+ *   -object memory-backend-file,id=ram,size=1G,mem-path=/dev/shm/qemu-ram,share=on
+ *   -machine q35,memory-backend=ram
+ *
+ * exposes all of guest RAM through that file. Mapping it here lets device
+ * DMA copy straight into guest memory instead of sending the payload over
+ * the remote-port socket.
+ *
+ * The file holds RAM in order, but the guest sees it as two windows: the
+ * first lowmem bytes at guest-physical 0 and the rest at 4 GiB, above the
+ * PCI hole. Addresses outside both windows (MSI, peer MMIO) are not RAM
+ * and must still go through QEMU.
+ */
+class GuestRamShm
+{
+public:
+    static const uint64_t HIGHMEM_BASE = 0x100000000ULL;
+
+    GuestRamShm() : base(nullptr), size(0), lowmem(0) {}
+
+    ~GuestRamShm()
+    {
+        unmap();
+    }
+
+    /**
+     * Map path read/write and shared. lowmem is the size of the window below
+     * 4 GiB (0 = the whole file, for guests small enough to fit under the
+     * PCI hole). Returns false if the file cannot be mapped.
+     */
+    bool map(const std::string &path, uint64_t lowmem_bytes)
+    {
+        unmap();
+
+        int fd = open(path.c_str(), O_RDWR);
+        if (fd < 0)
+        {
+            std::cerr << "GuestRamShm: cannot open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0)
+        {
+            std::cerr << "GuestRamShm: " << path << " is empty or unreadable" << std::endl;
+            close(fd);
+            return false;
+        }
+
+        void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            std::cerr << "GuestRamShm: mmap of " << path << " failed: " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        base = (unsigned char *)p;
+        size = st.st_size;
+        lowmem = (lowmem_bytes && lowmem_bytes < size) ? lowmem_bytes : size;
+        return true;
+    }
+
+    void unmap()
+    {
+        if (base)
+            munmap(base, size);
+        base = nullptr;
+        size = 0;
+        lowmem = 0;
+    }
+
+    bool mapped() const
+    {
+        return base != nullptr;
+    }
+
+    uint64_t ram_size() const
+    {
+        return size;
+    }
+
+    /**
+     * Host pointer for guest-physical [addr, addr + len), or nullptr if the
+     * range is not entirely inside one RAM window. *window_start and
+     * *window_end (inclusive) receive the guest-physical bounds of that
+     * window, for DMI grants.
+     */
+    unsigned char *translate(uint64_t addr, uint64_t len,
+                             uint64_t *window_start = nullptr, uint64_t *window_end = nullptr) const
+    {
+        if (!base)
+            return nullptr;
+
+        if (addr < lowmem && len <= lowmem - addr)
+        {
+            if (window_start)
+                *window_start = 0;
+            if (window_end)
+                *window_end = lowmem - 1;
+            return base + addr;
+        }
+
+        uint64_t high = size - lowmem;
+        if (addr >= HIGHMEM_BASE && addr - HIGHMEM_BASE < high && len <= high - (addr - HIGHMEM_BASE))
+        {
+            if (window_start)
+                *window_start = HIGHMEM_BASE;
+            if (window_end)
+                *window_end = HIGHMEM_BASE + high - 1;
+            return base + lowmem + (addr - HIGHMEM_BASE);
+        }
+
+        return nullptr;
+    }
+
+private:
+    unsigned char *base;
+    uint64_t size;
+    uint64_t lowmem;
+};
+
+#endif // GUEST_RAM_SHM_H
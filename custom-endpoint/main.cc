@@ -29,6 +29,8 @@ using namespace std;
 #include "remote-port-tlm-memory-master.h"
 #include "remote-port-tlm-memory-slave.h"
 
+#include "mm_log.h"
+
 // Xilinx PCIe Controller
 #include "pcie-controller.h"
 
@@ -320,18 +322,18 @@ SC_MODULE(TrafficMonitor)
         uint32_t len = trans.get_data_length();
         bool is_read = trans.is_read();
 
-        printf("\n[MONITOR] %s | Addr: 0x%lx | Len: %u bytes\n",
-               is_read ? "READ " : "WRITE", addr, len);
+        MM_VERBOSE("[MONITOR] " << (is_read ? "READ " : "WRITE") << " | Addr: 0x" << hex << addr
+                 << " | Len: " << dec << len << " bytes");
 
         // Pass the transaction through to the actual DummyTarget
         init_socket->b_transport(trans, delay);
 
-        if (is_read && trans.get_response_status() == tlm::TLM_OK_RESPONSE)
+        if (is_read && trans.get_response_status() == tlm::TLM_OK_RESPONSE && MM_LOG_ON(MM_LOG_TRACE))
         {
             uint32_t val = 0;
             if (len <= 4)
                 memcpy(&val, trans.get_data_ptr(), len);
-            printf("[MONITOR] Response Data: 0x%x\n", val);
+            MM_VERBOSE("[MONITOR] Response Data: 0x" << hex << val);
         }
     }
 };
@@ -356,11 +358,14 @@ SC_MODULE(DummyTarget)
         else
         {
             // Log the data written by QEMU
-            unsigned char *ptr = trans.get_data_ptr();
-            printf("SystemC: Data received: 0x");
-            for (int i = 0; i < trans.get_data_length(); i++)
-                printf("%02x", ptr[i]);
-            printf("\n");
+            if (MM_LOG_ON(MM_LOG_DEBUG))
+            {
+                unsigned char *ptr = trans.get_data_ptr();
+                ostringstream bytes;
+                for (int i = 0; i < trans.get_data_length(); i++)
+                    bytes << hex << setw(2) << setfill('0') << (unsigned)ptr[i];
+                MM_DEBUG("SystemC: Data received: 0x" << bytes.str());
+            }
             trans.set_response_status(tlm::TLM_OK_RESPONSE);
         }
     }
@@ -402,6 +407,7 @@ int sc_main(int argc, char *argv[])
     sc_start(SC_ZERO_TIME);
     rst.write(false);
 
+    mm_log::flush();
     printf("Waiting for QEMU connection on %s...\n", sk_descr);
 
     // Start simulation.
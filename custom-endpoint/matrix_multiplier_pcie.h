@@ -5,6 +5,19 @@
 #include <tlm>
 #include <tlm_utils/simple_target_socket.h>
 #include <tlm_utils/simple_initiator_socket.h>
+#include <tlm_utils/tlm_quantumkeeper.h>
+#include <algorithm>
+#include <deque>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <string>
+#include "gemm_kernel.h"
+#include "gemm_offload.h"
+#include "mm_checkpoint.h"
+#include "mm_log.h"
+#include "mm_profile.h"
+#include "pcie_link_model.h"
 
 using namespace sc_core;
 using namespace sc_dt;
@@ -19,6 +32,21 @@ using namespace std;
 #define REG_MATRIX_C_PTR 0x0020
 #define REG_INT_STATUS 0x0028
 #define REG_INT_ENABLE 0x002C
+#define REG_MSIX_CTRL 0x0030
+#define REG_INT_COALESCE 0x0034
+#define REG_SCHED_POLICY 0x0038
+#define REG_ENGINE_COUNT 0x003C
+
+// Submission/completion queue pairs (NVMe-style), one 0x20 block per queue
+#define MM_NUM_QUEUES 4
+#define REG_QUEUE_BASE 0x0100
+#define REG_QUEUE_STRIDE 0x0020
+#define QREG_SQ_BASE 0x00 // SQ ring address in host memory (R/W, 64-bit)
+#define QREG_CQ_BASE 0x08 // CQ ring address in host memory (R/W, 64-bit)
+#define QREG_SIZE 0x10    // [15:0] SQ entries, [31:16] CQ entries, 0 = disabled (R/W)
+#define QREG_SQ_TAIL 0x14 // SQ tail doorbell (R/W)
+#define QREG_CQ_HEAD 0x18 // CQ head doorbell (R/W)
+#define QREG_SQ_HEAD 0x1C // SQ entries consumed by the device (R)
 
 // Control Register Bits
 #define CTRL_START (1 << 0)
@@ -32,6 +60,209 @@ using namespace std;
 
 // Interrupt Bits
 #define INT_DONE (1 << 0)
+#define INT_CQ (1 << 1)
+#define INT_ERROR (1 << 2)
+
+// MSI-X Control Register Bits (mirror of the capability's Enable / Function Mask)
+#define MSIX_CTRL_ENABLE (1 << 0)
+#define MSIX_CTRL_MASK_ALL (1 << 1)
+
+// Interrupt Coalescing Register: [15:0] completions per interrupt (0/1 = off),
+// [31:16] aggregation time in 100 ns units (0 = until the queue drains)
+#define COAL_THRESHOLD_MASK 0xFFFF
+#define COAL_TIMER_SHIFT 16
+#define COAL_TIMER_UNIT_NS 100
+
+// MSI-X table and PBA, BIR 0: one vector per completion queue plus one
+// for register-interface completion and errors
+#define MM_MSIX_VECTORS (MM_NUM_QUEUES + 1)
+#define MSIX_VEC_MISC MM_NUM_QUEUES
+#define REG_MSIX_TABLE 0x1000
+#define REG_MSIX_PBA 0x2000
+#define MSIX_ENTRY_SIZE 16
+#define REG_MSIX_TABLE_END (REG_MSIX_TABLE + MM_MSIX_VECTORS * MSIX_ENTRY_SIZE)
+#define MSIX_ENTRY_ADDR_LO 0x0
+#define MSIX_ENTRY_ADDR_HI 0x4
+#define MSIX_ENTRY_DATA 0x8
+#define MSIX_ENTRY_VECTOR_CTRL 0xC
+#define MSIX_VECTOR_MASKED (1 << 0)
+
+// Completion status codes (CQ entry status[15:1])
+#define CQ_STATUS_SUCCESS 0
+#define CQ_STATUS_INVALID_DIM 1
+#define CQ_STATUS_DMA_ERROR 2
+#define CQ_STATUS_NO_BUFFER 3
+
+// Descriptors fetched with one DMA read; also the depth of the job scheduler
+#define MAX_SQ_FETCH 64
+
+// Compute engines, each with one counter block (all read-only)
+#define MAX_ENGINES 16
+#define REG_ENGINE_BASE 0x0200
+#define REG_ENGINE_STRIDE 0x0010
+#define EREG_BUSY_TIME 0x00 // ns spent on jobs since reset (64-bit)
+#define EREG_JOBS 0x08      // jobs completed since reset
+#define EREG_UTIL 0x0C      // busy time over time since reset, in 1/1000
+
+// Device-wide performance counters (read-only, 64-bit, free-running since
+// the last clear). Writing PERF_SNAPSHOT to PREG_CTRL latches all of them
+// at once and reads return the latched values, so one set is consistent.
+#define REG_PERF_BASE 0x0400
+#define REG_PERF_SIZE 0x0050
+#define PREG_CTRL 0x00          // snapshot/clear control (W)
+#define PREG_ELAPSED 0x08       // ns covered by the counters
+#define PREG_JOBS 0x10          // jobs completed, register interface and queues
+#define PREG_DMA_IN_BYTES 0x18  // host -> device DMA payload
+#define PREG_DMA_OUT_BYTES 0x20 // device -> host DMA payload, MSI-X messages included
+#define PREG_DMA_STALL 0x28     // ns device threads waited on DMA, summed over threads
+#define PREG_BUSY 0x30          // ns with at least one engine running a job
+#define PREG_IDLE 0x38          // ns with every engine idle
+#define PREG_INTERRUPTS 0x40    // MSI-X messages and INTx assertions
+#define PREG_ERRORS 0x48        // failed jobs and descriptor fetches
+#define PERF_COUNTERS (REG_PERF_SIZE / 8 - 1)
+
+// Performance counter control bits (PREG_CTRL)
+#define PERF_SNAPSHOT (1 << 0)
+#define PERF_CLEAR (1 << 1) // zero the live counters, after the snapshot if both are set
+
+// Scheduler policy bits (REG_SCHED_POLICY)
+#define SCHED_ROUND_ROBIN 0 // job sources served in turn, FIFO within a source
+#define SCHED_SJF 1         // smallest N first, FIFO among equals
+
+// Submission queue entry, written by the host
+struct mm_sq_entry
+{
+    uint64_t a_ptr;
+    uint64_t b_ptr;
+    uint64_t c_ptr;
+    uint32_t dim_n;
+    uint16_t cid;
+    uint16_t flags;
+};
+
+// Completion queue entry, written by the device. status bit 0 is the phase tag.
+struct mm_cq_entry
+{
+    uint32_t result;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;
+    uint32_t rsvd;
+};
+
+static_assert(sizeof(mm_sq_entry) == 32, "SQ entry layout is shared with the driver");
+static_assert(sizeof(mm_cq_entry) == 16, "CQ entry layout is shared with the driver");
+
+// One GEMM job, from the BAR0 registers or from a submission queue
+struct gemm_job
+{
+    uint32_t n;
+    uint64_t a_ptr;
+    uint64_t b_ptr;
+    uint64_t c_ptr;
+};
+
+// Jobs from the BAR0 registers use this source instead of a queue id
+#define JOB_SOURCE_REGISTERS MM_NUM_QUEUES
+
+// A job held by the scheduler until an engine is free
+struct scheduled_job
+{
+    gemm_job job;
+    unsigned source; // submission queue or JOB_SOURCE_REGISTERS
+    uint16_t cid;
+};
+
+// Largest N accepted in REG_DIM_N
+#define MAX_DIM_N 16384
+
+// Default on-device buffer budget for one job (bytes)
+#define DEFAULT_TILE_BUDGET (16 * 1024 * 1024)
+
+// How a job is staged through device memory
+enum exec_mode
+{
+    EXEC_AUTO,      // resident when A, B and C fit the tile budget, else streaming
+    EXEC_RESIDENT,  // whole A, B and C held on device
+    EXEC_STREAMING  // row panels of A/C and k panels of B, bounded by the tile budget
+};
+
+/**
+ * How the model spends simulated time.
+ *
+ * TIMING_APPROXIMATE waits out every DMA, compute step and completion as
+ * it happens. TIMING_LT uses temporal decoupling: each device thread keeps
+ * a tlm_quantumkeeper, runs ahead of the kernel by up to the global
+ * quantum and only yields when the quantum is used up or before it
+ * synchronises with another thread. Split-transaction DMA is bypassed.
+ * LT is much faster but end times are only accurate to about a quantum.
+ */
+enum timing_mode
+{
+    TIMING_APPROXIMATE,
+    TIMING_LT
+};
+
+#define DEFAULT_LT_QUANTUM_NS 1000
+
+// DMA timing: fixed per-transfer setup plus size over bandwidth, on top of
+// the latency reported by the target (b_transport delay or DMI latency)
+#define DEFAULT_DMA_SETUP_NS 50
+#define MAX_DMI_REGIONS 8
+
+// Split-transaction DMA engine: reads are issued as MRRS-sized requests and
+// writes as MPS-sized TLPs, with up to dma_tags of them outstanding
+#define MAX_DMA_TAGS 32
+
+// Per-run accounting of the split-transaction DMA engine
+struct dma_engine_stats
+{
+    uint64_t read_requests;
+    uint64_t write_tlps;
+    uint64_t read_bytes;
+    unsigned peak_outstanding;
+    sc_time read_busy; // time with at least one read request in flight
+
+    // Host-to-device throughput while reads were in flight, in GB/s
+    double read_throughput() const
+    {
+        double ns = read_busy.to_seconds() * 1e9;
+        return ns > 0 ? read_bytes / ns : 0.0;
+    }
+};
+
+// Buffers per pipeline stage in streaming mode (2 = ping-pong)
+#define DEFAULT_PIPELINE_DEPTH 2
+#define MAX_PIPELINE_DEPTH 8
+
+// Per-job accounting of the streaming pipeline
+struct pipeline_stats
+{
+    sc_time elapsed;
+    sc_time dma_in_busy;
+    sc_time compute_busy;
+    sc_time dma_out_busy;
+    uint64_t buffer_bytes;
+    unsigned depth;
+
+    // 0 = stages ran back to back, 1 = everything hidden behind the slowest stage
+    double overlap_ratio() const
+    {
+        sc_time serial = dma_in_busy + compute_busy + dma_out_busy;
+        sc_time longest = dma_in_busy;
+        if (compute_busy > longest)
+            longest = compute_busy;
+        if (dma_out_busy > longest)
+            longest = dma_out_busy;
+        if (serial <= longest)
+            return 0.0;
+        if (elapsed >= serial)
+            return 0.0;
+        double ratio = (serial - elapsed) / (serial - longest);
+        return ratio > 1.0 ? 1.0 : ratio;
+    }
+};
 
 SC_MODULE(matrix_multiplier_pcie)
 {
@@ -43,11 +274,38 @@ public:
     SC_CTOR(matrix_multiplier_pcie)
         : bar0_target_socket("bar0_target_socket"),
           dma_initiator_socket("dma_initiator_socket"),
-          interrupt("interrupt")
+          interrupt("interrupt"),
+          compute_mode(GEMM_MODE_REFERENCE),
+          job_exec_mode(EXEC_AUTO),
+          tile_budget(DEFAULT_TILE_BUDGET),
+          pipeline_depth(DEFAULT_PIPELINE_DEPTH),
+          prof_bar0(string(name()) + ".bar0_b_transport"),
+          prof_dma_read(string(name()) + ".dma_read"),
+          prof_dma_write(string(name()) + ".dma_write"),
+          prof_job(string(name()) + ".perform_matrix_multiply")
     {
         bar0_target_socket.register_b_transport(this, &matrix_multiplier_pcie::bar0_b_transport);
+        dma_initiator_socket.register_invalidate_direct_mem_ptr(this, &matrix_multiplier_pcie::invalidate_direct_mem_ptr);
+        // The MSI-X table belongs to the OS and survives CTRL_RESET
+        reset_msix();
+        memset(vec_fired, 0, sizeof(vec_fired));
+        dma_engine = dma_engine_stats();
+        for (unsigned t = 0; t < MAX_DMA_TAGS; t++)
+        {
+            string tag_name = "dma_tag_" + to_string(t);
+            sc_spawn(sc_bind(&matrix_multiplier_pcie::dma_tag_thread, this), tag_name.c_str());
+        }
+        // All engines exist in the model; set_engine_count() picks how many get jobs
+        for (unsigned i = 0; i < MAX_ENGINES; i++)
+        {
+            string name = "engine_" + to_string(i);
+            engines.push_back(unique_ptr<compute_engine>(new compute_engine(name)));
+            sc_spawn(sc_bind(&matrix_multiplier_pcie::engine_thread, this, i), name.c_str());
+            sc_spawn(sc_bind(&matrix_multiplier_pcie::dma_in_thread, this, i), (name + "_dma_in").c_str());
+            sc_spawn(sc_bind(&matrix_multiplier_pcie::dma_out_thread, this, i), (name + "_dma_out").c_str());
+        }
         reset_device();
-        SC_THREAD(compute_thread);
+        SC_THREAD(scheduler_thread);
         SC_THREAD(interrupt_controller);
         sensitive << interrupt_update_event;
         dont_initialize();
@@ -56,6 +314,278 @@ public:
     void start_of_simulation()
     {
         interrupt.write(false);
+
+        if (host_threads > 1)
+        {
+            gemm_pool.reset(new gemm_thread_pool(host_threads));
+            for (unsigned i = 0; i < engines.size(); i++)
+                engines[i]->offload.set_pool(gemm_pool.get());
+        }
+    }
+
+    // Host-side numerics only; simulated timing is the same in both modes
+    void set_gemm_mode(gemm_mode mode)
+    {
+        compute_mode = mode;
+    }
+
+    void set_exec_mode(exec_mode mode)
+    {
+        job_exec_mode = mode;
+    }
+
+    // Upper bound on device buffer memory per job, in bytes
+    void set_tile_budget(uint64_t bytes)
+    {
+        tile_budget = bytes;
+    }
+
+    // Number of A, B and C buffers the streaming pipeline rotates through
+    void set_pipeline_depth(unsigned depth)
+    {
+        if (depth < 1)
+            depth = 1;
+        if (depth > MAX_PIPELINE_DEPTH)
+            depth = MAX_PIPELINE_DEPTH;
+        pipeline_depth = depth;
+    }
+
+    // Stats of the most recent streaming job on any engine
+    const pipeline_stats &last_pipeline_stats() const
+    {
+        return last_stream_stats;
+    }
+
+    // Host threads for the GEMM arithmetic, 0 = one per core, 1 = inline on
+    // the SystemC thread. Takes effect at start of simulation.
+    void set_host_threads(unsigned threads)
+    {
+        host_threads = threads ? threads : max(1u, thread::hardware_concurrency());
+    }
+
+    // Also sets the TLM global quantum, shared with other LT initiators
+    void set_timing_mode(timing_mode mode, sc_time quantum = sc_time(DEFAULT_LT_QUANTUM_NS, SC_NS))
+    {
+        timing = mode;
+        if (mode == TIMING_LT)
+        {
+            tlm_utils::tlm_quantumkeeper::set_global_quantum(quantum);
+            MM_INFO("Loosely-timed mode, quantum " << quantum);
+        }
+    }
+
+    timing_mode get_timing_mode() const
+    {
+        return timing;
+    }
+
+    // Compute engines that receive jobs (1..MAX_ENGINES)
+    void set_engine_count(unsigned count)
+    {
+        num_engines = max(1u, min<unsigned>(count, MAX_ENGINES));
+    }
+
+    unsigned engine_count() const
+    {
+        return num_engines;
+    }
+
+    void set_sched_policy(uint32_t policy)
+    {
+        sched_policy = policy & SCHED_SJF;
+    }
+
+    // Use DMI pointers offered by the DMA target instead of b_transport
+    void set_dmi_enabled(bool enable)
+    {
+        dmi_enabled = enable;
+        if (!enable)
+            dmi_regions.clear();
+    }
+
+    // DMA bandwidth in GB/s (bytes per ns), 0 = unlimited; setup is per transfer
+    void set_dma_bandwidth(double gbytes_per_sec, sc_time setup = sc_time(DEFAULT_DMA_SETUP_NS, SC_NS))
+    {
+        dma_bytes_per_ns = gbytes_per_sec > 0.0 ? gbytes_per_sec : 0.0;
+        dma_setup = setup;
+    }
+
+    // Outstanding split DMA requests (read tags), 0 = one transaction per buffer
+    void set_dma_tags(unsigned tags)
+    {
+        dma_tags = min<unsigned>(tags, MAX_DMA_TAGS);
+    }
+
+    const dma_engine_stats &last_dma_engine_stats() const
+    {
+        return dma_engine;
+    }
+
+    // Time DMA with a PCIe link model instead of setup + bandwidth
+    void set_link_config(const pcie_link_config &cfg)
+    {
+        link.configure(cfg);
+        link_enabled = true;
+        MM_INFO("PCIe link model: " << cfg.to_string() << ", peak payload " << cfg.payload_bytes_per_ns()
+                << " GB/s");
+    }
+
+    const pcie_link_model *link_model() const
+    {
+        return link_enabled ? &link : nullptr;
+    }
+
+    void end_of_simulation()
+    {
+        if (gemm_pool)
+        {
+            uint64_t offloads = 0, waits = 0;
+            for (unsigned i = 0; i < engines.size(); i++)
+            {
+                offloads += engines[i]->offload.offload_count();
+                waits += engines[i]->offload.host_wait_count();
+            }
+            MM_INFO("Host GEMM pool: " << dec << gemm_pool->size() << " threads, " << offloads
+                    << " offloaded calls, " << waits << " outlasted their simulated time");
+        }
+        if (num_engines > 1)
+        {
+            MM_INFO("Compute engines (" << (sched_policy == SCHED_SJF ? "shortest-job-first" : "round-robin")
+                    << "):");
+            for (unsigned i = 0; i < num_engines; i++)
+                MM_INFO("  engine " << dec << i << ": " << engines[i]->jobs_done << " jobs, busy "
+                        << engine_busy_time(i) << ", utilisation " << fixed << setprecision(1)
+                        << engine_utilisation(i) / 10.0 << "%" << defaultfloat);
+        }
+        if (link_enabled)
+        {
+            ostringstream stats;
+            link.print_stats(stats, sc_time_stamp());
+            string text = stats.str();
+            MM_INFO(text.substr(0, text.find_last_not_of('\n') + 1));
+        }
+        if (dma_tags)
+            MM_INFO("DMA engine: " << dec << dma_engine.read_requests << " read requests, "
+                    << dma_engine.write_tlps << " write TLPs, peak " << dma_engine.peak_outstanding << "/"
+                    << dma_tags << " tags, host-to-device " << dma_engine.read_throughput() << " GB/s");
+    }
+
+    // Bytes moved through DMI pointers and through b_transport
+    uint64_t dma_dmi_bytes() const
+    {
+        return dmi_bytes;
+    }
+
+    uint64_t dma_transport_bytes() const
+    {
+        return transport_bytes;
+    }
+
+    // Interrupts fired on a vector (MSI-X messages or INTx assertions)
+    uint64_t interrupts_fired(unsigned vector) const
+    {
+        return vector < MM_MSIX_VECTORS ? vec_fired[vector] : 0;
+    }
+
+    /**
+     * True when no job is queued, running or moving data, so registers and
+     * queue pointers describe the device completely. Checkpoints are only
+     * taken at such points.
+     */
+    bool quiescent() const
+    {
+        if (computation_requested || !pending_jobs.empty() || dma_outstanding || !dma_pending.empty())
+            return false;
+        for (unsigned i = 0; i < engines.size(); i++)
+        {
+            if (engines[i]->busy)
+                return false;
+        }
+        for (unsigned i = 0; i < MM_NUM_QUEUES; i++)
+        {
+            if (queues[i].jobs_in_flight)
+                return false;
+        }
+        return true;
+    }
+
+    // Block the calling thread until the running jobs have drained
+    void wait_quiescent()
+    {
+        while (!quiescent())
+            wait(sc_time(1, SC_US), idle_event);
+    }
+
+    /**
+     * Registers, MSI-X table, queue pointers and pending interrupt
+     * aggregation. Call only when quiescent(); unfetched SQ entries stay
+     * in host memory and are fetched again after a restore. Statistics
+     * are not saved.
+     */
+    void save_state(mm_snapshot_writer &w) const
+    {
+        sc_time now = sc_time_stamp();
+
+        w.begin_section(MM_SNAPSHOT_DEVICE);
+        w.put(reg_control);
+        w.put(reg_status);
+        w.put(reg_dim_n);
+        w.put(reg_matrix_a_ptr);
+        w.put(reg_matrix_b_ptr);
+        w.put(reg_matrix_c_ptr);
+        w.put(reg_int_status);
+        w.put(reg_int_enable);
+        w.put(reg_msix_ctrl);
+        w.put(reg_int_coalesce);
+        w.put(sched_policy);
+        w.put(msix_table);
+        w.put(msix_pba);
+        w.put(queues);
+        w.put(vec_pending);
+        for (unsigned v = 0; v < MM_MSIX_VECTORS; v++)
+            w.put_time(vec_deadline[v] > now ? vec_deadline[v] - now : SC_ZERO_TIME);
+        w.end_section();
+    }
+
+    // Counterpart of save_state(); call from a process, before host traffic
+    bool restore_state(mm_snapshot_reader &r)
+    {
+        reset_device();
+
+        bool ok = r.open_section(MM_SNAPSHOT_DEVICE) &&
+                  r.get(reg_control) && r.get(reg_status) && r.get(reg_dim_n) &&
+                  r.get(reg_matrix_a_ptr) && r.get(reg_matrix_b_ptr) && r.get(reg_matrix_c_ptr) &&
+                  r.get(reg_int_status) && r.get(reg_int_enable) && r.get(reg_msix_ctrl) &&
+                  r.get(reg_int_coalesce) && r.get(sched_policy) &&
+                  r.get(msix_table) && r.get(msix_pba) && r.get(queues) && r.get(vec_pending);
+        for (unsigned v = 0; ok && v < MM_MSIX_VECTORS; v++)
+        {
+            ok = r.get_time(vec_deadline[v]);
+            vec_deadline[v] += sc_time_stamp();
+        }
+        if (!ok)
+        {
+            MM_ERROR("ERROR: Snapshot has no usable device state");
+            reset_to_power_on();
+            return false;
+        }
+
+        dmi_regions.clear();
+        writes_posted = false;
+        update_interrupt();
+        schedule_event.notify();
+        return true;
+    }
+
+    // Undo a partial or abandoned restore: registers, queues and the
+    // MSI-X table go back to their power-on values
+    void reset_to_power_on()
+    {
+        reset_msix();
+        reset_device();
+        dmi_regions.clear();
+        writes_posted = false;
+        update_interrupt();
     }
 
 private:
@@ -67,10 +597,177 @@ private:
     uint64_t reg_matrix_c_ptr;
     uint32_t reg_int_status;
     uint32_t reg_int_enable;
-    sc_event start_event;
+    uint32_t reg_msix_ctrl;
+    uint32_t reg_int_coalesce;
+    uint32_t sched_policy = SCHED_ROUND_ROBIN;
+    sc_event schedule_event;
     sc_event interrupt_update_event;
+    sc_event idle_event;
     bool computation_requested;
 
+    // MSI-X table entry as laid out in BAR0
+    struct msix_entry
+    {
+        uint32_t addr_lo;
+        uint32_t addr_hi;
+        uint32_t data;
+        uint32_t vector_ctrl;
+    };
+    msix_entry msix_table[MM_MSIX_VECTORS];
+    uint64_t msix_pba;
+
+    // DMA fast path: DMI regions granted by the DMA target, dropped on
+    // invalidate_direct_mem_ptr
+    bool dmi_enabled = true;
+    vector<tlm::tlm_dmi> dmi_regions;
+    sc_time dma_setup = sc_time(DEFAULT_DMA_SETUP_NS, SC_NS);
+    double dma_bytes_per_ns = 0.0;
+    uint64_t dmi_bytes = 0;
+    uint64_t transport_bytes = 0;
+    bool link_enabled = false;
+    pcie_link_model link;
+    bool writes_posted = false;
+    uint64_t last_write_addr = 0;
+
+    // One MRRS/MPS-sized piece of a split transfer, completed by a tag thread
+    struct dma_batch;
+    struct dma_request
+    {
+        tlm::tlm_command cmd;
+        uint64_t addr;
+        unsigned char *data;
+        unsigned int len;
+        dma_batch *batch;
+    };
+    struct dma_batch
+    {
+        unsigned remaining;
+        bool ok;
+        sc_event done;
+    };
+    unsigned dma_tags = 0;
+    deque<dma_request> dma_pending;
+    sc_event dma_work_event;
+    unsigned dma_outstanding = 0;
+    unsigned dma_reads_in_flight = 0;
+    sc_time dma_read_since;
+    dma_engine_stats dma_engine;
+
+    // Per-vector coalescing: events not yet signalled and when they are due
+    unsigned vec_pending[MM_MSIX_VECTORS];
+    sc_time vec_deadline[MM_MSIX_VECTORS];
+    uint64_t vec_fired[MM_MSIX_VECTORS];
+
+    // Live performance counters and the bank PREG_* reads return
+    struct perf_counters
+    {
+        uint64_t jobs;
+        uint64_t dma_in_bytes;
+        uint64_t dma_out_bytes;
+        sc_time dma_stall;
+        sc_time busy;
+        uint64_t interrupts;
+        uint64_t errors;
+    };
+    perf_counters perf;
+    sc_time perf_epoch;
+    sc_time perf_busy_since;
+    unsigned engines_busy = 0;
+    uint64_t perf_latched[PERF_COUNTERS];
+
+    // Device-side state of one submission/completion queue pair
+    struct mm_queue
+    {
+        uint64_t sq_base;
+        uint64_t cq_base;
+        uint16_t sq_size;
+        uint16_t cq_size;
+        uint16_t sq_tail;
+        uint16_t sq_head;
+        uint16_t cq_head;
+        uint16_t cq_tail;
+        bool cq_phase;
+        uint16_t jobs_in_flight; // fetched, completion not yet posted
+    };
+    mm_queue queues[MM_NUM_QUEUES];
+    sc_event cq_space_event;
+
+    gemm_mode compute_mode;
+    exec_mode job_exec_mode;
+    uint64_t tile_budget;
+
+    unsigned pipeline_depth;
+    pipeline_stats last_stream_stats;
+
+    // Host-side profile (MM_PROFILE)
+    mm_profile_probe prof_bar0;
+    mm_profile_probe prof_dma_read;
+    mm_profile_probe prof_dma_write;
+    mm_profile_probe prof_job;
+
+    /**
+     * One compute unit. It runs one job at a time out of its own scratch
+     * memory: whole matrices in resident mode, or a streaming pipeline
+     * (DMA-in -> compute -> DMA-out) that hands buffer indices through
+     * bounded free/full queues. All engines share the DMA engine and link.
+     */
+    struct compute_engine
+    {
+        explicit compute_engine(const string &name)
+            : offload((name + "_offload").c_str()),
+              a_free((name + "_a_free").c_str(), MAX_PIPELINE_DEPTH),
+              a_full((name + "_a_full").c_str(), MAX_PIPELINE_DEPTH),
+              b_free((name + "_b_free").c_str(), MAX_PIPELINE_DEPTH),
+              b_full((name + "_b_full").c_str(), MAX_PIPELINE_DEPTH),
+              c_free((name + "_c_free").c_str(), MAX_PIPELINE_DEPTH),
+              c_full((name + "_c_full").c_str(), MAX_PIPELINE_DEPTH)
+        {
+        }
+
+        gemm_offload offload;
+        vector<float> resident_a, resident_b, resident_c;
+
+        sc_fifo<int> a_free, a_full;
+        sc_fifo<int> b_free, b_full;
+        sc_fifo<int> c_free, c_full;
+        vector<vector<float>> a_bufs, b_bufs, c_bufs;
+        sc_event stream_start_event;
+        sc_event stream_done_event;
+        gemm_job stream_job;
+        uint32_t stream_rows = 0;
+        bool stream_error = false;
+        bool stream_done = false;
+        pipeline_stats stream_stats;
+
+        // Scheduler handoff and utilisation counters
+        sc_event dispatch_event;
+        bool busy = false;
+        scheduled_job job;
+        sc_time busy_since;
+        sc_time busy_time;
+        uint64_t jobs_done = 0;
+    };
+    vector<unique_ptr<compute_engine>> engines;
+    unsigned host_threads = max(1u, thread::hardware_concurrency());
+    timing_mode timing = TIMING_APPROXIMATE;
+    map<sc_object *, tlm_utils::tlm_quantumkeeper> keepers; // per device thread, LT mode
+    unique_ptr<gemm_thread_pool> gemm_pool;
+    unsigned num_engines = 1;
+    unsigned next_engine = 0;
+    deque<scheduled_job> pending_jobs;
+    unsigned next_source = 0;
+    sc_time engine_epoch;
+
+    // Vectors come up masked as the PCIe spec requires
+    void reset_msix()
+    {
+        memset(msix_table, 0, sizeof(msix_table));
+        for (unsigned v = 0; v < MM_MSIX_VECTORS; v++)
+            msix_table[v].vector_ctrl = MSIX_VECTOR_MASKED;
+        msix_pba = 0;
+        reg_msix_ctrl = 0;
+    }
+
     void reset_device()
     {
         reg_control = 0;
@@ -81,22 +778,179 @@ private:
         reg_matrix_c_ptr = 0;
         reg_int_status = 0;
         reg_int_enable = 0;
+        reg_int_coalesce = 0;
         computation_requested = false;
+        memset(queues, 0, sizeof(queues));
+        pending_jobs.clear();
+        engine_epoch = sc_time_stamp();
+        for (unsigned i = 0; i < engines.size(); i++)
+        {
+            engines[i]->busy_time = SC_ZERO_TIME;
+            engines[i]->busy_since = sc_time_stamp();
+            engines[i]->jobs_done = 0;
+        }
+        for (unsigned v = 0; v < MM_MSIX_VECTORS; v++)
+        {
+            vec_pending[v] = 0;
+            vec_deadline[v] = SC_ZERO_TIME;
+        }
+        clear_perf_counters();
+        memset(perf_latched, 0, sizeof(perf_latched));
     }
 
-    // Dedicated thread to handle interrupt signal updates
+    /**
+     * Dedicated thread to handle interrupt signal updates.
+     *
+     * Fires every vector whose coalescing condition is met. With MSI-X
+     * enabled a fired vector sets its PBA bit and, once unmasked, is sent as
+     * a memory write of the table's data to the table's address over the
+     * DMA path; otherwise it sets its cause in INT_STATUS and drives the
+     * INTx line from INT_STATUS & INT_ENABLE.
+     */
     void interrupt_controller()
     {
         while (true)
         {
             wait();
-            bool irq = (reg_int_status & reg_int_enable) != 0;
+
+            // Message writes take simulated time, during which new events
+            // may arrive: rescan until there is nothing left to send
+            while (deliver_interrupts())
+                ;
+
+            arm_coalesce_timer();
+
+            // INTx is a side-band line here, so order it behind posted
+            // completion writes explicitly (MSI-X messages already are)
+            bool msix = (reg_msix_ctrl & MSIX_CTRL_ENABLE) != 0;
+            bool irq = !msix && (reg_int_status & reg_int_enable) != 0;
+            if (irq && !interrupt.read())
+                dma_fence();
             interrupt.write(irq);
         }
     }
 
+    bool vector_due(unsigned v)
+    {
+        if (vec_pending[v] == 0)
+            return false;
+
+        unsigned threshold = reg_int_coalesce & COAL_THRESHOLD_MASK;
+        if (threshold <= 1 || vec_pending[v] >= threshold)
+            return true;
+
+        return vec_deadline[v] <= sc_time_stamp();
+    }
+
+    bool vector_masked(unsigned v)
+    {
+        return (reg_msix_ctrl & MSIX_CTRL_MASK_ALL) ||
+               (msix_table[v].vector_ctrl & MSIX_VECTOR_MASKED);
+    }
+
+    bool deliver_interrupts()
+    {
+        bool msix = (reg_msix_ctrl & MSIX_CTRL_ENABLE) != 0;
+        bool progress = false;
+
+        for (unsigned v = 0; v < MM_MSIX_VECTORS; v++)
+        {
+            if (vector_due(v))
+            {
+                vec_pending[v] = 0;
+                vec_fired[v]++;
+                perf.interrupts++;
+                if (v < MM_NUM_QUEUES)
+                    reg_int_status |= INT_CQ;
+                if (msix)
+                    msix_pba |= 1ULL << v;
+                progress = true;
+            }
+
+            if (msix && (msix_pba & (1ULL << v)) && !vector_masked(v))
+            {
+                msix_pba &= ~(1ULL << v);
+                send_msix_message(v);
+                progress = true;
+            }
+        }
+
+        return progress;
+    }
+
+    void send_msix_message(unsigned v)
+    {
+        const msix_entry &e = msix_table[v];
+        uint64_t addr = ((uint64_t)e.addr_hi << 32) | e.addr_lo;
+        uint32_t data = e.data;
+
+        if (addr == 0)
+        {
+            MM_WARN("WARNING: MSI-X vector " << dec << v << " has no message address");
+            return;
+        }
+
+        if (!dma_write(addr, (unsigned char *)&data, sizeof(data)))
+            MM_ERROR("ERROR: MSI-X message write for vector " << dec << v << " failed");
+    }
+
+    // Wake the controller again when the earliest aggregation time expires
+    void arm_coalesce_timer()
+    {
+        sc_time now = sc_time_stamp();
+        sc_time next = SC_ZERO_TIME;
+        bool armed = false;
+
+        for (unsigned v = 0; v < MM_MSIX_VECTORS; v++)
+        {
+            if (vec_pending[v] == 0 || vec_deadline[v] <= now)
+                continue;
+            if (!armed || vec_deadline[v] < next)
+                next = vec_deadline[v];
+            armed = true;
+        }
+
+        if (armed)
+            interrupt_update_event.notify(next - now);
+    }
+
+    /**
+     * Record one interrupt event on a vector. Completion-queue events are
+     * aggregated per REG_INT_COALESCE; immediate events (register-interface
+     * completion, errors) fire the vector together with anything pending.
+     */
+    void signal_vector(unsigned v, bool immediate)
+    {
+        if (vec_pending[v]++ == 0)
+        {
+            unsigned timer = reg_int_coalesce >> COAL_TIMER_SHIFT;
+            vec_deadline[v] = timer ? sc_time_stamp() + sc_time((double)timer * COAL_TIMER_UNIT_NS, SC_NS)
+                                    : sc_max_time();
+        }
+        if (immediate)
+            vec_deadline[v] = SC_ZERO_TIME;
+        update_interrupt();
+    }
+
+    // Queue drained: nothing more will complete soon, stop aggregating
+    void flush_vector(unsigned v)
+    {
+        if (vec_pending[v] == 0)
+            return;
+        vec_deadline[v] = SC_ZERO_TIME;
+        update_interrupt();
+    }
+
+    void signal_error()
+    {
+        perf.errors++;
+        reg_int_status |= INT_ERROR;
+        signal_vector(MSIX_VEC_MISC, true);
+    }
+
     void bar0_b_transport(tlm::tlm_generic_payload & trans, sc_time & delay)
     {
+        mm_profile_scope prof(prof_bar0, &delay);
         tlm::tlm_command cmd = trans.get_command();
         sc_dt::uint64 addr = trans.get_address();
         unsigned char *ptr = trans.get_data_ptr();
@@ -108,6 +962,13 @@ private:
             return;
         }
 
+        // MSI-X table accesses are copied in place: keep them aligned and inside it
+        if (addr >= REG_MSIX_TABLE && addr < REG_MSIX_TABLE_END && (addr % len || addr + len > REG_MSIX_TABLE_END))
+        {
+            trans.set_response_status(tlm::TLM_ADDRESS_ERROR_RESPONSE);
+            return;
+        }
+
         if (cmd == tlm::TLM_READ_COMMAND)
         {
             handle_mmio_read(addr, ptr, len);
@@ -125,19 +986,50 @@ private:
     {
         uint32_t value = 0;
 
-        switch (addr)
+        if (addr >= REG_QUEUE_BASE && addr < REG_QUEUE_BASE + MM_NUM_QUEUES * REG_QUEUE_STRIDE)
         {
-        case REG_CONTROL:
-            value = reg_control;
-            break;
-        case REG_STATUS:
-            value = reg_status;
-            break;
-        case REG_DIM_N:
-            value = reg_dim_n;
-            break;
-        case REG_MATRIX_A_PTR:
-            if (len == 8)
+            handle_queue_read(addr - REG_QUEUE_BASE, data, len);
+            return;
+        }
+
+        if (addr >= REG_MSIX_TABLE && addr < REG_MSIX_TABLE_END)
+        {
+            memcpy(data, (unsigned char *)msix_table + (addr - REG_MSIX_TABLE), len);
+            return;
+        }
+
+        if (addr == REG_MSIX_PBA || addr == REG_MSIX_PBA + 4)
+        {
+            uint64_t pba = msix_pba >> ((addr - REG_MSIX_PBA) * 8);
+            memcpy(data, &pba, len);
+            return;
+        }
+
+        if (addr >= REG_ENGINE_BASE && addr < REG_ENGINE_BASE + MAX_ENGINES * REG_ENGINE_STRIDE)
+        {
+            handle_engine_read(addr - REG_ENGINE_BASE, data, len);
+            return;
+        }
+
+        if (addr >= REG_PERF_BASE && addr < REG_PERF_BASE + REG_PERF_SIZE)
+        {
+            handle_perf_read(addr - REG_PERF_BASE, data, len);
+            return;
+        }
+
+        switch (addr)
+        {
+        case REG_CONTROL:
+            value = reg_control;
+            break;
+        case REG_STATUS:
+            value = reg_status;
+            break;
+        case REG_DIM_N:
+            value = reg_dim_n;
+            break;
+        case REG_MATRIX_A_PTR:
+            if (len == 8)
             {
                 memcpy(data, &reg_matrix_a_ptr, 8);
                 return;
@@ -175,8 +1067,20 @@ private:
         case REG_INT_ENABLE:
             value = reg_int_enable;
             break;
+        case REG_MSIX_CTRL:
+            value = reg_msix_ctrl;
+            break;
+        case REG_INT_COALESCE:
+            value = reg_int_coalesce;
+            break;
+        case REG_SCHED_POLICY:
+            value = sched_policy;
+            break;
+        case REG_ENGINE_COUNT:
+            value = num_engines;
+            break;
         default:
-            cout << "WARNING: Read from undefined register 0x" << hex << addr << endl;
+            MM_WARN("WARNING: Read from undefined register 0x" << hex << addr);
             value = 0xDEADBEEF;
         }
 
@@ -197,6 +1101,29 @@ private:
             memcpy(&value64, data, 8);
         }
 
+        if (addr >= REG_QUEUE_BASE && addr < REG_QUEUE_BASE + MM_NUM_QUEUES * REG_QUEUE_STRIDE)
+        {
+            handle_queue_write(addr - REG_QUEUE_BASE, len == 8 ? value64 : value, len);
+            return;
+        }
+
+        if (addr >= REG_MSIX_TABLE && addr < REG_MSIX_TABLE_END)
+        {
+            // Unmasking a vector releases its pending message
+            memcpy((unsigned char *)msix_table + (addr - REG_MSIX_TABLE), data, len);
+            update_interrupt();
+            return;
+        }
+
+        if (addr == REG_PERF_BASE + PREG_CTRL)
+        {
+            if (value & PERF_SNAPSHOT)
+                snapshot_perf_counters();
+            if (value & PERF_CLEAR)
+                clear_perf_counters();
+            return;
+        }
+
         switch (addr)
         {
         case REG_CONTROL:
@@ -204,21 +1131,21 @@ private:
             if (value & CTRL_RESET)
             {
                 reset_device();
-                cout << "[" << sc_time_stamp() << "] Device reset" << endl;
+                MM_DEBUG("[" << sc_time_stamp() << "] Device reset");
             }
             if (value & CTRL_START)
             {
                 if (reg_status & STATUS_IDLE)
                 {
                     computation_requested = true;
-                    start_event.notify();
-                    cout << "[" << sc_time_stamp() << "] Computation started" << endl;
+                    schedule_event.notify();
+                    MM_DEBUG("[" << sc_time_stamp() << "] Computation started");
                 }
             }
             break;
         case REG_DIM_N:
             reg_dim_n = value;
-            cout << "[" << sc_time_stamp() << "] Matrix dimension set to " << value << endl;
+            MM_DEBUG("[" << sc_time_stamp() << "] Matrix dimension set to " << value);
             break;
         case REG_MATRIX_A_PTR:
             if (len == 8)
@@ -267,17 +1194,367 @@ private:
             reg_int_enable = value;
             update_interrupt();
             break;
+        case REG_MSIX_CTRL:
+            reg_msix_ctrl = value & (MSIX_CTRL_ENABLE | MSIX_CTRL_MASK_ALL);
+            update_interrupt();
+            MM_DEBUG("[" << sc_time_stamp() << "] MSI-X " << ((reg_msix_ctrl & MSIX_CTRL_ENABLE) ? "enabled" : "disabled")
+                     << ((reg_msix_ctrl & MSIX_CTRL_MASK_ALL) ? " (masked)" : ""));
+            break;
+        case REG_INT_COALESCE:
+            reg_int_coalesce = value;
+            MM_DEBUG("[" << sc_time_stamp() << "] Interrupt coalescing: " << dec
+                     << (value & COAL_THRESHOLD_MASK) << " completions / "
+                     << (value >> COAL_TIMER_SHIFT) * COAL_TIMER_UNIT_NS << " ns");
+            break;
+        case REG_SCHED_POLICY:
+            set_sched_policy(value);
+            MM_DEBUG("[" << sc_time_stamp() << "] Scheduler policy: "
+                     << (sched_policy == SCHED_SJF ? "shortest-job-first" : "round-robin"));
+            break;
+        default:
+            MM_WARN("WARNING: Write to undefined register 0x" << hex << addr);
+        }
+    }
+
+    void handle_queue_read(uint64_t offset, unsigned char *data, unsigned int len)
+    {
+        mm_queue &q = queues[offset / REG_QUEUE_STRIDE];
+        uint64_t value = 0;
+
+        switch (offset % REG_QUEUE_STRIDE)
+        {
+        case QREG_SQ_BASE:
+            value = q.sq_base;
+            break;
+        case QREG_SQ_BASE + 4:
+            value = q.sq_base >> 32;
+            break;
+        case QREG_CQ_BASE:
+            value = q.cq_base;
+            break;
+        case QREG_CQ_BASE + 4:
+            value = q.cq_base >> 32;
+            break;
+        case QREG_SIZE:
+            value = q.sq_size | ((uint32_t)q.cq_size << 16);
+            break;
+        case QREG_SQ_TAIL:
+            value = q.sq_tail;
+            break;
+        case QREG_CQ_HEAD:
+            value = q.cq_head;
+            break;
+        case QREG_SQ_HEAD:
+            value = q.sq_head;
+            break;
+        }
+
+        if (len == 4)
+            value &= 0xFFFFFFFF;
+        memcpy(data, &value, len);
+    }
+
+    void handle_engine_read(uint64_t offset, unsigned char *data, unsigned int len)
+    {
+        unsigned id = offset / REG_ENGINE_STRIDE;
+        uint64_t value = 0;
+
+        if (id < num_engines)
+        {
+            uint64_t busy_ns = time_to_ns(engine_busy_time(id));
+
+            switch (offset % REG_ENGINE_STRIDE)
+            {
+            case EREG_BUSY_TIME:
+                value = busy_ns;
+                break;
+            case EREG_BUSY_TIME + 4:
+                value = busy_ns >> 32;
+                break;
+            case EREG_JOBS:
+                value = engines[id]->jobs_done;
+                break;
+            case EREG_UTIL:
+                value = engine_utilisation(id);
+                break;
+            }
+        }
+
+        if (len == 4)
+            value &= 0xFFFFFFFF;
+        memcpy(data, &value, len);
+    }
+
+    void handle_perf_read(uint64_t offset, unsigned char *data, unsigned int len)
+    {
+        uint64_t value = 0;
+
+        if (offset >= PREG_ELAPSED)
+        {
+            value = perf_latched[offset / 8 - 1];
+            if (offset % 8)
+                value >>= 32;
+        }
+
+        if (len == 4)
+            value &= 0xFFFFFFFF;
+        memcpy(data, &value, len);
+    }
+
+    // Latch the live counters in PREG_* order
+    void snapshot_perf_counters()
+    {
+        sc_time now = sc_time_stamp();
+        sc_time elapsed = now - perf_epoch;
+        sc_time busy = engines_busy ? perf.busy + (now - perf_busy_since) : perf.busy;
+        uint64_t *c = perf_latched;
+
+        *c++ = time_to_ns(elapsed);
+        *c++ = perf.jobs;
+        *c++ = perf.dma_in_bytes;
+        *c++ = perf.dma_out_bytes;
+        *c++ = time_to_ns(perf.dma_stall);
+        *c++ = time_to_ns(busy);
+        *c++ = time_to_ns(elapsed - busy);
+        *c++ = perf.interrupts;
+        *c++ = perf.errors;
+    }
+
+    void clear_perf_counters()
+    {
+        perf = perf_counters();
+        perf_epoch = sc_time_stamp();
+        perf_busy_since = sc_time_stamp();
+    }
+
+    static uint64_t time_to_ns(const sc_time &t)
+    {
+        return (uint64_t)(t.to_seconds() * 1e9 + 0.5);
+    }
+
+    // Busy time including the job running now
+    sc_time engine_busy_time(unsigned id) const
+    {
+        const compute_engine &e = *engines[id];
+        return e.busy ? e.busy_time + (sc_time_stamp() - e.busy_since) : e.busy_time;
+    }
+
+    // Busy fraction since reset, in 1/1000
+    uint32_t engine_utilisation(unsigned id) const
+    {
+        sc_time window = sc_time_stamp() - engine_epoch;
+        if (window == SC_ZERO_TIME)
+            return 0;
+        return (uint32_t)(engine_busy_time(id) / window * 1000.0 + 0.5);
+    }
+
+    void handle_queue_write(uint64_t offset, uint64_t value, unsigned int len)
+    {
+        unsigned qid = offset / REG_QUEUE_STRIDE;
+        mm_queue &q = queues[qid];
+
+        switch (offset % REG_QUEUE_STRIDE)
+        {
+        case QREG_SQ_BASE:
+            if (len == 8)
+                q.sq_base = value;
+            else
+                q.sq_base = (q.sq_base & 0xFFFFFFFF00000000ULL) | (uint32_t)value;
+            break;
+        case QREG_SQ_BASE + 4:
+            q.sq_base = (q.sq_base & 0xFFFFFFFF) | (value << 32);
+            break;
+        case QREG_CQ_BASE:
+            if (len == 8)
+                q.cq_base = value;
+            else
+                q.cq_base = (q.cq_base & 0xFFFFFFFF00000000ULL) | (uint32_t)value;
+            break;
+        case QREG_CQ_BASE + 4:
+            q.cq_base = (q.cq_base & 0xFFFFFFFF) | (value << 32);
+            break;
+        case QREG_SIZE:
+            // (Re)configuring a queue resets its indices and the phase tag
+            q.sq_size = value & 0xFFFF;
+            q.cq_size = (value >> 16) & 0xFFFF;
+            if (q.sq_size == 1 || q.cq_size == 1)
+            {
+                MM_WARN("WARNING: Queue " << qid << " needs at least 2 entries, disabled");
+                q.sq_size = 0;
+                q.cq_size = 0;
+            }
+            q.sq_head = q.sq_tail = 0;
+            q.cq_head = q.cq_tail = 0;
+            q.cq_phase = true;
+            MM_DEBUG("[" << sc_time_stamp() << "] Queue " << qid << " configured: SQ " << dec
+                     << q.sq_size << " entries @ 0x" << hex << q.sq_base << ", CQ " << dec
+                     << q.cq_size << " entries @ 0x" << hex << q.cq_base);
+            break;
+        case QREG_SQ_TAIL:
+            if (q.sq_size == 0)
+                break;
+            q.sq_tail = value % q.sq_size;
+            schedule_event.notify();
+            break;
+        case QREG_CQ_HEAD:
+            if (q.cq_size == 0)
+                break;
+            q.cq_head = value % q.cq_size;
+            cq_space_event.notify();
+            break;
         default:
-            cout << "WARNING: Write to undefined register 0x" << hex << addr << endl;
+            MM_WARN("WARNING: Write to read-only queue register 0x" << hex
+                    << (REG_QUEUE_BASE + offset));
         }
     }
 
     bool dma_read(uint64_t addr, unsigned char *data, unsigned int len)
     {
+        mm_profile_scope prof(prof_dma_read);
+        sc_time start = local_time_now();
+        bool ok = dma_transfer(tlm::TLM_READ_COMMAND, addr, data, len);
+        perf.dma_in_bytes += len;
+        perf.dma_stall += local_time_now() - start;
+        return ok;
+    }
+
+    // Posted writes return at once, so they add little stall time
+    bool dma_write(uint64_t addr, unsigned char *data, unsigned int len)
+    {
+        mm_profile_scope prof(prof_dma_write);
+        sc_time start = local_time_now();
+        bool ok = dma_transfer(tlm::TLM_WRITE_COMMAND, addr, data, len);
+        perf.dma_out_bytes += len;
+        perf.dma_stall += local_time_now() - start;
+        return ok;
+    }
+
+    sc_time dma_transfer_time(unsigned int len)
+    {
+        if (dma_bytes_per_ns <= 0.0)
+            return dma_setup;
+        return dma_setup + sc_time(len / dma_bytes_per_ns, SC_NS);
+    }
+
+    // Completion time of a transfer on the modelled link, as a delay from now
+    sc_time link_transfer_time(bool is_read, unsigned int len, sc_time target_latency)
+    {
+        sc_time now = local_time_now();
+        sc_time end = is_read ? link.read(len, now, target_latency) : link.write(len, now);
+        return end - now;
+    }
+
+    /**
+     * Move one buffer between device and host memory. If a cached DMI
+     * region covers it the data is copied directly; otherwise a
+     * b_transport is issued and, when the target marks it DMI-allowed,
+     * a DMI pointer is requested for the following transfers. Both paths
+     * annotate the same time: the PCIe link model when one is configured,
+     * else setup + bandwidth, plus the target latency.
+     */
+    bool dma_transfer(tlm::tlm_command cmd, uint64_t addr, unsigned char *data, unsigned int len)
+    {
+        bool is_read = (cmd == tlm::TLM_READ_COMMAND);
+        sc_time delay = link_enabled ? SC_ZERO_TIME : dma_transfer_time(len);
+
+        const tlm::tlm_dmi *dmi = find_dmi(addr, len, is_read);
+        if (dmi)
+            return dmi_transfer(*dmi, is_read, addr, data, len, delay);
+
+        const pcie_link_config &lc = link.get_config();
+        if (dma_tags && timing != TIMING_LT && len > (is_read ? lc.mrrs : lc.mps))
+            return dma_split_transfer(cmd, addr, data, len);
+
+        return dma_single_transfer(cmd, addr, data, len, delay);
+    }
+
+    // Copy through a cached DMI pointer, annotated like dma_transfer()
+    bool dmi_transfer(const tlm::tlm_dmi &dmi, bool is_read, uint64_t addr, unsigned char *data,
+                      unsigned int len, sc_time delay)
+    {
+        unsigned char *host = dmi.get_dmi_ptr() + (addr - dmi.get_start_address());
+        sc_time latency = is_read ? dmi.get_read_latency() : dmi.get_write_latency();
+        if (is_read)
+            memcpy(data, host, len);
+        else
+            memcpy(host, data, len);
+        dmi_bytes += len;
+        consume(link_enabled ? link_transfer_time(is_read, len, latency) : delay + latency);
+        return true;
+    }
+
+    tlm_utils::tlm_quantumkeeper &local_keeper()
+    {
+        sc_object *self = sc_get_current_process_handle().get_process_object();
+        map<sc_object *, tlm_utils::tlm_quantumkeeper>::iterator it = keepers.find(self);
+        if (it == keepers.end())
+        {
+            it = keepers.insert(make_pair(self, tlm_utils::tlm_quantumkeeper())).first;
+            it->second.reset();
+        }
+        return it->second;
+    }
+
+    // Let d pass for the calling thread: a wait, or local time in LT mode
+    void consume(const sc_time &d)
+    {
+        if (timing != TIMING_LT)
+        {
+            wait(d);
+            return;
+        }
+
+        tlm_utils::tlm_quantumkeeper &qk = local_keeper();
+        qk.inc(d);
+        if (qk.need_sync())
+            qk.sync();
+    }
+
+    // Catch the kernel up with the calling thread before it hands off work,
+    // blocks or raises an interrupt
+    void sync_local_time()
+    {
+        if (timing == TIMING_LT)
+            local_keeper().sync();
+    }
+
+    sc_time local_time_now()
+    {
+        return timing == TIMING_LT ? local_keeper().get_current_time() : sc_time_stamp();
+    }
+
+    // Pipeline buffer handoff; in LT mode time is synced only if it blocks
+    int pipeline_read(sc_fifo<int> &fifo)
+    {
+        if (fifo.num_available() == 0)
+            sync_local_time();
+        return fifo.read();
+    }
+
+    /**
+     * Zero-length read after posted writes: returns once every earlier
+     * write has reached host memory, as a PCIe read would. Used before
+     * signalling completion on paths that bypass the DMA queue (status
+     * register, INTx line). DMI copies are immediate and need no fence.
+     */
+    void dma_fence()
+    {
+        if (!writes_posted)
+            return;
+        writes_posted = false;
+
+        unsigned char dummy = 0;
+        dma_single_transfer(tlm::TLM_READ_COMMAND, last_write_addr, &dummy, 0, SC_ZERO_TIME);
+    }
+
+    // One b_transport for the whole buffer, annotated like dma_transfer()
+    bool dma_single_transfer(tlm::tlm_command cmd, uint64_t addr, unsigned char *data, unsigned int len,
+                             sc_time delay)
+    {
+        bool is_read = (cmd == tlm::TLM_READ_COMMAND);
         tlm::tlm_generic_payload trans;
-        sc_time delay = sc_time(50, SC_NS);
 
-        trans.set_command(tlm::TLM_READ_COMMAND);
+        trans.set_command(cmd);
         trans.set_address(addr);
         trans.set_data_ptr(data);
         trans.set_data_length(len);
@@ -287,29 +1564,150 @@ private:
         trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
 
         dma_initiator_socket->b_transport(trans, delay);
-        wait(delay);
+        transport_bytes += len;
+        if (!is_read)
+        {
+            writes_posted = true;
+            last_write_addr = addr;
+        }
+
+        if (trans.is_response_ok() && trans.is_dmi_allowed() && dmi_enabled)
+            acquire_dmi(cmd, addr);
+
+        // With the link model, the target's annotation is its memory latency
+        if (link_enabled)
+            delay = link_transfer_time(is_read, len, delay);
+
+        consume(delay);
 
         return trans.is_response_ok();
     }
 
-    bool dma_write(uint64_t addr, unsigned char *data, unsigned int len)
+    /**
+     * Break a transfer into MRRS-sized read requests or MPS-sized write
+     * TLPs and hand them to the tag threads, so up to dma_tags of them are
+     * in flight at once. Each piece lands at its own offset of the buffer,
+     * so completions may return in any order. The caller blocks until all
+     * pieces are done.
+     */
+    bool dma_split_transfer(tlm::tlm_command cmd, uint64_t addr, unsigned char *data, unsigned int len)
+    {
+        bool is_read = (cmd == tlm::TLM_READ_COMMAND);
+        unsigned chunk = is_read ? link.get_config().mrrs : link.get_config().mps;
+        dma_batch batch;
+
+        batch.remaining = (len + chunk - 1) / chunk;
+        batch.ok = true;
+
+        for (unsigned int off = 0; off < len; off += chunk)
+        {
+            dma_request req = {cmd, addr + off, data + off, min(chunk, len - off), &batch};
+            dma_pending.push_back(req);
+        }
+        dma_work_event.notify();
+
+        while (batch.remaining)
+            wait(batch.done);
+
+        return batch.ok;
+    }
+
+    // One outstanding-request slot of the split-transaction DMA engine
+    void dma_tag_thread()
+    {
+        while (true)
+        {
+            while (dma_pending.empty() || dma_outstanding >= dma_tags)
+                wait(dma_work_event);
+
+            dma_request req = dma_pending.front();
+            dma_pending.pop_front();
+            bool is_read = (req.cmd == tlm::TLM_READ_COMMAND);
+
+            dma_outstanding++;
+            dma_engine.peak_outstanding = max(dma_engine.peak_outstanding, dma_outstanding);
+            if (is_read)
+            {
+                if (dma_reads_in_flight++ == 0)
+                    dma_read_since = sc_time_stamp();
+                dma_engine.read_requests++;
+                dma_engine.read_bytes += req.len;
+            }
+            else
+            {
+                dma_engine.write_tlps++;
+            }
+
+            // A DMI grant may have arrived since the transfer was split
+            sc_time delay = link_enabled ? SC_ZERO_TIME : dma_transfer_time(req.len);
+            const tlm::tlm_dmi *dmi = find_dmi(req.addr, req.len, is_read);
+            bool ok = dmi ? dmi_transfer(*dmi, is_read, req.addr, req.data, req.len, delay)
+                          : dma_single_transfer(req.cmd, req.addr, req.data, req.len, delay);
+
+            if (is_read && --dma_reads_in_flight == 0)
+                dma_engine.read_busy += sc_time_stamp() - dma_read_since;
+            dma_outstanding--;
+            dma_work_event.notify();
+
+            if (!ok)
+                req.batch->ok = false;
+            if (--req.batch->remaining == 0)
+                req.batch->done.notify();
+        }
+    }
+
+    const tlm::tlm_dmi *find_dmi(uint64_t addr, unsigned int len, bool is_read)
+    {
+        if (!dmi_enabled || len == 0)
+            return nullptr;
+
+        for (const tlm::tlm_dmi &dmi : dmi_regions)
+        {
+            if (addr < dmi.get_start_address() || addr + len - 1 > dmi.get_end_address())
+                continue;
+            if (is_read ? dmi.is_read_allowed() : dmi.is_write_allowed())
+                return &dmi;
+        }
+        return nullptr;
+    }
+
+    void acquire_dmi(tlm::tlm_command cmd, uint64_t addr)
     {
         tlm::tlm_generic_payload trans;
-        sc_time delay = sc_time(50, SC_NS);
+        tlm::tlm_dmi dmi;
+
+        // Another transfer in flight may already have been granted this region
+        if (find_dmi(addr, 1, cmd == tlm::TLM_READ_COMMAND))
+            return;
 
-        trans.set_command(tlm::TLM_WRITE_COMMAND);
+        trans.set_command(cmd);
         trans.set_address(addr);
-        trans.set_data_ptr(data);
-        trans.set_data_length(len);
-        trans.set_streaming_width(len);
-        trans.set_byte_enable_ptr(0);
-        trans.set_dmi_allowed(false);
-        trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+        trans.set_data_length(0);
 
-        dma_initiator_socket->b_transport(trans, delay);
-        wait(delay);
+        if (!dma_initiator_socket->get_direct_mem_ptr(trans, dmi) || !dmi.get_dmi_ptr())
+            return;
 
-        return trans.is_response_ok();
+        // Newest grant wins over any cached region it overlaps
+        drop_dmi(dmi.get_start_address(), dmi.get_end_address());
+        if (dmi_regions.size() >= MAX_DMI_REGIONS)
+            dmi_regions.erase(dmi_regions.begin());
+        dmi_regions.push_back(dmi);
+
+        MM_DEBUG("[" << sc_time_stamp() << "] DMI granted for 0x" << hex << dmi.get_start_address()
+                 << "-0x" << dmi.get_end_address() << dec);
+    }
+
+    void drop_dmi(uint64_t start, uint64_t end)
+    {
+        dmi_regions.erase(remove_if(dmi_regions.begin(), dmi_regions.end(),
+                                    [&](const tlm::tlm_dmi &dmi)
+                                    { return dmi.get_start_address() <= end && dmi.get_end_address() >= start; }),
+                          dmi_regions.end());
+    }
+
+    void invalidate_direct_mem_ptr(sc_dt::uint64 start, sc_dt::uint64 end)
+    {
+        drop_dmi(start, end);
     }
 
     void update_interrupt()
@@ -318,91 +1716,581 @@ private:
         interrupt_update_event.notify();
     }
 
-    void compute_thread()
+    bool queues_pending()
+    {
+        for (unsigned i = 0; i < MM_NUM_QUEUES; i++)
+        {
+            if (queues[i].sq_size && queues[i].sq_head != queues[i].sq_tail)
+                return true;
+        }
+        return false;
+    }
+
+    /**
+     * On-device job scheduler.
+     *
+     * Accepts the BAR0 register job and fetches queued descriptors into a
+     * pending list of up to MAX_SQ_FETCH jobs, then hands jobs to idle
+     * engines, picking the engine round-robin and the job by
+     * REG_SCHED_POLICY. schedule_event covers CTRL_START, SQ tail doorbells
+     * and engines going idle.
+     */
+    void scheduler_thread()
     {
         while (true)
         {
-            wait(start_event);
+            if (computation_requested)
+                accept_register_job();
 
-            if (!computation_requested)
-                continue;
+            for (unsigned i = 0; i < MM_NUM_QUEUES && pending_jobs.size() < MAX_SQ_FETCH; i++)
+                fetch_descriptors(i);
 
-            reg_status = STATUS_BUSY;
-            reg_status &= ~STATUS_IDLE;
-            computation_requested = false;
+            sync_local_time();
+            dispatch_jobs();
+
+            // Fetch DMA may have let engines finish or doorbells arrive
+            if (!scheduler_has_work())
+                wait(schedule_event);
+        }
+    }
+
+    bool scheduler_has_work()
+    {
+        if (computation_requested)
+            return true;
+        if (pending_jobs.size() < MAX_SQ_FETCH && queues_pending())
+            return true;
+        return !pending_jobs.empty() && idle_engine() >= 0;
+    }
+
+    void accept_register_job()
+    {
+        computation_requested = false;
+        reg_status = STATUS_BUSY;
+
+        scheduled_job sj = {{reg_dim_n, reg_matrix_a_ptr, reg_matrix_b_ptr, reg_matrix_c_ptr},
+                            JOB_SOURCE_REGISTERS, 0};
+        pending_jobs.push_back(sj);
+    }
+
+    /**
+     * Fetch the available descriptors of a submission queue, up to the
+     * free room in the pending list, with a single DMA read.
+     */
+    void fetch_descriptors(unsigned qid)
+    {
+        mm_queue &q = queues[qid];
+
+        if (q.sq_size == 0 || q.sq_head == q.sq_tail)
+            return;
 
-            cout << "[" << sc_time_stamp() << "] Starting matrix multiplication (N="
-                 << reg_dim_n << ")" << endl;
+        uint16_t avail = (q.sq_tail + q.sq_size - q.sq_head) % q.sq_size;
+        uint16_t count = min<uint16_t>(avail, q.sq_size - q.sq_head);
+        count = min<uint16_t>(count, MAX_SQ_FETCH - pending_jobs.size());
 
-            bool success = perform_matrix_multiply();
+        reg_status = (reg_status & ~STATUS_IDLE) | STATUS_BUSY;
 
-            if (success)
+        vector<mm_sq_entry> entries(count);
+        if (!dma_read(q.sq_base + (uint64_t)q.sq_head * sizeof(mm_sq_entry),
+                      (unsigned char *)entries.data(), count * sizeof(mm_sq_entry)))
+        {
+            MM_ERROR("ERROR: Failed to fetch descriptors from SQ " << qid << ", queue disabled");
+            q.sq_size = 0;
+            q.cq_size = 0;
+            reg_status = (reg_status & ~STATUS_BUSY) | STATUS_IDLE | STATUS_ERROR;
+            signal_error();
+            return;
+        }
+
+        MM_VERBOSE("[" << sc_time_stamp() << "] SQ " << qid << ": fetched " << dec << count
+                 << " descriptor(s)");
+
+        // The queue may have been reconfigured while the read was in flight
+        if (q.sq_size == 0)
+            return;
+
+        for (uint16_t i = 0; i < count; i++)
+        {
+            const mm_sq_entry &e = entries[i];
+            scheduled_job sj = {{e.dim_n, e.a_ptr, e.b_ptr, e.c_ptr}, qid, e.cid};
+            pending_jobs.push_back(sj);
+        }
+        q.sq_head = (q.sq_head + count) % q.sq_size;
+        q.jobs_in_flight += count;
+    }
+
+    int idle_engine()
+    {
+        for (unsigned i = 0; i < num_engines; i++)
+        {
+            unsigned id = (next_engine + i) % num_engines;
+            if (!engines[id]->busy)
+                return id;
+        }
+        return -1;
+    }
+
+    // Index in pending_jobs of the job to run next
+    size_t pick_job()
+    {
+        if (sched_policy == SCHED_SJF)
+        {
+            size_t best = 0;
+            for (size_t i = 1; i < pending_jobs.size(); i++)
             {
-                reg_status = STATUS_IDLE | STATUS_DONE;
-                reg_int_status |= INT_DONE;
-                cout << "[" << sc_time_stamp() << "] Computation completed successfully" << endl;
+                if (pending_jobs[i].job.n < pending_jobs[best].job.n)
+                    best = i;
             }
-            else
+            return best;
+        }
+
+        // Round-robin over the queues and the register interface
+        for (unsigned s = 0; s <= MM_NUM_QUEUES; s++)
+        {
+            unsigned source = (next_source + s) % (MM_NUM_QUEUES + 1);
+            for (size_t i = 0; i < pending_jobs.size(); i++)
             {
-                reg_status = STATUS_IDLE | STATUS_ERROR;
-                cout << "[" << sc_time_stamp() << "] Computation failed!" << endl;
+                if (pending_jobs[i].source == source)
+                {
+                    next_source = (source + 1) % (MM_NUM_QUEUES + 1);
+                    return i;
+                }
             }
+        }
+        return 0;
+    }
 
-            update_interrupt();
+    void dispatch_jobs()
+    {
+        int id;
+
+        while (!pending_jobs.empty() && (id = idle_engine()) >= 0)
+        {
+            size_t pick = pick_job();
+            compute_engine &e = *engines[id];
+
+            e.job = pending_jobs[pick];
+            pending_jobs.erase(pending_jobs.begin() + pick);
+            e.busy = true;
+            e.busy_since = sc_time_stamp();
+            if (engines_busy++ == 0)
+                perf_busy_since = sc_time_stamp();
+            next_engine = (id + 1) % num_engines;
+
+            if (num_engines > 1)
+                MM_DEBUG("[" << sc_time_stamp() << "] Engine " << dec << id << ": N=" << e.job.job.n
+                         << " from " << (e.job.source == JOB_SOURCE_REGISTERS ? "registers" : "SQ ")
+                         << (e.job.source == JOB_SOURCE_REGISTERS ? "" : to_string(e.job.source)));
+            e.dispatch_event.notify();
         }
+
+        refresh_busy_status();
     }
 
-    bool perform_matrix_multiply()
+    // BUSY while any job is pending or running; DONE/ERROR are left alone
+    void refresh_busy_status()
     {
-        uint32_t n = reg_dim_n;
+        bool active = !pending_jobs.empty();
+        for (unsigned i = 0; i < engines.size() && !active; i++)
+            active = engines[i]->busy;
 
-        if (n == 0 || n > 256)
+        if (active)
         {
-            cout << "ERROR: Invalid matrix dimension" << endl;
-            return false;
+            reg_status = (reg_status & ~STATUS_IDLE) | STATUS_BUSY;
+        }
+        else
+        {
+            reg_status = (reg_status & ~STATUS_BUSY) | STATUS_IDLE;
+            idle_event.notify(SC_ZERO_TIME);
         }
+    }
 
-        vector<float> matrix_a(n * n);
-        vector<float> matrix_b(n * n);
-        vector<float> matrix_c(n * n, 0.0f);
+    // One compute unit: run whatever the scheduler assigns, then report back
+    void engine_thread(unsigned id)
+    {
+        compute_engine &e = *engines[id];
 
-        cout << "  Reading Matrix A from 0x" << hex << reg_matrix_a_ptr << endl;
-        if (!dma_read(reg_matrix_a_ptr, (unsigned char *)matrix_a.data(), n * n * sizeof(float)))
+        while (true)
         {
-            cout << "ERROR: Failed to read Matrix A" << endl;
-            return false;
+            while (!e.busy)
+                wait(e.dispatch_event);
+
+            if (e.job.source == JOB_SOURCE_REGISTERS)
+                MM_DEBUG("[" << sc_time_stamp() << "] Starting matrix multiplication (N="
+                         << dec << e.job.job.n << ")");
+
+            uint16_t status = perform_matrix_multiply(e, e.job.job);
+            sync_local_time();
+
+            if (e.job.source == JOB_SOURCE_REGISTERS)
+                complete_register_job(status);
+            else
+                complete_queue_job(e.job.source, e.job.cid, status);
+
+            e.busy_time += sc_time_stamp() - e.busy_since;
+            e.jobs_done++;
+            e.busy = false;
+            perf.jobs++;
+            if (--engines_busy == 0)
+                perf.busy += sc_time_stamp() - perf_busy_since;
+            refresh_busy_status();
+            schedule_event.notify();
         }
+    }
+
+    void complete_register_job(uint16_t status)
+    {
+        dma_fence();
+        sync_local_time();
 
-        cout << "  Reading Matrix B from 0x" << hex << reg_matrix_b_ptr << endl;
-        if (!dma_read(reg_matrix_b_ptr, (unsigned char *)matrix_b.data(), n * n * sizeof(float)))
+        if (status == CQ_STATUS_SUCCESS)
         {
-            cout << "ERROR: Failed to read Matrix B" << endl;
-            return false;
+            reg_status |= STATUS_DONE;
+            reg_int_status |= INT_DONE;
+            MM_DEBUG("[" << sc_time_stamp() << "] Computation completed successfully");
+            signal_vector(MSIX_VEC_MISC, true);
         }
+        else
+        {
+            reg_status |= STATUS_ERROR;
+            MM_ERROR("[" << sc_time_stamp() << "] Computation failed!");
+            signal_error();
+        }
+    }
+
+    void complete_queue_job(unsigned qid, uint16_t cid, uint16_t status)
+    {
+        mm_queue &q = queues[qid];
+
+        if (status != CQ_STATUS_SUCCESS)
+            perf.errors++;
+        post_completion(qid, cid, status);
+
+        if (q.jobs_in_flight)
+            q.jobs_in_flight--;
+        if (q.jobs_in_flight == 0 && q.sq_head == q.sq_tail)
+            flush_vector(qid);
+    }
+
+    /**
+     * Completions from different engines may finish in any order; each
+     * takes its CQ slot and phase before the DMA write, so concurrent
+     * writers never share a slot. The host matches entries by cid.
+     */
+    void post_completion(unsigned qid, uint16_t cid, uint16_t status)
+    {
+        mm_queue &q = queues[qid];
+
+        // Back-pressure: hold the completion until the host frees a CQ slot.
+        // The host only reaps on an interrupt, so stop aggregating first.
+        while (q.cq_size && (q.cq_tail + 1) % q.cq_size == q.cq_head)
+        {
+            flush_vector(qid);
+            sync_local_time();
+            wait(cq_space_event);
+        }
+
+        if (q.cq_size == 0)
+            return;
+
+        uint16_t slot = q.cq_tail;
+        mm_cq_entry cqe;
+        memset(&cqe, 0, sizeof(cqe));
+        cqe.sq_head = q.sq_head;
+        cqe.sq_id = qid;
+        cqe.cid = cid;
+        cqe.status = (status << 1) | (q.cq_phase ? 1 : 0);
+
+        q.cq_tail = (q.cq_tail + 1) % q.cq_size;
+        if (q.cq_tail == 0)
+            q.cq_phase = !q.cq_phase;
+
+        if (!dma_write(q.cq_base + (uint64_t)slot * sizeof(mm_cq_entry),
+                       (unsigned char *)&cqe, sizeof(cqe)))
+        {
+            MM_ERROR("ERROR: Failed to post completion on CQ " << qid);
+            signal_error();
+            return;
+        }
+
+        sync_local_time();
+        signal_vector(qid, false);
+    }
+
+    uint16_t perform_matrix_multiply(compute_engine &e, const gemm_job &job)
+    {
+        mm_profile_scope prof(prof_job);
+        uint32_t n = job.n;
+
+        if (n == 0 || n > MAX_DIM_N)
+        {
+            MM_ERROR("ERROR: Invalid matrix dimension");
+            return CQ_STATUS_INVALID_DIM;
+        }
+
+        uint64_t resident_bytes = 3ULL * n * n * sizeof(float);
+        bool resident = (job_exec_mode == EXEC_RESIDENT) ||
+                        (job_exec_mode == EXEC_AUTO && resident_bytes <= tile_budget);
+
+        if (resident)
+            return perform_resident(e, job);
+
+        return perform_streaming(e, job);
+    }
+
+    uint16_t perform_resident(compute_engine &e, const gemm_job &job)
+    {
+        uint32_t n = job.n;
+        vector<float> &matrix_a = e.resident_a;
+        vector<float> &matrix_b = e.resident_b;
+        vector<float> &matrix_c = e.resident_c;
+
+        matrix_a.resize((size_t)n * n);
+        matrix_b.resize((size_t)n * n);
+        matrix_c.assign((size_t)n * n, 0.0f);
+
+        MM_VERBOSE("  Reading Matrix A from 0x" << hex << job.a_ptr);
+        if (!dma_read(job.a_ptr, (unsigned char *)matrix_a.data(), n * n * sizeof(float)))
+        {
+            MM_ERROR("ERROR: Failed to read Matrix A");
+            return CQ_STATUS_DMA_ERROR;
+        }
+
+        MM_VERBOSE("  Reading Matrix B from 0x" << hex << job.b_ptr);
+        if (!dma_read(job.b_ptr, (unsigned char *)matrix_b.data(), n * n * sizeof(float)))
+        {
+            MM_ERROR("ERROR: Failed to read Matrix B");
+            return CQ_STATUS_DMA_ERROR;
+        }
+
+        MM_VERBOSE("  Computing C = A * B (" << gemm_isa_name(gemm_host_isa())
+                 << (compute_mode == GEMM_MODE_FAST ? ", fast" : ", reference-order") << ")...");
+
+        // The datapath produces one output row every 2*N ns
+        e.offload.start(compute_mode, n, n, n,
+                        matrix_a.data(), n,
+                        matrix_b.data(), n,
+                        matrix_c.data(), n);
+        consume(sc_time((double)n * n * 2, SC_NS));
+        e.offload.finish();
+
+        MM_VERBOSE("  Writing Matrix C to 0x" << hex << job.c_ptr);
+        if (!dma_write(job.c_ptr, (unsigned char *)matrix_c.data(), n * n * sizeof(float)))
+        {
+            MM_ERROR("ERROR: Failed to write Matrix C");
+            return CQ_STATUS_DMA_ERROR;
+        }
+
+        return CQ_STATUS_SUCCESS;
+    }
+
+    /**
+     * Streaming execution for matrices that do not fit the tile budget.
+     *
+     * C is produced one row panel (T rows x N) at a time. For each panel the
+     * matching rows of A are fetched once, then B is streamed through in
+     * k panels (T rows x N, contiguous in host memory) and accumulated into
+     * the C panel, which is written back as soon as it is complete.
+     *
+     * The engine's dma_in_thread, its compute thread (this one) and its
+     * dma_out_thread run as a pipeline over pipeline_depth buffers of each kind, so panel fetches
+     * and write-backs overlap with compute. Device memory in use is
+     * 3 * depth * T * N floats, with T derived from the tile budget.
+     */
+    uint16_t perform_streaming(compute_engine &e, const gemm_job &job)
+    {
+        uint32_t n = job.n;
+        uint64_t row_bytes = (uint64_t)n * sizeof(float);
+        uint64_t panel_rows = tile_budget / (3ULL * pipeline_depth * row_bytes);
+
+        if (panel_rows == 0)
+        {
+            MM_ERROR("ERROR: Tile budget of " << dec << tile_budget
+                     << " bytes cannot hold one row panel for N=" << n);
+            return CQ_STATUS_NO_BUFFER;
+        }
+        if (panel_rows > n)
+            panel_rows = n;
 
-        cout << "  Computing C = A * B..." << endl;
-        for (uint32_t i = 0; i < n; i++)
+        uint32_t t = (uint32_t)panel_rows;
+
+        e.a_bufs.assign(pipeline_depth, vector<float>((size_t)t * n));
+        e.b_bufs.assign(pipeline_depth, vector<float>((size_t)t * n));
+        e.c_bufs.assign(pipeline_depth, vector<float>((size_t)t * n));
+        for (unsigned i = 0; i < pipeline_depth; i++)
         {
-            for (uint32_t j = 0; j < n; j++)
+            e.a_free.write(i);
+            e.b_free.write(i);
+            e.c_free.write(i);
+        }
+
+        e.stream_job = job;
+        e.stream_rows = t;
+        e.stream_error = false;
+        e.stream_done = false;
+        e.stream_stats = pipeline_stats();
+        e.stream_stats.depth = pipeline_depth;
+        e.stream_stats.buffer_bytes = 3ULL * pipeline_depth * panel_rows * row_bytes;
+
+        MM_DEBUG("  Streaming N=" << dec << n << " in panels of " << t << " rows, "
+                 << pipeline_depth << " buffers per stage ("
+                 << e.stream_stats.buffer_bytes / 1024 << " KB on device)");
+
+        sc_time start = sc_time_stamp();
+        e.stream_start_event.notify();
+
+        for (uint32_t i0 = 0; i0 < n; i0 += t)
+        {
+            uint32_t rows = (n - i0 < t) ? n - i0 : t;
+            int a_idx = pipeline_read(e.a_full);
+            int c_idx = pipeline_read(e.c_free);
+            float *panel_c = e.c_bufs[c_idx].data();
+
+            fill(panel_c, panel_c + (size_t)rows * n, 0.0f);
+
+            for (uint32_t k0 = 0; k0 < n; k0 += t)
             {
-                float sum = 0.0f;
-                for (uint32_t k = 0; k < n; k++)
+                uint32_t depth = (n - k0 < t) ? n - k0 : t;
+                int b_idx = pipeline_read(e.b_full);
+
+                if (!e.stream_error)
                 {
-                    sum += matrix_a[i * n + k] * matrix_b[k * n + j];
+                    sc_time busy_start = local_time_now();
+                    // Same datapath rate as the resident path: 2 ns per k step per row
+                    e.offload.start(compute_mode, rows, n, depth,
+                                    e.a_bufs[a_idx].data() + k0, n,
+                                    e.b_bufs[b_idx].data(), n,
+                                    panel_c, n);
+                    consume(sc_time((double)rows * depth * 2, SC_NS));
+                    e.offload.finish();
+                    e.stream_stats.compute_busy += local_time_now() - busy_start;
                 }
-                matrix_c[i * n + j] = sum;
+
+                e.b_free.write(b_idx);
             }
-            wait(sc_time(n * 2, SC_NS));
+
+            e.a_free.write(a_idx);
+            e.c_full.write(c_idx);
         }
 
-        cout << "  Writing Matrix C to 0x" << hex << reg_matrix_c_ptr << endl;
-        if (!dma_write(reg_matrix_c_ptr, (unsigned char *)matrix_c.data(), n * n * sizeof(float)))
+        sync_local_time();
+        while (!e.stream_done)
+            wait(e.stream_done_event);
+        // DMA-out's last c_free write only becomes readable in the update
+        // phase; a leftover index would alias a buffer in the next job
+        wait(SC_ZERO_TIME);
+
+        // Drain the free lists so the next job starts from a clean pipeline
+        int idx;
+        while (e.a_free.nb_read(idx))
+            ;
+        while (e.b_free.nb_read(idx))
+            ;
+        while (e.c_free.nb_read(idx))
+            ;
+
+        e.stream_stats.elapsed = sc_time_stamp() - start;
+
+        MM_DEBUG("  Pipeline: elapsed " << e.stream_stats.elapsed
+                 << ", DMA-in busy " << e.stream_stats.dma_in_busy
+                 << ", compute busy " << e.stream_stats.compute_busy
+                 << ", DMA-out busy " << e.stream_stats.dma_out_busy
+                 << ", overlap " << fixed << setprecision(1)
+                 << e.stream_stats.overlap_ratio() * 100.0 << "%" << defaultfloat);
+
+        last_stream_stats = e.stream_stats;
+        return e.stream_error ? CQ_STATUS_DMA_ERROR : CQ_STATUS_SUCCESS;
+    }
+
+    // Pipeline stage 1: fetch A row panels and B k panels into free buffers
+    void dma_in_thread(unsigned id)
+    {
+        compute_engine &e = *engines[id];
+
+        while (true)
         {
-            cout << "ERROR: Failed to write Matrix C" << endl;
-            return false;
+            wait(e.stream_start_event);
+
+            uint32_t n = e.stream_job.n;
+            uint32_t t = e.stream_rows;
+            uint64_t row_bytes = (uint64_t)n * sizeof(float);
+
+            for (uint32_t i0 = 0; i0 < n; i0 += t)
+            {
+                uint32_t rows = (n - i0 < t) ? n - i0 : t;
+                int a_idx = pipeline_read(e.a_free);
+
+                if (!e.stream_error)
+                {
+                    sc_time busy_start = local_time_now();
+                    if (!dma_read(e.stream_job.a_ptr + i0 * row_bytes, (unsigned char *)e.a_bufs[a_idx].data(),
+                                  (unsigned int)(rows * row_bytes)))
+                    {
+                        MM_ERROR("ERROR: Failed to read Matrix A rows " << dec << i0);
+                        e.stream_error = true;
+                    }
+                    e.stream_stats.dma_in_busy += local_time_now() - busy_start;
+                }
+                e.a_full.write(a_idx);
+
+                for (uint32_t k0 = 0; k0 < n; k0 += t)
+                {
+                    uint32_t depth = (n - k0 < t) ? n - k0 : t;
+                    int b_idx = pipeline_read(e.b_free);
+
+                    if (!e.stream_error)
+                    {
+                        sc_time busy_start = local_time_now();
+                        if (!dma_read(e.stream_job.b_ptr + k0 * row_bytes, (unsigned char *)e.b_bufs[b_idx].data(),
+                                      (unsigned int)(depth * row_bytes)))
+                        {
+                            MM_ERROR("ERROR: Failed to read Matrix B rows " << dec << k0);
+                            e.stream_error = true;
+                        }
+                        e.stream_stats.dma_in_busy += local_time_now() - busy_start;
+                    }
+                    e.b_full.write(b_idx);
+                }
+            }
         }
+    }
 
-        return true;
+    // Pipeline stage 3: write finished C panels back to host memory
+    void dma_out_thread(unsigned id)
+    {
+        compute_engine &e = *engines[id];
+
+        while (true)
+        {
+            wait(e.stream_start_event);
+
+            uint32_t n = e.stream_job.n;
+            uint32_t t = e.stream_rows;
+            uint64_t row_bytes = (uint64_t)n * sizeof(float);
+
+            for (uint32_t i0 = 0; i0 < n; i0 += t)
+            {
+                uint32_t rows = (n - i0 < t) ? n - i0 : t;
+                int c_idx = pipeline_read(e.c_full);
+
+                if (!e.stream_error)
+                {
+                    sc_time busy_start = local_time_now();
+                    if (!dma_write(e.stream_job.c_ptr + i0 * row_bytes, (unsigned char *)e.c_bufs[c_idx].data(),
+                                   (unsigned int)(rows * row_bytes)))
+                    {
+                        MM_ERROR("ERROR: Failed to write Matrix C rows " << dec << i0);
+                        e.stream_error = true;
+                    }
+                    e.stream_stats.dma_out_busy += local_time_now() - busy_start;
+                }
+                e.c_free.write(c_idx);
+            }
+
+            sync_local_time();
+            e.stream_done = true;
+            e.stream_done_event.notify();
+        }
     }
 };
 
@@ -0,0 +1,390 @@
+#ifndef MM_CHECKPOINT_H
+#define MM_CHECKPOINT_H
+
+#include <systemc>
+#include <tlm>
+#include <tlm_utils/simple_initiator_socket.h>
+#include <tlm_utils/simple_target_socket.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include "mm_log.h"
+
+using namespace sc_core;
+
+/**
+ * Endpoint checkpoint/restore.
+ *
+ * A snapshot is a small binary file: a header, then tagged sections
+ * ({tag, length, bytes}) that each component writes and reads on its own,
+ * so a reader can skip sections it does not know. Values are stored in
+ * host byte order; snapshots are meant to be restored on the machine
+ * that took them, next to the matching QEMU savevm image.
+ */
+
+#define MM_SNAPSHOT_MAGIC "MMCKPT"
+#define MM_SNAPSHOT_VERSION 1
+
+// Section tags
+#define MM_SNAPSHOT_DEVICE 0x30564544  // "DEV0": matrix_multiplier_pcie
+#define MM_SNAPSHOT_CONFIG 0x30474643  // "CFG0": PCIe config-write journal
+
+class mm_snapshot_writer
+{
+public:
+    mm_snapshot_writer() : section_start(0)
+    {
+        char magic[8] = MM_SNAPSHOT_MAGIC;
+        put_bytes(magic, sizeof(magic));
+        put<uint32_t>(MM_SNAPSHOT_VERSION);
+    }
+
+    void begin_section(uint32_t tag)
+    {
+        put(tag);
+        section_start = buf.size();
+        put<uint32_t>(0);
+    }
+
+    void end_section()
+    {
+        uint32_t len = buf.size() - section_start - sizeof(uint32_t);
+        memcpy(&buf[section_start], &len, sizeof(len));
+    }
+
+    template <typename T>
+    void put(const T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot fields are copied bytewise");
+        put_bytes(&value, sizeof(value));
+    }
+
+    void put_bytes(const void *data, size_t len)
+    {
+        const unsigned char *p = (const unsigned char *)data;
+        buf.insert(buf.end(), p, p + len);
+    }
+
+    void put_time(const sc_time &t)
+    {
+        put<uint64_t>(t.value());
+    }
+
+    // Write to path.tmp and rename, so a crash never leaves half a snapshot
+    bool write_file(const std::string &path) const
+    {
+        std::string tmp = path + ".tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            MM_ERROR("ERROR: Cannot create " << tmp << ": " << strerror(errno));
+            return false;
+        }
+
+        bool ok = write(fd, buf.data(), buf.size()) == (ssize_t)buf.size() && fsync(fd) == 0;
+        close(fd);
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+        {
+            MM_ERROR("ERROR: Cannot write snapshot " << path << ": " << strerror(errno));
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    size_t size() const
+    {
+        return buf.size();
+    }
+
+private:
+    std::vector<unsigned char> buf;
+    size_t section_start;
+};
+
+class mm_snapshot_reader
+{
+public:
+    mm_snapshot_reader() : pos(0), limit(0) {}
+
+    bool read_file(const std::string &path)
+    {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f)
+        {
+            MM_ERROR("ERROR: Cannot open snapshot " << path << ": " << strerror(errno));
+            return false;
+        }
+        fseek(f, 0, SEEK_END);
+        buf.resize(ftell(f));
+        fseek(f, 0, SEEK_SET);
+        bool ok = fread(buf.data(), 1, buf.size(), f) == buf.size();
+        fclose(f);
+
+        char magic[8] = MM_SNAPSHOT_MAGIC;
+        uint32_t version = 0;
+        pos = 0;
+        limit = buf.size();
+        if (!ok || buf.size() < sizeof(magic) || memcmp(buf.data(), magic, sizeof(magic)) != 0)
+        {
+            MM_ERROR("ERROR: " << path << " is not an endpoint snapshot");
+            return false;
+        }
+        pos = sizeof(magic);
+        if (!get(version) || version != MM_SNAPSHOT_VERSION)
+        {
+            MM_ERROR("ERROR: " << path << " is snapshot version " << version << ", expected "
+                     << MM_SNAPSHOT_VERSION);
+            return false;
+        }
+        return true;
+    }
+
+    // Position at a section's payload; false if the snapshot has none
+    bool open_section(uint32_t tag)
+    {
+        size_t p = HEADER_BYTES;
+        while (p + 2 * sizeof(uint32_t) <= buf.size())
+        {
+            uint32_t t, len;
+            memcpy(&t, &buf[p], sizeof(t));
+            memcpy(&len, &buf[p + sizeof(t)], sizeof(len));
+            p += 2 * sizeof(uint32_t);
+            if (p + len > buf.size())
+                break;
+            if (t == tag)
+            {
+                pos = p;
+                limit = p + len;
+                return true;
+            }
+            p += len;
+        }
+        return false;
+    }
+
+    template <typename T>
+    bool get(T &value)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "snapshot fields are copied bytewise");
+        return get_bytes(&value, sizeof(value));
+    }
+
+    bool get_bytes(void *data, size_t len)
+    {
+        if (pos + len > limit)
+            return false;
+        memcpy(data, &buf[pos], len);
+        pos += len;
+        return true;
+    }
+
+    bool get_time(sc_time &t)
+    {
+        uint64_t v;
+        if (!get(v))
+            return false;
+        t = sc_time::from_value(v);
+        return true;
+    }
+
+private:
+    static const size_t HEADER_BYTES = 8 + sizeof(uint32_t); // magic, version
+
+    std::vector<unsigned char> buf;
+    size_t pos;
+    size_t limit;
+};
+
+/**
+ * Records the config-space writes QEMU sends down the root-port link, so
+ * a restore can rebuild the controller's config space (BARs, command
+ * register, MSI-X enable) without the guest enumerating again.
+ *
+ * Sits on both directions of the link. Downstream TLPs pass through and
+ * configuration writes (Fmt/Type byte 0x44 or 0x45) are kept, the last
+ * write per register only. replay() sends them to the controller again
+ * and swallows the completions it answers with on the upstream side, so
+ * QEMU never sees them. Everything else is forwarded untouched.
+ */
+SC_MODULE(pcie_config_journal)
+{
+    // Root port -> controller
+    tlm_utils::simple_target_socket<pcie_config_journal> down_target_socket;
+    tlm_utils::simple_initiator_socket<pcie_config_journal> down_init_socket;
+    // Controller -> root port
+    tlm_utils::simple_target_socket<pcie_config_journal> up_target_socket;
+    tlm_utils::simple_initiator_socket<pcie_config_journal> up_init_socket;
+
+    SC_CTOR(pcie_config_journal)
+        : down_target_socket("down_target_socket"),
+          down_init_socket("down_init_socket"),
+          up_target_socket("up_target_socket"),
+          up_init_socket("up_init_socket"),
+          completions_to_drop(0)
+    {
+        down_target_socket.register_b_transport(this, &pcie_config_journal::down_b_transport);
+        down_target_socket.register_transport_dbg(this, &pcie_config_journal::down_transport_dbg);
+        down_init_socket.register_invalidate_direct_mem_ptr(this, &pcie_config_journal::down_invalidate);
+        up_target_socket.register_b_transport(this, &pcie_config_journal::up_b_transport);
+        up_target_socket.register_transport_dbg(this, &pcie_config_journal::up_transport_dbg);
+        up_target_socket.register_get_direct_mem_ptr(this, &pcie_config_journal::up_get_direct_mem_ptr);
+        up_init_socket.register_invalidate_direct_mem_ptr(this, &pcie_config_journal::up_invalidate);
+    }
+
+    size_t entries() const
+    {
+        return journal.size();
+    }
+
+    void save(mm_snapshot_writer &w) const
+    {
+        w.begin_section(MM_SNAPSHOT_CONFIG);
+        w.put<uint32_t>(journal.size());
+        for (size_t i = 0; i < journal.size(); i++)
+        {
+            w.put<uint64_t>(journal[i].address);
+            w.put<uint32_t>(journal[i].tlp.size());
+            w.put_bytes(journal[i].tlp.data(), journal[i].tlp.size());
+        }
+        w.end_section();
+    }
+
+    // Re-issue the saved writes; call from an SC_THREAD before QEMU traffic.
+    // The whole section is parsed first, so on failure nothing was sent
+    // and the journal is unchanged.
+    bool replay(mm_snapshot_reader &r)
+    {
+        uint32_t count;
+        if (!r.open_section(MM_SNAPSHOT_CONFIG) || !r.get(count))
+            return false;
+
+        std::vector<config_write> saved;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            config_write cw;
+            uint32_t len;
+            if (!r.get(cw.address) || !r.get(len) || len > MAX_TLP_BYTES)
+                return false;
+            cw.tlp.resize(len);
+            if (!r.get_bytes(cw.tlp.data(), len))
+                return false;
+            saved.push_back(cw);
+        }
+        journal.swap(saved);
+
+        for (size_t i = 0; i < journal.size(); i++)
+        {
+            tlm::tlm_generic_payload trans;
+            std::vector<unsigned char> tlp = journal[i].tlp;
+            sc_time delay = SC_ZERO_TIME;
+
+            trans.set_command(tlm::TLM_WRITE_COMMAND);
+            trans.set_address(journal[i].address);
+            trans.set_data_ptr(tlp.data());
+            trans.set_data_length(tlp.size());
+            trans.set_streaming_width(tlp.size());
+            trans.set_byte_enable_ptr(0);
+            trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+
+            completions_to_drop++;
+            down_init_socket->b_transport(trans, delay);
+            wait(delay);
+        }
+        return true;
+    }
+
+private:
+    static const uint32_t MAX_TLP_BYTES = 4096 + 16;
+
+    struct config_write
+    {
+        uint64_t address;
+        std::vector<unsigned char> tlp;
+    };
+    std::vector<config_write> journal;
+    unsigned completions_to_drop;
+
+    // TLP header byte 0 is Fmt[7:5] Type[4:0]
+    static bool is_config_write(const tlm::tlm_generic_payload &trans)
+    {
+        return trans.get_data_length() >= 12 && (trans.get_data_ptr()[0] & 0xFE) == 0x44;
+    }
+
+    static bool is_completion(const tlm::tlm_generic_payload &trans)
+    {
+        return trans.get_data_length() >= 12 && (trans.get_data_ptr()[0] & 0x1F) == 0x0A;
+    }
+
+    // Same target register: requester ID and tag (bytes 4-6) vary, the
+    // byte enables (7) and bus/device/function/register (8-11) do not
+    static bool same_register(const std::vector<unsigned char> &a, const unsigned char *b)
+    {
+        return memcmp(&a[7], b + 7, 5) == 0;
+    }
+
+    void down_b_transport(tlm::tlm_generic_payload &trans, sc_time &delay)
+    {
+        if (is_config_write(trans))
+        {
+            const unsigned char *p = trans.get_data_ptr();
+            for (size_t i = 0; i < journal.size(); i++)
+            {
+                if (same_register(journal[i].tlp, p))
+                {
+                    journal.erase(journal.begin() + i);
+                    break;
+                }
+            }
+            config_write cw;
+            cw.address = trans.get_address();
+            cw.tlp.assign(p, p + trans.get_data_length());
+            journal.push_back(cw);
+        }
+        down_init_socket->b_transport(trans, delay);
+    }
+
+    unsigned int down_transport_dbg(tlm::tlm_generic_payload &trans)
+    {
+        return down_init_socket->transport_dbg(trans);
+    }
+
+    void down_invalidate(sc_dt::uint64 start, sc_dt::uint64 end)
+    {
+        down_target_socket->invalidate_direct_mem_ptr(start, end);
+    }
+
+    void up_b_transport(tlm::tlm_generic_payload &trans, sc_time &delay)
+    {
+        if (completions_to_drop && is_completion(trans))
+        {
+            completions_to_drop--;
+            trans.set_response_status(tlm::TLM_OK_RESPONSE);
+            return;
+        }
+        up_init_socket->b_transport(trans, delay);
+    }
+
+    unsigned int up_transport_dbg(tlm::tlm_generic_payload &trans)
+    {
+        return up_init_socket->transport_dbg(trans);
+    }
+
+    bool up_get_direct_mem_ptr(tlm::tlm_generic_payload &trans, tlm::tlm_dmi &dmi)
+    {
+        return up_init_socket->get_direct_mem_ptr(trans, dmi);
+    }
+
+    void up_invalidate(sc_dt::uint64 start, sc_dt::uint64 end)
+    {
+        up_target_socket->invalidate_direct_mem_ptr(start, end);
+    }
+};
+
+#endif // MM_CHECKPOINT_H
@@ -0,0 +1,274 @@
+#ifndef MM_LOG_H
+#define MM_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+/**
+ * Leveled, asynchronous logging for the simulation.
+ *
+ * MM_LOG(level, a << b << c) formats its stream expression only when the
+ * level is enabled, copies the text into a slot of a lock-free ring and
+ * returns; a background thread writes the ring to stdout. The calling
+ * thread never blocks on the console, and a disabled message costs one
+ * integer compare. Errors and warnings are off the hot path and go
+ * straight to stderr instead, so they survive an abort.
+ *
+ * Levels are filtered twice:
+ *   - at compile time, messages above MM_LOG_COMPILE_LEVEL are removed
+ *     (e.g. -DMM_LOG_COMPILE_LEVEL=2 strips debug and trace);
+ *   - at run time, messages above the current level are skipped. The level
+ *     starts at info and can be set with MM_LOG_LEVEL=error|warn|info|
+ *     debug|trace (or 0..4) or mm_log::set_level().
+ *
+ * Per-transaction messages use debug or trace, so the default level does
+ * no formatting on the transaction path. The trace-level macro is
+ * MM_VERBOSE, since MM_TRACE names the transaction recorder's variable. Code that writes to stdout
+ * directly should call mm_log::flush() first to keep the output ordered.
+ */
+
+#define MM_LOG_ERROR 0
+#define MM_LOG_WARN 1
+#define MM_LOG_INFO 2
+#define MM_LOG_DEBUG 3
+#define MM_LOG_TRACE 4
+
+#ifndef MM_LOG_COMPILE_LEVEL
+#define MM_LOG_COMPILE_LEVEL MM_LOG_TRACE
+#endif
+
+// Ring geometry: slots of MM_LOG_SLOT_BYTES, longer messages are cut
+#define MM_LOG_SLOTS 4096
+#define MM_LOG_SLOT_BYTES 512
+
+class mm_log
+{
+public:
+    static mm_log &instance()
+    {
+        static mm_log log;
+        return log;
+    }
+
+    static bool enabled(int level)
+    {
+        return level <= instance().level.load(std::memory_order_relaxed);
+    }
+
+    static void set_level(int lvl)
+    {
+        instance().level.store(std::max(MM_LOG_ERROR, std::min(lvl, MM_LOG_TRACE)), std::memory_order_relaxed);
+    }
+
+    static int get_level()
+    {
+        return instance().level.load(std::memory_order_relaxed);
+    }
+
+    // Block until everything logged so far has been written
+    static void flush()
+    {
+        mm_log &log = instance();
+        size_t target = log.head.load(std::memory_order_acquire);
+        while (log.written.load(std::memory_order_acquire) < target)
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        fflush(stdout);
+    }
+
+    // Messages that found the ring full and had to wait for the writer
+    static uint64_t stall_count()
+    {
+        return instance().stalls.load(std::memory_order_relaxed);
+    }
+
+    // Log one formatted message at lvl
+    void write(int lvl, const std::string &text)
+    {
+        if (lvl > MM_LOG_WARN)
+        {
+            push(lvl, text);
+            return;
+        }
+
+        // Let earlier messages out first so the console stays in order
+        flush();
+        std::string line = text + '\n';
+        fwrite(line.data(), 1, line.size(), stderr);
+    }
+
+    /**
+     * Enqueue one message. Safe from any thread: producers claim a slot
+     * by compare-and-swap on head and publish it through the slot's
+     * sequence number (bounded MPMC ring). If the ring is full the
+     * producer yields until the writer frees a slot; nothing is dropped.
+     */
+    void push(int lvl, const std::string &text)
+    {
+        size_t pos = head.load(std::memory_order_relaxed);
+        slot *s;
+        bool stalled = false;
+
+        while (true)
+        {
+            s = &ring[pos % MM_LOG_SLOTS];
+            size_t seq = s->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+            if (diff == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                if (!stalled)
+                    stalls.fetch_add(1, std::memory_order_relaxed);
+                stalled = true;
+                std::this_thread::yield();
+                pos = head.load(std::memory_order_relaxed);
+            }
+            else
+            {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+
+        size_t len = std::min(text.size(), (size_t)MM_LOG_SLOT_BYTES);
+        memcpy(s->text, text.data(), len);
+        s->len = (uint16_t)len;
+        s->level = (uint8_t)lvl;
+        s->seq.store(pos + 1, std::memory_order_release);
+
+        // Pairs with the fence in writer_thread: either the writer sees
+        // this slot before it sleeps, or we see it idle and wake it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (idle.load(std::memory_order_relaxed))
+            wake_writer();
+    }
+
+private:
+    struct slot
+    {
+        std::atomic<size_t> seq;
+        uint16_t len;
+        uint8_t level;
+        char text[MM_LOG_SLOT_BYTES];
+    };
+
+    slot ring[MM_LOG_SLOTS];
+    std::atomic<size_t> head;
+    std::atomic<size_t> written;
+    std::atomic<int> level;
+    std::atomic<uint64_t> stalls;
+    std::atomic<bool> stopping;
+    std::atomic<bool> idle;
+    std::mutex wake_lock;
+    std::condition_variable wake;
+    std::thread writer;
+
+    mm_log() : head(0), written(0), level(MM_LOG_INFO), stalls(0), stopping(false), idle(false)
+    {
+        for (size_t i = 0; i < MM_LOG_SLOTS; i++)
+            ring[i].seq.store(i, std::memory_order_relaxed);
+
+        if (const char *env = getenv("MM_LOG_LEVEL"))
+            level.store(parse_level(env), std::memory_order_relaxed);
+
+        writer = std::thread(&mm_log::writer_thread, this);
+    }
+
+    ~mm_log()
+    {
+        stopping.store(true, std::memory_order_release);
+        wake_writer();
+        writer.join();
+        fflush(stdout);
+    }
+
+    static int parse_level(const char *text)
+    {
+        static const char *names[] = {"error", "warn", "info", "debug", "trace"};
+        for (int i = MM_LOG_ERROR; i <= MM_LOG_TRACE; i++)
+        {
+            if (strcmp(text, names[i]) == 0)
+                return i;
+        }
+        if (text[0] >= '0' && text[0] <= '4' && text[1] == '\0')
+            return text[0] - '0';
+        fprintf(stderr, "WARNING: Ignoring unknown MM_LOG_LEVEL=%s\n", text);
+        return MM_LOG_INFO;
+    }
+
+    void wake_writer()
+    {
+        std::lock_guard<std::mutex> lock(wake_lock);
+        idle.store(false, std::memory_order_relaxed);
+        wake.notify_one();
+    }
+
+    // Single consumer: write slots in order, block while the ring is empty
+    void writer_thread()
+    {
+        size_t tail = 0;
+
+        while (true)
+        {
+            slot &s = ring[tail % MM_LOG_SLOTS];
+            if (s.seq.load(std::memory_order_acquire) == tail + 1)
+            {
+                fwrite(s.text, 1, s.len, stdout);
+                fputc('\n', stdout);
+                s.seq.store(tail + MM_LOG_SLOTS, std::memory_order_release);
+                tail++;
+                written.store(tail, std::memory_order_release);
+                continue;
+            }
+
+            fflush(stdout);
+            if (stopping.load(std::memory_order_acquire) && tail == head.load(std::memory_order_acquire))
+                return;
+
+            std::unique_lock<std::mutex> lock(wake_lock);
+            idle.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (s.seq.load(std::memory_order_acquire) == tail + 1 || stopping.load(std::memory_order_acquire))
+            {
+                idle.store(false, std::memory_order_relaxed);
+                continue;
+            }
+            wake.wait(lock, [this] { return !idle.load(std::memory_order_relaxed); });
+        }
+    }
+};
+
+// True if a message at lvl would be logged; guards multi-statement formatting
+#define MM_LOG_ON(lvl) ((lvl) <= MM_LOG_COMPILE_LEVEL && mm_log::enabled(lvl))
+
+#define MM_LOG(lvl, msg)                                     \
+    do                                                       \
+    {                                                        \
+        if (MM_LOG_ON(lvl))                                  \
+        {                                                    \
+            std::ostringstream mm_log_os_;                   \
+            mm_log_os_ << msg;                               \
+            mm_log::instance().write(lvl, mm_log_os_.str()); \
+        }                                                    \
+    } while (0)
+
+#define MM_ERROR(msg) MM_LOG(MM_LOG_ERROR, msg)
+#define MM_WARN(msg) MM_LOG(MM_LOG_WARN, msg)
+#define MM_INFO(msg) MM_LOG(MM_LOG_INFO, msg)
+#define MM_DEBUG(msg) MM_LOG(MM_LOG_DEBUG, msg)
+#define MM_VERBOSE(msg) MM_LOG(MM_LOG_TRACE, msg)
+
+#endif // MM_LOG_H
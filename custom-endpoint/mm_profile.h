@@ -0,0 +1,248 @@
+#ifndef MM_PROFILE_H
+#define MM_PROFILE_H
+
+#include <systemc>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "mm_log.h"
+
+using namespace sc_core;
+
+/**
+ * Host-side profile of the simulator itself.
+ *
+ * Probes sit on the hot entry points: remote-port transport, BAR0
+ * accesses, DMA and job execution. Each call records its host time, read
+ * from the TSC, into a histogram, together with the simulated time that
+ * passed. A call that suspends (wait() on the kernel) also includes the
+ * time other processes ran meanwhile, so those calls are counted apart:
+ * "run" is host time spent in calls that returned without yielding.
+ * Probes are inclusive, e.g. a DMA made by a job is part of both.
+ *
+ * Off unless MM_PROFILE is set, leaving one branch per probe. Probes are
+ * only updated from SystemC processes.
+ */
+
+// Histogram: 4 buckets per power of two of TSC ticks
+#define MM_PROFILE_SUB_BUCKETS 4
+#define MM_PROFILE_BUCKETS (64 * MM_PROFILE_SUB_BUCKETS)
+
+class mm_profile_probe;
+
+class mm_profiler
+{
+public:
+    static mm_profiler &instance()
+    {
+        static mm_profiler profiler;
+        return profiler;
+    }
+
+    static bool enabled()
+    {
+        return instance().on;
+    }
+
+    static uint64_t ticks()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+
+    // TSC rate measured against the steady clock over the whole run
+    double ns_per_tick() const
+    {
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - wall_start).count();
+        uint64_t t = ticks() - tick_start;
+        return t ? ns / t : 1.0;
+    }
+
+    void attach(mm_profile_probe *p)
+    {
+        probes.push_back(p);
+    }
+
+    void detach(mm_profile_probe *p)
+    {
+        probes.erase(std::remove(probes.begin(), probes.end(), p), probes.end());
+    }
+
+    // Log a table of every probe that has been hit; call from a process
+    // or after sc_start() returns
+    void report(const char *reason) const;
+
+private:
+    bool on;
+    uint64_t tick_start;
+    std::chrono::steady_clock::time_point wall_start;
+    std::vector<mm_profile_probe *> probes;
+
+    mm_profiler() : tick_start(ticks()), wall_start(std::chrono::steady_clock::now())
+    {
+        const char *env = getenv("MM_PROFILE");
+        on = env && *env && strcmp(env, "0") != 0;
+    }
+};
+
+class mm_profile_probe
+{
+public:
+    explicit mm_profile_probe(const std::string &name)
+        : name(name), calls(0), blocked(0), total_ticks(0), run_ticks(0), max_ticks(0)
+    {
+        memset(histogram, 0, sizeof(histogram));
+        mm_profiler::instance().attach(this);
+    }
+
+    ~mm_profile_probe()
+    {
+        mm_profiler::instance().detach(this);
+    }
+
+    void add(uint64_t ticks, const sc_time &sim, bool suspended)
+    {
+        calls++;
+        total_ticks += ticks;
+        if (suspended)
+            blocked++;
+        else
+            run_ticks += ticks;
+        max_ticks = std::max(max_ticks, ticks);
+        histogram[bucket(ticks)]++;
+        sim_time += sim;
+    }
+
+    // Smallest bucket bound that covers fraction q of the calls, in ticks
+    uint64_t percentile(double q) const
+    {
+        uint64_t want = (uint64_t)(q * calls + 0.5), seen = 0;
+        for (unsigned b = 0; b < MM_PROFILE_BUCKETS; b++)
+        {
+            seen += histogram[b];
+            if (seen >= want && seen)
+                return std::min(bucket_limit(b), max_ticks);
+        }
+        return max_ticks;
+    }
+
+    std::string name;
+    uint64_t calls;
+    uint64_t blocked;
+    uint64_t total_ticks;
+    uint64_t run_ticks;
+    uint64_t max_ticks;
+    sc_time sim_time;
+
+private:
+    uint64_t histogram[MM_PROFILE_BUCKETS];
+
+    static unsigned bucket(uint64_t t)
+    {
+        if (t < MM_PROFILE_SUB_BUCKETS)
+            return t;
+        unsigned lg = 63 - __builtin_clzll(t);
+        return (lg - 1) * MM_PROFILE_SUB_BUCKETS + ((t >> (lg - 2)) & (MM_PROFILE_SUB_BUCKETS - 1));
+    }
+
+    // Upper end of a bucket
+    static uint64_t bucket_limit(unsigned b)
+    {
+        if (b < MM_PROFILE_SUB_BUCKETS)
+            return b;
+        unsigned lg = b / MM_PROFILE_SUB_BUCKETS + 1;
+        uint64_t sub = b % MM_PROFILE_SUB_BUCKETS;
+        return ((MM_PROFILE_SUB_BUCKETS + sub + 1) << (lg - 2)) - 1;
+    }
+};
+
+/**
+ * Times one call of a probe from construction to destruction. With a
+ * delay, time annotated on it (loosely-timed callers) counts as
+ * simulated time too.
+ */
+class mm_profile_scope
+{
+public:
+    explicit mm_profile_scope(mm_profile_probe &p, const sc_time *delay = nullptr)
+        : probe(mm_profiler::enabled() ? &p : nullptr), annotated(delay)
+    {
+        if (!probe)
+            return;
+        sim_start = sc_time_stamp();
+        delta_start = sc_delta_count();
+        if (annotated)
+            delay_start = *annotated;
+        tick_start = mm_profiler::ticks();
+    }
+
+    ~mm_profile_scope()
+    {
+        if (!probe)
+            return;
+        uint64_t t = mm_profiler::ticks() - tick_start;
+        sc_time sim = sc_time_stamp() - sim_start;
+        if (annotated && *annotated > delay_start)
+            sim += *annotated - delay_start;
+        probe->add(t, sim, sc_delta_count() != delta_start || sim_start != sc_time_stamp());
+    }
+
+private:
+    mm_profile_probe *probe;
+    const sc_time *annotated;
+    sc_time sim_start;
+    sc_time delay_start;
+    uint64_t delta_start;
+    uint64_t tick_start;
+
+    mm_profile_scope(const mm_profile_scope &);
+    mm_profile_scope &operator=(const mm_profile_scope &);
+};
+
+inline void mm_profiler::report(const char *reason) const
+{
+    if (!on)
+        return;
+
+    double tick_ns = ns_per_tick();
+    double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+
+    // One log message per line: the logger cuts long messages
+    MM_INFO("Simulator profile (" << reason << "): " << std::fixed << std::setprecision(3) << wall_s
+            << " s host, " << sc_time_stamp() << " simulated, " << sc_delta_count() << " delta cycles");
+    MM_INFO("  " << std::left << std::setw(40) << "probe" << std::right
+            << std::setw(10) << "calls" << std::setw(9) << "blocked"
+            << std::setw(11) << "total ms" << std::setw(11) << "run ms"
+            << std::setw(10) << "p50 us" << std::setw(10) << "p99 us" << std::setw(11) << "max us"
+            << "  simulated");
+
+    for (size_t i = 0; i < probes.size(); i++)
+    {
+        const mm_profile_probe &p = *probes[i];
+        if (!p.calls)
+            continue;
+        MM_INFO("  " << std::left << std::setw(40) << p.name << std::right
+                << std::setw(10) << p.calls << std::setw(8) << std::fixed << std::setprecision(1)
+                << 100.0 * p.blocked / p.calls << "%" << std::setprecision(3)
+                << std::setw(11) << p.total_ticks * tick_ns / 1e6 << std::setw(11) << p.run_ticks * tick_ns / 1e6
+                << std::setw(10) << p.percentile(0.5) * tick_ns / 1e3
+                << std::setw(10) << p.percentile(0.99) * tick_ns / 1e3
+                << std::setw(11) << p.max_ticks * tick_ns / 1e3
+                << "  " << p.sim_time);
+    }
+}
+
+#endif // MM_PROFILE_H
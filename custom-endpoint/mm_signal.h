@@ -0,0 +1,104 @@
+#ifndef MM_SIGNAL_H
+#define MM_SIGNAL_H
+
+#include <systemc>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include "mm_log.h"
+
+using namespace sc_core;
+
+/**
+ * Turns a POSIX signal into an sc_event, e.g. SIGUSR2 for checkpoints and
+ * SIGUSR1 for the profile report. The handler only writes a byte to a
+ * pipe; a helper thread reads it and wakes the kernel through
+ * async_request_update(), which is not safe to call from a handler.
+ * One instance per signal.
+ */
+class mm_signal_event : public sc_prim_channel
+{
+public:
+    mm_signal_event(const char *name, int signo) : sc_prim_channel(name), signo(signo)
+    {
+        if (signo <= 0 || signo >= MAX_SIGNAL || pipe(fds) != 0)
+        {
+            fds[0] = fds[1] = -1;
+            MM_WARN("WARNING: Cannot watch signal " << signo << ": " << strerror(errno));
+            return;
+        }
+        write_fd(signo) = fds[1];
+        watcher = std::thread(&mm_signal_event::watch, this);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &mm_signal_event::on_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(signo, &sa, nullptr);
+    }
+
+    ~mm_signal_event()
+    {
+        if (fds[1] < 0)
+            return;
+        signal(signo, SIG_DFL);
+        write_fd(signo) = -1;
+        close(fds[1]);
+        watcher.join();
+        close(fds[0]);
+    }
+
+    // Same as receiving the signal; callable from any thread
+    void request()
+    {
+        async_request_update();
+    }
+
+    const sc_event &event() const
+    {
+        return raised;
+    }
+
+private:
+    static const int MAX_SIGNAL = 65;
+
+    int signo;
+    int fds[2];
+    std::thread watcher;
+    sc_event raised;
+
+    static int &write_fd(int signo)
+    {
+        static int fd[MAX_SIGNAL] = {};
+        return fd[signo];
+    }
+
+    static void on_signal(int signo)
+    {
+        int saved = errno;
+        char c = 1;
+        if (write_fd(signo) > 0)
+        {
+            ssize_t n = write(write_fd(signo), &c, 1);
+            (void)n; // a full pipe already holds a request
+        }
+        errno = saved;
+    }
+
+    void watch()
+    {
+        char c;
+        while (read(fds[0], &c, 1) > 0)
+            async_request_update();
+    }
+
+    void update()
+    {
+        raised.notify(SC_ZERO_TIME);
+    }
+};
+
+#endif // MM_SIGNAL_H
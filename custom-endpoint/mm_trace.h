@@ -0,0 +1,492 @@
+#ifndef MM_TRACE_H
+#define MM_TRACE_H
+
+#include <systemc>
+#include <tlm>
+#include <tlm_utils/simple_initiator_socket.h>
+#include <tlm_utils/simple_target_socket.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mm_log.h"
+
+using namespace sc_core;
+
+/**
+ * Binary TLM transaction trace.
+ *
+ * File layout: one MM_TRACE_HEADER_SIZE header, then fixed 64-byte
+ * records. Every transaction is one mm_trace_record; with payload capture
+ * on, its data follows in ceil(length / 64) continuation records, so the
+ * file stays an array of equal-sized slots that can be mapped and indexed
+ * directly. header.records counts all slots written and is updated with
+ * every record, so a trace cut short by a crash is still readable.
+ *
+ * The recorder appends through a shared mapping of the file and grows it
+ * in MM_TRACE_GROW_BYTES steps; a record is a handful of stores plus the
+ * optional payload digest, with no system call on the common path.
+ */
+
+#define MM_TRACE_MAGIC "MMTRACE"
+#define MM_TRACE_VERSION 1
+#define MM_TRACE_HEADER_SIZE 4096
+#define MM_TRACE_RECORD_SIZE 64
+#define MM_TRACE_MAX_PORTS 16
+#define MM_TRACE_PORT_NAME 48
+#define MM_TRACE_GROW_BYTES (64u << 20)
+
+// Header flags
+#define MM_TRACE_DIGEST 0x1  // records carry a digest of the payload
+#define MM_TRACE_PAYLOAD 0x2 // payload bytes follow each record
+
+struct mm_trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t record_size;
+    uint32_t flags;
+    uint64_t records;    // slots written, continuation records included
+    uint64_t created;    // Unix time the trace was opened
+    uint64_t time_unit_fs; // record times are in kernel resolution units
+    uint32_t port_count;
+    uint32_t reserved;
+    char port_names[MM_TRACE_MAX_PORTS][MM_TRACE_PORT_NAME];
+};
+
+struct mm_trace_record
+{
+    uint64_t time;       // sc_time_stamp() plus annotated delay at issue
+    uint64_t latency;    // delay the target added
+    uint64_t address;
+    uint64_t data;       // first 8 payload bytes, after the access
+    uint64_t digest;     // payload digest, 0 without MM_TRACE_DIGEST
+    uint32_t length;
+    uint32_t payload_records; // continuation records that follow
+    uint16_t port;
+    uint8_t command;     // tlm::tlm_command
+    int8_t status;       // tlm::tlm_response_status
+    uint32_t streaming_width;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(mm_trace_header) <= MM_TRACE_HEADER_SIZE, "trace header too large");
+static_assert(sizeof(mm_trace_record) == MM_TRACE_RECORD_SIZE, "trace record size");
+
+// Word-at-a-time 64-bit digest; cheap enough to run on every DMA burst
+inline uint64_t mm_trace_digest(const unsigned char *p, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    if (i < len)
+    {
+        uint64_t w = 0;
+        memcpy(&w, p + i, len - i);
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/**
+ * Owns one trace file. Not thread-safe: all taps must record from
+ * SystemC processes, which run on one host thread.
+ */
+class mm_trace_recorder
+{
+public:
+    mm_trace_recorder() : fd(-1), base(nullptr), mapped(0), flags(0), header(nullptr) {}
+
+    ~mm_trace_recorder()
+    {
+        close();
+    }
+
+    /**
+     * Create path (truncating it) with the given MM_TRACE_* flags.
+     * Returns false if the file cannot be created or mapped.
+     */
+    bool open(const std::string &path, uint32_t trace_flags)
+    {
+        close();
+
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            MM_ERROR("ERROR: Cannot create trace " << path << ": " << strerror(errno));
+            return false;
+        }
+        if (!grow(MM_TRACE_GROW_BYTES))
+        {
+            close();
+            return false;
+        }
+
+        flags = trace_flags;
+        header = (mm_trace_header *)base;
+        memcpy(header->magic, MM_TRACE_MAGIC, sizeof(MM_TRACE_MAGIC));
+        header->version = MM_TRACE_VERSION;
+        header->header_size = MM_TRACE_HEADER_SIZE;
+        header->record_size = MM_TRACE_RECORD_SIZE;
+        header->flags = flags;
+        header->records = 0;
+        header->created = (uint64_t)time(nullptr);
+        header->time_unit_fs = (uint64_t)(sc_get_time_resolution().to_seconds() * 1e15 + 0.5);
+        this->path = path;
+
+        MM_INFO("Transaction trace: " << path << ((flags & MM_TRACE_DIGEST) ? ", digests" : "")
+                << ((flags & MM_TRACE_PAYLOAD) ? ", payloads" : ""));
+        return true;
+    }
+
+    /**
+     * Parse "file[,digest][,payload]" from MM_TRACE and open the file.
+     * *pass_dmi is set if ",dmi" asks the taps to forward DMI requests.
+     */
+    bool open_spec(const std::string &spec, bool *pass_dmi)
+    {
+        uint32_t f = 0;
+        *pass_dmi = false;
+        size_t comma = spec.find(',');
+        while (comma != std::string::npos)
+        {
+            size_t next = spec.find(',', comma + 1);
+            std::string opt = spec.substr(comma + 1, next == std::string::npos ? std::string::npos : next - comma - 1);
+            if (opt == "digest")
+                f |= MM_TRACE_DIGEST;
+            else if (opt == "payload")
+                f |= MM_TRACE_PAYLOAD;
+            else if (opt == "dmi")
+                *pass_dmi = true;
+            else
+                MM_WARN("WARNING: Ignoring unknown trace option " << opt);
+            comma = next;
+        }
+        return open(spec.substr(0, spec.find(',')), f);
+    }
+
+    // Trim the file to what was written and release it
+    void close()
+    {
+        if (base)
+        {
+            uint64_t used = used_bytes();
+            munmap(base, mapped);
+            if (ftruncate(fd, used) < 0)
+                MM_WARN("WARNING: Cannot trim trace " << path << ": " << strerror(errno));
+            MM_INFO("Transaction trace: " << std::dec << records_written << " records in " << path);
+        }
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        base = nullptr;
+        header = nullptr;
+        mapped = 0;
+        records_written = 0;
+    }
+
+    bool is_open() const
+    {
+        return header != nullptr;
+    }
+
+    // Name a port for the header; the returned id goes into its records
+    uint16_t add_port(const std::string &name)
+    {
+        if (!header)
+            return 0;
+        uint32_t id = header->port_count;
+        if (id >= MM_TRACE_MAX_PORTS)
+        {
+            MM_WARN("WARNING: Trace supports " << MM_TRACE_MAX_PORTS << " ports, " << name << " shares the last");
+            return MM_TRACE_MAX_PORTS - 1;
+        }
+        strncpy(header->port_names[id], name.c_str(), MM_TRACE_PORT_NAME - 1);
+        header->port_count = id + 1;
+        return (uint16_t)id;
+    }
+
+    // Append one completed transaction; start is the issue time
+    void record(uint16_t port, const tlm::tlm_generic_payload &trans, const sc_time &start, const sc_time &latency)
+    {
+        if (!header)
+            return;
+
+        uint32_t len = trans.get_data_length();
+        const unsigned char *data = trans.get_data_ptr();
+        bool with_payload = (flags & MM_TRACE_PAYLOAD) && data && trans.get_command() != tlm::TLM_IGNORE_COMMAND;
+        uint32_t extra = with_payload ? (len + MM_TRACE_RECORD_SIZE - 1) / MM_TRACE_RECORD_SIZE : 0;
+
+        uint64_t offset = used_bytes();
+        uint64_t need = offset + (uint64_t)(1 + extra) * MM_TRACE_RECORD_SIZE;
+        if (need > mapped && !grow(std::max<uint64_t>(mapped + MM_TRACE_GROW_BYTES, need)))
+            return;
+
+        mm_trace_record *r = (mm_trace_record *)(base + offset);
+        r->time = start.value();
+        r->latency = latency.value();
+        r->address = trans.get_address();
+        r->data = 0;
+        if (data)
+            memcpy(&r->data, data, std::min<uint32_t>(len, 8));
+        r->digest = (flags & MM_TRACE_DIGEST) && data ? mm_trace_digest(data, len) : 0;
+        r->length = len;
+        r->payload_records = extra;
+        r->port = port;
+        r->command = (uint8_t)trans.get_command();
+        r->status = (int8_t)trans.get_response_status();
+        r->streaming_width = trans.get_streaming_width();
+        r->reserved = 0;
+
+        if (extra)
+            memcpy(r + 1, data, len);
+
+        records_written += 1 + extra;
+        header->records = records_written;
+    }
+
+    uint64_t record_count() const
+    {
+        return records_written;
+    }
+
+private:
+    int fd;
+    unsigned char *base;
+    uint64_t mapped;
+    uint32_t flags;
+    mm_trace_header *header;
+    uint64_t records_written = 0;
+    std::string path;
+
+    uint64_t used_bytes() const
+    {
+        return MM_TRACE_HEADER_SIZE + records_written * MM_TRACE_RECORD_SIZE;
+    }
+
+    // Extend the file and its mapping to at least bytes
+    bool grow(uint64_t bytes)
+    {
+        if (ftruncate(fd, bytes) < 0)
+        {
+            MM_ERROR("ERROR: Cannot extend trace to " << bytes << " bytes: " << strerror(errno));
+            return false;
+        }
+
+        void *p = base ? mremap(base, mapped, bytes, MREMAP_MAYMOVE)
+                       : mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            MM_ERROR("ERROR: Cannot map trace: " << strerror(errno));
+            return false;
+        }
+
+#ifdef MADV_POPULATE_WRITE
+        // Fault the new range in one go instead of once per page on the
+        // record path; older kernels just take the faults
+        madvise((unsigned char *)p + mapped, bytes - mapped, MADV_POPULATE_WRITE);
+#endif
+
+        base = (unsigned char *)p;
+        header = (mm_trace_header *)base;
+        mapped = bytes;
+        return true;
+    }
+};
+
+/**
+ * Read-only view of a trace file. Transactions are visited with
+ * first()/next(), which step over payload continuation records.
+ */
+class mm_trace_reader
+{
+public:
+    mm_trace_reader() : base(nullptr), size(0), hdr(nullptr), slots(0) {}
+
+    ~mm_trace_reader()
+    {
+        if (base)
+            munmap((void *)base, size);
+    }
+
+    bool open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            MM_ERROR("ERROR: Cannot open trace " << path << ": " << strerror(errno));
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < MM_TRACE_HEADER_SIZE)
+        {
+            MM_ERROR("ERROR: " << path << " is too short for a trace");
+            ::close(fd);
+            return false;
+        }
+
+        void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+        {
+            MM_ERROR("ERROR: Cannot map trace " << path << ": " << strerror(errno));
+            return false;
+        }
+
+        base = (const unsigned char *)p;
+        size = st.st_size;
+        hdr = (const mm_trace_header *)base;
+        if (memcmp(hdr->magic, MM_TRACE_MAGIC, sizeof(MM_TRACE_MAGIC)) != 0 ||
+            hdr->version != MM_TRACE_VERSION || hdr->record_size != MM_TRACE_RECORD_SIZE)
+        {
+            MM_ERROR("ERROR: " << path << " is not a version " << MM_TRACE_VERSION << " trace");
+            return false;
+        }
+        if (hdr->header_size < MM_TRACE_HEADER_SIZE || hdr->header_size > size)
+        {
+            MM_ERROR("ERROR: " << path << " has a bad header size " << hdr->header_size);
+            return false;
+        }
+
+        // Trust the header count only as far as the file goes
+        slots = std::min<uint64_t>(hdr->records, (size - hdr->header_size) / MM_TRACE_RECORD_SIZE);
+        return true;
+    }
+
+    const mm_trace_header &header() const
+    {
+        return *hdr;
+    }
+
+    // Port id whose name ends with suffix, or -1
+    int find_port(const std::string &suffix) const
+    {
+        for (uint32_t i = 0; i < hdr->port_count && i < MM_TRACE_MAX_PORTS; i++)
+        {
+            std::string name(hdr->port_names[i], strnlen(hdr->port_names[i], MM_TRACE_PORT_NAME));
+            if (name.size() >= suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+                return i;
+        }
+        return -1;
+    }
+
+    sc_time to_time(uint64_t units) const
+    {
+        return sc_time((double)units * hdr->time_unit_fs, SC_FS);
+    }
+
+    // Slot index of the first transaction; indices >= end() are past the end
+    uint64_t first() const
+    {
+        return 0;
+    }
+
+    uint64_t end() const
+    {
+        return slots;
+    }
+
+    uint64_t next(uint64_t i) const
+    {
+        return i + 1 + record(i).payload_records;
+    }
+
+    const mm_trace_record &record(uint64_t i) const
+    {
+        return *(const mm_trace_record *)(base + hdr->header_size + i * MM_TRACE_RECORD_SIZE);
+    }
+
+    // Captured payload of record i, or nullptr if it was not captured
+    const unsigned char *payload(uint64_t i) const
+    {
+        const mm_trace_record &r = record(i);
+        if (!r.payload_records || i + r.payload_records >= slots)
+            return nullptr;
+        return (const unsigned char *)(&r + 1);
+    }
+
+private:
+    const unsigned char *base;
+    uint64_t size;
+    const mm_trace_header *hdr;
+    uint64_t slots;
+};
+
+/**
+ * Pass-through module that records every b_transport crossing it.
+ *
+ * Insert it between an initiator and a target socket. Debug transport is
+ * forwarded unrecorded. DMI requests are refused unless pass_dmi is set,
+ * since accesses through a DMI pointer never reach the tap; a trace meant
+ * for replay needs them refused.
+ */
+SC_MODULE(mm_trace_tap)
+{
+    tlm_utils::simple_target_socket<mm_trace_tap> target_socket;
+    tlm_utils::simple_initiator_socket<mm_trace_tap> initiator_socket;
+
+    mm_trace_tap(sc_module_name name, mm_trace_recorder &rec, bool pass_dmi = false)
+        : sc_module(name),
+          target_socket("target_socket"),
+          initiator_socket("initiator_socket"),
+          recorder(rec),
+          port(rec.add_port(this->name())),
+          dmi_enabled(pass_dmi)
+    {
+        target_socket.register_b_transport(this, &mm_trace_tap::b_transport);
+        target_socket.register_transport_dbg(this, &mm_trace_tap::transport_dbg);
+        target_socket.register_get_direct_mem_ptr(this, &mm_trace_tap::get_direct_mem_ptr);
+        initiator_socket.register_invalidate_direct_mem_ptr(this, &mm_trace_tap::invalidate_direct_mem_ptr);
+    }
+
+private:
+    mm_trace_recorder &recorder;
+    uint16_t port;
+    bool dmi_enabled;
+
+    void b_transport(tlm::tlm_generic_payload &trans, sc_time &delay)
+    {
+        // The target may wait() and hand back a smaller delay, so measure
+        // against absolute time rather than subtracting the two delays
+        sc_time start = sc_time_stamp() + delay;
+        initiator_socket->b_transport(trans, delay);
+        if (!dmi_enabled)
+            trans.set_dmi_allowed(false);
+        sc_time end = sc_time_stamp() + delay;
+        recorder.record(port, trans, start, end > start ? end - start : SC_ZERO_TIME);
+    }
+
+    unsigned int transport_dbg(tlm::tlm_generic_payload &trans)
+    {
+        return initiator_socket->transport_dbg(trans);
+    }
+
+    bool get_direct_mem_ptr(tlm::tlm_generic_payload &trans, tlm::tlm_dmi &dmi)
+    {
+        if (!dmi_enabled)
+            return false;
+        return initiator_socket->get_direct_mem_ptr(trans, dmi);
+    }
+
+    void invalidate_direct_mem_ptr(sc_dt::uint64 start, sc_dt::uint64 end)
+    {
+        target_socket->invalidate_direct_mem_ptr(start, end);
+    }
+};
+
+#endif // MM_TRACE_H
@@ -12,7 +12,7 @@ endif
 
 # Compiler settings
 CXX = g++
-CXXFLAGS = -std=c++11 -Wall -Wextra -g -O2 -DSC_INCLUDE_DYNAMIC_PROCESSES
+CXXFLAGS = -std=c++11 -Wall -Wextra -g -O2 -ffp-contract=off -DSC_INCLUDE_DYNAMIC_PROCESSES
 
 # Include directories
 INCLUDES = -I$(SYSTEMC_HOME)/include \
@@ -32,6 +32,16 @@ OBJS = $(SRCS:.cpp=.o)
 # Executable name
 TARGET = pcie_test
 
+# Trace replay front-end (make replay)
+REPLAY_SRCS = replay.cpp
+REPLAY_OBJS = $(REPLAY_SRCS:.cpp=.o)
+REPLAY_TARGET = pcie_replay
+
+# Benchmark suite (make bench)
+BENCH_SRCS = bench.cpp
+BENCH_OBJS = $(BENCH_SRCS:.cpp=.o)
+BENCH_TARGET = pcie_bench
+
 # ===============================
 # Default target
 # ===============================
@@ -42,6 +52,22 @@ $(TARGET): $(OBJS)
 	$(CXX) $(CXXFLAGS) $(OBJS) $(LDFLAGS) $(LIBS) -o $(TARGET)
 	@echo "Build successful!"
 
+.PHONY: replay
+replay: $(REPLAY_TARGET)
+
+$(REPLAY_TARGET): $(REPLAY_OBJS)
+	@echo "Linking $(REPLAY_TARGET)..."
+	$(CXX) $(CXXFLAGS) $(REPLAY_OBJS) $(LDFLAGS) $(LIBS) -o $(REPLAY_TARGET)
+	@echo "Build successful!"
+
+.PHONY: bench
+bench: $(BENCH_TARGET)
+
+$(BENCH_TARGET): $(BENCH_OBJS)
+	@echo "Linking $(BENCH_TARGET)..."
+	$(CXX) $(CXXFLAGS) $(BENCH_OBJS) $(LDFLAGS) $(LIBS) -o $(BENCH_TARGET)
+	@echo "Build successful!"
+
 %.o: %.cpp
 	@echo "Compiling $<..."
 	$(CXX) $(CXXFLAGS) $(INCLUDES) -c $< -o $@
@@ -58,7 +84,7 @@ run: $(TARGET)
 # ===============================
 clean:
 	@echo "Cleaning..."
-	rm -f $(OBJS) $(TARGET) *.vcd *.log *.d
+	rm -f $(OBJS) $(TARGET) $(REPLAY_OBJS) $(REPLAY_TARGET) $(BENCH_OBJS) $(BENCH_TARGET) *.vcd *.log *.d
 	@echo "Clean complete!"
 
 # ===============================
@@ -68,6 +94,8 @@ help:
 	@echo "Usage:"
 	@echo "  make              Build project"
 	@echo "  make run          Build + run"
+	@echo "  make replay       Build the trace replay front-end"
+	@echo "  make bench        Build the benchmark suite"
 	@echo "  make clean        Clean build files"
 	@echo ""
 	@echo "SYSTEMC_HOME used:"
@@ -76,7 +104,7 @@ help:
 # ===============================
 # Auto dependency generation
 # ===============================
--include $(OBJS:.o=.d)
+-include $(OBJS:.o=.d) $(REPLAY_OBJS:.o=.d) $(BENCH_OBJS:.o=.d)
 
 %.d: %.cpp
 	$(CXX) $(CXXFLAGS) $(INCLUDES) -MM -MT $(@:.d=.o) $< -MF $@
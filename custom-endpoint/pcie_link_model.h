@@ -0,0 +1,365 @@
+#ifndef PCIE_LINK_MODEL_H
+#define PCIE_LINK_MODEL_H
+
+#include <systemc>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+using namespace sc_core;
+
+/**
+ * Transaction-level timing model of one PCIe link, used to annotate device
+ * DMA. Data still moves as one transfer; the model only computes when it
+ * would have finished on the wire.
+ *
+ * Writes are split into posted memory-write TLPs of at most MPS bytes,
+ * reads into non-posted requests of at most MRRS bytes whose completions
+ * come back in MPS-sized TLPs. Every TLP pays a fixed framing/header/LCRC
+ * overhead plus an amortised share of ACK/UpdateFC DLLP traffic, and the
+ * two link directions are serialised independently, so concurrent DMA
+ * streams contend for bandwidth.
+ *
+ * Flow control follows the credit scheme of the receiving root port:
+ * posted header/data and non-posted header credits are consumed per TLP
+ * and returned credit_return after the TLP arrives. Completion credits are
+ * infinite, as the spec requires of endpoints.
+ */
+
+// FC data credits are counted in 16-byte units
+#define PCIE_FC_UNIT 16
+
+struct pcie_link_config
+{
+    unsigned gen = 1;           // 1..5
+    unsigned width = 1;         // x1, x2, x4, x8, x16
+    unsigned mps = 128;         // Max Payload Size (bytes)
+    unsigned mrrs = 512;        // Max Read Request Size (bytes)
+    unsigned tlp_overhead = 0;  // bytes per TLP besides payload, 0 = derive from gen
+    unsigned dllp_bytes = 8;    // one ACK/UpdateFC DLLP on the wire
+    unsigned tlps_per_dllp = 4; // TLPs covered by one DLLP
+    unsigned posted_hdr_credits = 32;
+    unsigned posted_data_credits = 256;
+    unsigned nonposted_hdr_credits = 32;
+    sc_time flight_latency = sc_time(20, SC_NS);     // PHY + wire, one way
+    sc_time credit_return = sc_time(100, SC_NS);     // TLP arrival to UpdateFC
+    sc_time completion_latency = sc_time(200, SC_NS); // root complex read turnaround
+
+    // Raw data rate per lane after line encoding, in bytes per ns
+    double lane_bytes_per_ns() const
+    {
+        switch (gen)
+        {
+        case 1:
+            return 2.5 * 8 / 10 / 8;
+        case 2:
+            return 5.0 * 8 / 10 / 8;
+        case 3:
+            return 8.0 * 128 / 130 / 8;
+        case 4:
+            return 16.0 * 128 / 130 / 8;
+        default:
+            return 32.0 * 128 / 130 / 8;
+        }
+    }
+
+    double bytes_per_ns() const
+    {
+        return lane_bytes_per_ns() * width;
+    }
+
+    // STP/END framing (Gen1/2) or STP token (Gen3+), sequence number,
+    // 4DW header (64-bit addressing) and LCRC
+    unsigned tlp_overhead_bytes() const
+    {
+        if (tlp_overhead)
+            return tlp_overhead;
+        return (gen <= 2 ? 2 : 4) + 2 + 16 + 4;
+    }
+
+    // Best-case payload throughput for a stream of MPS-sized TLPs
+    double payload_bytes_per_ns() const
+    {
+        double wire = mps + tlp_overhead_bytes() + (double)dllp_bytes / tlps_per_dllp;
+        return bytes_per_ns() * mps / wire;
+    }
+
+    bool valid() const
+    {
+        return gen >= 1 && gen <= 5 &&
+               (width == 1 || width == 2 || width == 4 || width == 8 || width == 16) &&
+               mps >= 128 && mps <= 4096 && (mps & (mps - 1)) == 0 &&
+               mrrs >= 128 && mrrs <= 4096 && (mrrs & (mrrs - 1)) == 0 &&
+               tlps_per_dllp > 0 && posted_hdr_credits > 0 &&
+               posted_data_credits * PCIE_FC_UNIT >= mps && nonposted_hdr_credits > 0;
+    }
+
+    std::string to_string() const
+    {
+        std::ostringstream os;
+        os << "Gen" << gen << " x" << width << ", MPS " << mps << ", MRRS " << mrrs;
+        return os.str();
+    }
+
+    /**
+     * Parse "gen3x8[,mps=256][,mrrs=512][,ph=32][,pd=256][,nph=32]", as
+     * given in the MM_PCIE_LINK environment variable. Returns false and
+     * leaves cfg untouched on a malformed string.
+     */
+    static bool parse(const std::string &text, pcie_link_config &cfg)
+    {
+        pcie_link_config c = cfg;
+        std::stringstream ss(text);
+        std::string item;
+        bool first = true;
+
+        while (std::getline(ss, item, ','))
+        {
+            if (first)
+            {
+                first = false;
+                if (sscanf(item.c_str(), "gen%ux%u", &c.gen, &c.width) != 2)
+                    return false;
+                continue;
+            }
+
+            size_t eq = item.find('=');
+            if (eq == std::string::npos)
+                return false;
+            std::string key = item.substr(0, eq);
+            unsigned value = (unsigned)strtoul(item.c_str() + eq + 1, nullptr, 0);
+
+            if (key == "mps")
+                c.mps = value;
+            else if (key == "mrrs")
+                c.mrrs = value;
+            else if (key == "ph")
+                c.posted_hdr_credits = value;
+            else if (key == "pd")
+                c.posted_data_credits = value;
+            else if (key == "nph")
+                c.nonposted_hdr_credits = value;
+            else
+                return false;
+        }
+
+        if (first || !c.valid())
+            return false;
+        cfg = c;
+        return true;
+    }
+};
+
+class pcie_link_model
+{
+public:
+    struct stats
+    {
+        uint64_t read_bytes = 0;
+        uint64_t write_bytes = 0;
+        uint64_t read_requests = 0;
+        uint64_t completion_tlps = 0;
+        uint64_t write_tlps = 0;
+        uint64_t credit_stalls = 0;
+        sc_time up_busy;   // device -> host link occupancy
+        sc_time down_busy; // host -> device link occupancy
+    };
+
+    pcie_link_model() = default;
+
+    explicit pcie_link_model(const pcie_link_config &cfg)
+    {
+        configure(cfg);
+    }
+
+    void configure(const pcie_link_config &cfg)
+    {
+        config = cfg;
+        up_free = down_free = SC_ZERO_TIME;
+        posted_inflight.clear();
+        nonposted_inflight.clear();
+        ph_used = pd_used = nph_used = 0;
+        counters = stats();
+    }
+
+    const pcie_link_config &get_config() const
+    {
+        return config;
+    }
+
+    const stats &get_stats() const
+    {
+        return counters;
+    }
+
+    /**
+     * Memory write of len bytes issued at start. Returns when the last
+     * posted TLP has left the device: posted writes do not wait for the
+     * memory target.
+     */
+    sc_time write(uint64_t len, sc_time start)
+    {
+        sc_time t = start;
+        counters.write_bytes += len;
+
+        for (uint64_t done = 0; done < len;)
+        {
+            unsigned payload = (unsigned)std::min<uint64_t>(config.mps, len - done);
+            unsigned data_credits = (payload + PCIE_FC_UNIT - 1) / PCIE_FC_UNIT;
+
+            t = acquire_posted(t, data_credits);
+            sc_time end = send(up_free, t, payload);
+            counters.up_busy += end - std::max(up_free, t);
+            up_free = end;
+            t = end;
+
+            posted_inflight.push_back({end + config.flight_latency + config.credit_return, 1, data_credits});
+            ph_used += 1;
+            pd_used += data_credits;
+            counters.write_tlps++;
+
+            done += payload;
+        }
+
+        return t;
+    }
+
+    /**
+     * Memory read of len bytes issued at start. host_latency is added to
+     * the root complex turnaround of every request. Returns when the last
+     * completion byte has arrived at the device.
+     */
+    sc_time read(uint64_t len, sc_time start, sc_time host_latency = SC_ZERO_TIME)
+    {
+        sc_time t = start;
+        sc_time last = start;
+        counters.read_bytes += len;
+
+        for (uint64_t done = 0; done < len;)
+        {
+            unsigned request = (unsigned)std::min<uint64_t>(config.mrrs, len - done);
+
+            // Header-only request TLP upstream, gated by NPH credits
+            t = acquire_nonposted(t);
+            sc_time req_end = send(up_free, t, 0);
+            counters.up_busy += req_end - std::max(up_free, t);
+            up_free = req_end;
+            t = req_end;
+            nonposted_inflight.push_back(req_end + config.flight_latency + config.credit_return);
+            nph_used++;
+            counters.read_requests++;
+
+            // Completions downstream, split at MPS
+            sc_time ready = req_end + 2 * config.flight_latency + config.completion_latency + host_latency;
+            for (unsigned off = 0; off < request; off += config.mps)
+            {
+                unsigned payload = std::min(config.mps, request - off);
+                sc_time end = send(down_free, ready, payload);
+                counters.down_busy += end - std::max(down_free, ready);
+                down_free = end;
+                ready = end;
+                counters.completion_tlps++;
+            }
+            last = std::max(last, ready);
+
+            done += request;
+        }
+
+        return last;
+    }
+
+    void print_stats(std::ostream &os, sc_time elapsed) const
+    {
+        double ns = elapsed.to_seconds() * 1e9;
+        os << std::dec << "PCIe link (" << config.to_string() << "): peak payload "
+           << std::fixed << std::setprecision(2) << config.payload_bytes_per_ns() << " GB/s" << std::endl;
+        os << "  DMA read:  " << counters.read_bytes << " bytes in " << counters.read_requests
+           << " requests / " << counters.completion_tlps << " completions";
+        if (ns > 0)
+            os << ", " << counters.read_bytes / ns << " GB/s";
+        os << std::endl;
+        os << "  DMA write: " << counters.write_bytes << " bytes in " << counters.write_tlps << " TLPs";
+        if (ns > 0)
+            os << ", " << counters.write_bytes / ns << " GB/s";
+        os << std::endl;
+        if (ns > 0)
+            os << "  Link utilisation: up " << 100.0 * counters.up_busy.to_seconds() * 1e9 / ns
+               << "%, down " << 100.0 * counters.down_busy.to_seconds() * 1e9 / ns << "%" << std::endl;
+        os << "  Credit stalls: " << counters.credit_stalls << std::endl;
+        os.unsetf(std::ios::fixed);
+    }
+
+private:
+    struct posted_credit
+    {
+        sc_time release;
+        unsigned hdr;
+        unsigned data;
+    };
+
+    pcie_link_config config;
+    sc_time up_free;
+    sc_time down_free;
+    std::deque<posted_credit> posted_inflight;
+    std::deque<sc_time> nonposted_inflight;
+    unsigned ph_used = 0;
+    unsigned pd_used = 0;
+    unsigned nph_used = 0;
+    stats counters;
+
+    // Serialise one TLP on a link direction that is busy until link_free
+    sc_time send(sc_time link_free, sc_time ready, unsigned payload)
+    {
+        double wire = payload + config.tlp_overhead_bytes() + (double)config.dllp_bytes / config.tlps_per_dllp;
+        return std::max(link_free, ready) + sc_time(wire / config.bytes_per_ns(), SC_NS);
+    }
+
+    sc_time acquire_posted(sc_time t, unsigned data_credits)
+    {
+        // Credits come back in TLP order, so the front is always the earliest
+        while (!posted_inflight.empty() && posted_inflight.front().release <= t)
+            release_posted();
+
+        while (ph_used + 1 > config.posted_hdr_credits ||
+               pd_used + data_credits > config.posted_data_credits)
+        {
+            counters.credit_stalls++;
+            t = std::max(t, posted_inflight.front().release);
+            release_posted();
+        }
+        return t;
+    }
+
+    void release_posted()
+    {
+        ph_used -= posted_inflight.front().hdr;
+        pd_used -= posted_inflight.front().data;
+        posted_inflight.pop_front();
+    }
+
+    sc_time acquire_nonposted(sc_time t)
+    {
+        while (!nonposted_inflight.empty() && nonposted_inflight.front() <= t)
+        {
+            nonposted_inflight.pop_front();
+            nph_used--;
+        }
+
+        if (nph_used + 1 > config.nonposted_hdr_credits)
+        {
+            counters.credit_stalls++;
+            t = std::max(t, nonposted_inflight.front());
+            nonposted_inflight.pop_front();
+            nph_used--;
+        }
+        return t;
+    }
+};
+
+#endif // PCIE_LINK_MODEL_H
@@ -22,7 +22,12 @@
 
 #include <systemc>
 #include <tlm>
+#include <chrono>
 #include "matrix_multiplier_pcie.h"
+#include "mm_checkpoint.h"
+#include "mm_profile.h"
+#include "mm_signal.h"
+#include "mm_trace.h"
 #include "pci-defs-fix.h"  // Add PCI definitions before pf-config.h
 #include "pcie_api.h"
 #include "pf-config.h"
@@ -39,19 +44,36 @@ public:
     PCIeController *pcie_controller;
     PCIeQemuBridge *qemu_bridge;
 
+    // Optional binary trace of BAR0, DMA and downstream link traffic
+    mm_trace_recorder trace;
+    mm_trace_tap *bar0_tap = nullptr;
+    mm_trace_tap *dma_tap = nullptr;
+    mm_trace_tap *link_tap = nullptr;
+
+    // Checkpoint/restore: config writes seen on the link, and SIGUSR2
+    pcie_config_journal *config_journal;
+    mm_signal_event checkpoint_trigger;
+    std::string checkpoint_path;
+    std::string restore_path;
+
+    // MM_PROFILE: SIGUSR1 logs the host-side profile
+    mm_signal_event *profile_trigger = nullptr;
+
     // Reset signal (must be toggled in sc_main)
     sc_signal<bool> rst;
 
-    // Interrupt signals (if using MSI-X)
+    // Legacy INTx line. MSI-X messages are posted by the device itself as
+    // memory writes on the DMA path, using the table it exposes in BAR0.
     sc_vector<sc_signal<bool>> irq_signals;
 
     SC_CTOR(pcie_system_top) :
-        irq_signals("irq_signals", 1)  // Assuming 1 interrupt for now
+        checkpoint_trigger("checkpoint_trigger", SIGUSR2),
+        irq_signals("irq_signals", 1)
     {
         // ============================================
         // 1. Create Physical Function Configuration
         // ============================================
-        PhysFuncConfig pf_cfg; //create_pf_config();
+        PhysFuncConfig pf_cfg = create_pf_config();
 
         // ============================================
         // 2. Instantiate Components
@@ -59,15 +81,75 @@ public:
         
         // Your matrix multiplier PCIe endpoint device
         matrix_device = new matrix_multiplier_pcie("matrix_device");
+
+        // DMA timing follows the advertised link (Gen1 x1) unless
+        // MM_PCIE_LINK selects another, e.g. "gen3x8,mps=256,mrrs=512"
+        pcie_link_config link_cfg;
+        if (const char *link = getenv("MM_PCIE_LINK"))
+        {
+            if (!pcie_link_config::parse(link, link_cfg))
+                MM_WARN("WARNING: Ignoring malformed MM_PCIE_LINK=" << link);
+        }
+        matrix_device->set_link_config(link_cfg);
+
+        // Split DMA into MRRS/MPS-sized requests with this many tags in flight
+        const char *tags = getenv("MM_DMA_TAGS");
+        matrix_device->set_dma_tags(tags ? atoi(tags) : 8);
+
+        // MM_LT_QUANTUM=<ns> switches the device to loosely-timed mode; the
+        // quantum becomes the TLM global quantum for all LT initiators
+        if (const char *quantum = getenv("MM_LT_QUANTUM"))
+            matrix_device->set_timing_mode(TIMING_LT, sc_time(atof(quantum), SC_NS));
+
+        // Parallel compute engines behind the on-device job scheduler
+        if (const char *engines = getenv("MM_ENGINES"))
+            matrix_device->set_engine_count(atoi(engines));
+
+        // GEMM arithmetic runs on a host thread pool, one thread per core
+        // unless MM_HOST_THREADS says otherwise (1 = on the SystemC thread)
+        if (const char *threads = getenv("MM_HOST_THREADS"))
+            matrix_device->set_host_threads(atoi(threads));
         
         // PCIe Controller (manages BARs, DMA, MSI-X)
         pcie_controller = new PCIeController("pcie_controller", pf_cfg);
         
         // QEMU Bridge (connects to QEMU via Remote-Port socket)
-        // The socket path should match QEMU's -chardev socket parameter
-        const char* socket_path = "unix:/tmp/qemu-rp-0";
+        // The socket path should match QEMU's -chardev socket parameter.
+        // MM_RP_SOCKET="shm:<guest-ram-file>,sk=unix:/tmp/qemu-rp-0" adds
+        // zero-copy DMA through QEMU's shared RAM backend.
+        const char* socket_path = getenv("MM_RP_SOCKET") ? getenv("MM_RP_SOCKET") : "unix:/tmp/qemu-rp-0";
         qemu_bridge = new PCIeQemuBridge("qemu_bridge", socket_path);
 
+        // MM_TRACE=<file>[,digest][,payload][,dmi] records transactions
+        // through taps on the link, BAR0 and DMA sockets. Upstream link
+        // traffic is the DMA tap's traffic plus MSI-X and is not repeated.
+        bool trace_dmi = false;
+        if (const char *spec = getenv("MM_TRACE"))
+        {
+            if (trace.open_spec(spec, &trace_dmi))
+            {
+                link_tap = new mm_trace_tap("link_trace", trace, trace_dmi);
+                bar0_tap = new mm_trace_tap("bar0_trace", trace, trace_dmi);
+                dma_tap = new mm_trace_tap("dma_trace", trace, trace_dmi);
+            }
+        }
+
+        // SIGUSR2 writes a snapshot to MM_CHECKPOINT (default
+        // mm-checkpoint.bin); MM_RESTORE=<file> starts from one
+        config_journal = new pcie_config_journal("config_journal");
+        checkpoint_path = getenv("MM_CHECKPOINT") ? getenv("MM_CHECKPOINT") : "mm-checkpoint.bin";
+        if (const char *restore = getenv("MM_RESTORE"))
+            restore_path = restore;
+        SC_THREAD(checkpoint_thread);
+
+        if (mm_profiler::enabled())
+        {
+            profile_trigger = new mm_signal_event("profile_trigger", SIGUSR1);
+            SC_METHOD(profile_report);
+            sensitive << profile_trigger->event();
+            dont_initialize();
+        }
+
         // ============================================
         // 3. Connect Reset Signal
         // ============================================
@@ -76,19 +158,45 @@ public:
         // ============================================
         // 4. Connect QEMU Bridge <-> PCIe Controller
         // ============================================
-        // This connects the TLP packet flow between QEMU and the controller
-        qemu_bridge->rootport.init_socket.bind(pcie_controller->tgt_socket);
-        pcie_controller->init_socket.bind(qemu_bridge->rootport.tgt_socket);
+        // This connects the TLP packet flow between QEMU and the controller.
+        // Upstream traffic goes through the bridge so it can be batched.
+        // Both directions pass the config journal.
+        if (link_tap)
+        {
+            qemu_bridge->rootport.init_socket.bind(link_tap->target_socket);
+            link_tap->initiator_socket.bind(config_journal->down_target_socket);
+        }
+        else
+        {
+            qemu_bridge->rootport.init_socket.bind(config_journal->down_target_socket);
+        }
+        config_journal->down_init_socket.bind(pcie_controller->tgt_socket);
+        pcie_controller->init_socket.bind(config_journal->up_target_socket);
+        config_journal->up_init_socket.bind(qemu_bridge->tgt_socket);
+
+        // Up to MM_RP_BATCH queued upstream requests (0 = one at a time)
+        const char *batch = getenv("MM_RP_BATCH");
+        unsigned rp_batch = batch ? atoi(batch) : 16;
+        qemu_bridge->set_batching(rp_batch > 0, rp_batch);
 
         // ============================================
         // 5. Connect PCIe Controller <-> Device
         // ============================================
         
-        // Connect BAR0 (register interface)
-        pcie_controller->bar0_init_socket.bind(matrix_device->bar0_target_socket);
-        
-        // Connect DMA path (device -> host memory via QEMU)
-        matrix_device->dma_initiator_socket.bind(pcie_controller->dma_tgt_socket);
+        // Connect BAR0 (register interface) and the DMA path (device -> host
+        // memory via QEMU), through the trace taps when tracing
+        if (bar0_tap)
+        {
+            pcie_controller->bar0_init_socket.bind(bar0_tap->target_socket);
+            bar0_tap->initiator_socket.bind(matrix_device->bar0_target_socket);
+            matrix_device->dma_initiator_socket.bind(dma_tap->target_socket);
+            dma_tap->initiator_socket.bind(pcie_controller->dma_tgt_socket);
+        }
+        else
+        {
+            pcie_controller->bar0_init_socket.bind(matrix_device->bar0_target_socket);
+            matrix_device->dma_initiator_socket.bind(pcie_controller->dma_tgt_socket);
+        }
         
         // Connect interrupts (device -> controller)
         // Note: irq is private, need to use public method or signals
@@ -107,67 +215,129 @@ public:
         delete matrix_device;
         delete pcie_controller;
         delete qemu_bridge;
+        delete link_tap;
+        delete bar0_tap;
+        delete dma_tap;
+        delete config_journal;
+        delete profile_trigger;
+    }
+
+    void end_of_simulation()
+    {
+        mm_profiler::instance().report("end of simulation");
     }
 
 private:
+    void profile_report()
+    {
+        mm_profiler::instance().report("SIGUSR1");
+    }
+
+    /**
+     * Restores MM_RESTORE at time zero, then writes a snapshot each time
+     * a checkpoint is requested. Jobs that are running finish first, so a
+     * snapshot holds registers, queue pointers and config space only;
+     * jobs still in the submission queues are fetched after a restore.
+     */
+    void checkpoint_thread()
+    {
+        if (!restore_path.empty())
+        {
+            auto start = std::chrono::steady_clock::now();
+            mm_snapshot_reader r;
+            if (r.read_file(restore_path) && matrix_device->restore_state(r) && config_journal->replay(r))
+            {
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                MM_INFO("Restored " << restore_path << " (" << config_journal->entries()
+                        << " config writes) in " << ms << " ms");
+            }
+            else
+            {
+                // The device section may have been applied before the
+                // config section failed to parse
+                matrix_device->reset_to_power_on();
+                MM_ERROR("ERROR: Restore from " << restore_path << " failed, starting from reset");
+            }
+        }
+
+        while (true)
+        {
+            wait(checkpoint_trigger.event());
+            matrix_device->wait_quiescent();
+
+            auto start = std::chrono::steady_clock::now();
+            mm_snapshot_writer w;
+            matrix_device->save_state(w);
+            config_journal->save(w);
+            if (w.write_file(checkpoint_path))
+            {
+                double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                MM_INFO("[" << sc_time_stamp() << "] Checkpoint written to " << checkpoint_path << ", "
+                        << w.size() << " bytes in " << ms << " ms");
+            }
+        }
+    }
+
     /**
      * Create Physical Function Configuration
      * This defines the PCIe device's capabilities, BARs, etc.
      */
-    // PhysFuncConfig create_pf_config()
-    // {
-    //     PhysFuncConfig cfg;
-    //     PMCapability pmCap;
-    //     PCIExpressCapability pcieCap;
-    //     MSIXCapability msixCap;
-
-    //     // Vendor/Device IDs (customize these for your device)
-    //     cfg.SetPCIVendorID(0x10EE);  // Xilinx vendor ID
-    //     cfg.SetPCIDeviceID(0x9038);  // Custom device ID
-    //     cfg.SetPCISubsystemVendorID(0x10EE);
-    //     cfg.SetPCISubsystemID(0x0001);
-
-    //     // Device class (0x12 = Processing Accelerator)
-    //     cfg.SetPCIClassBase(0x12);
-    //     cfg.SetPCIClassDevice(0x00);
-    //     cfg.SetPCIClassProgIF(0x00);
-
-    //     // BAR Configuration
-    //     // BAR0: 4KB for registers (64-bit BAR)
-    //     uint32_t bar_flags = PCI_BASE_ADDRESS_MEM_TYPE_64;
-    //     cfg.SetPCIBAR0(4 * 1024, bar_flags);
-        
-    //     // BAR2-5: Optional, add if you need more BARs
-    //     // cfg.SetPCIBAR2(64 * 1024, bar_flags);
-
-    //     // Expansion ROM (disabled)
-    //     cfg.SetPCIExpansionROMBAR(0, 0);
-
-    //     // Add PM Capability
-    //     cfg.AddPCICapability(pmCap);
-
-    //     // Add PCIe Capability
-    //     uint32_t maxLinkWidth = 1 << 4;  // x1 link width
-    //     pcieCap.SetDeviceCapabilities(PCI_EXP_DEVCAP_RBER);
-    //     pcieCap.SetLinkCapabilities(PCI_EXP_LNKCAP_SLS_2_5GB | maxLinkWidth);
-    //     pcieCap.SetLinkStatus(PCI_EXP_LNKSTA_CLS_2_5GB | PCI_EXP_LNKSTA_NLW_X1);
-    //     cfg.AddPCICapability(pcieCap);
-
-    //     // Add MSI-X Capability
-    //     uint32_t msixTableSz = 1;  // Number of interrupt vectors
-    //     uint32_t tableOffset = 0x1000 | 0;  // Offset 0x1000, BIR 0 (BAR0)
-    //     uint32_t pba = 0x2000 | 0;  // PBA at offset 0x2000, BIR 0
-        
-    //     msixCap.SetMessageControl(msixTableSz - 1);
-    //     msixCap.SetTableOffsetBIR(tableOffset);
-    //     msixCap.SetPendingBitArray(pba);
-    //     cfg.AddPCICapability(msixCap);
+    PhysFuncConfig create_pf_config()
+    {
+        PhysFuncConfig cfg;
+        PMCapability pmCap;
+        PCIExpressCapability pcieCap;
+        MSIXCapability msixCap;
+
+        // Vendor/Device IDs the guest driver binds to (custom_qemu_device_driver.c)
+        cfg.SetPCIVendorID(0x1234);
+        cfg.SetPCIDeviceID(0xabcd);
+        cfg.SetPCISubsystemVendorID(0x1234);
+        cfg.SetPCISubsystemID(0x0001);
 
-    //     return cfg;
-    // }
+        // Device class (0x12 = Processing Accelerator)
+        cfg.SetPCIClassBase(0x12);
+        cfg.SetPCIClassDevice(0x00);
+        cfg.SetPCIClassProgIF(0x00);
+
+        // BAR Configuration
+        // BAR0: 16KB for registers, MSI-X table and PBA (64-bit BAR)
+        uint32_t bar_flags = PCI_BASE_ADDRESS_MEM_TYPE_64;
+        cfg.SetPCIBAR0(16 * 1024, bar_flags);
+
+        // BAR2-5: Optional, add if you need more BARs
+        // cfg.SetPCIBAR2(64 * 1024, bar_flags);
+
+        // Expansion ROM (disabled)
+        cfg.SetPCIExpansionROMBAR(0, 0);
+
+        // Add PM Capability
+        cfg.AddPCICapability(pmCap);
+
+        // Add PCIe Capability
+        uint32_t maxLinkWidth = 1 << 4;  // x1 link width
+        pcieCap.SetDeviceCapabilities(PCI_EXP_DEVCAP_RBER);
+        pcieCap.SetLinkCapabilities(PCI_EXP_LNKCAP_SLS_2_5GB | maxLinkWidth);
+        pcieCap.SetLinkStatus(PCI_EXP_LNKSTA_CLS_2_5GB | PCI_EXP_LNKSTA_NLW_X1);
+        cfg.AddPCICapability(pcieCap);
+
+        // Add MSI-X Capability; the table and PBA live in the device's BAR0
+        uint32_t msixTableSz = MM_MSIX_VECTORS;  // One per CQ + misc/error
+        uint32_t tableOffset = REG_MSIX_TABLE | 0;  // Offset 0x1000, BIR 0 (BAR0)
+        uint32_t pba = REG_MSIX_PBA | 0;  // PBA at offset 0x2000, BIR 0
+
+        msixCap.SetMessageControl(msixTableSz - 1);
+        msixCap.SetTableOffsetBIR(tableOffset);
+        msixCap.SetPendingBitArray(pba);
+        cfg.AddPCICapability(msixCap);
+
+        return cfg;
+    }
 
     void print_device_info()
     {
+        // The banner goes straight to stdout; let queued log lines out first
+        mm_log::flush();
         std::cout << "==================================================" << std::endl;
         std::cout << "Matrix Multiplier PCIe Device Initialized" << std::endl;
         std::cout << "==================================================" << std::endl;
@@ -180,9 +350,25 @@ private:
         std::cout << "  0x0020 - MATRIX_C_PTR (R/W, 64-bit)" << std::endl;
         std::cout << "  0x0028 - INT_STATUS   (R/W1C)" << std::endl;
         std::cout << "  0x002C - INT_ENABLE   (R/W)" << std::endl;
+        std::cout << "  0x0030 - MSIX_CTRL    (R/W)" << std::endl;
+        std::cout << "  0x0034 - INT_COALESCE (R/W)" << std::endl;
+        std::cout << "  0x0038 - SCHED_POLICY (R/W, 0 = round-robin, 1 = shortest-job-first)" << std::endl;
+        std::cout << "  0x003C - ENGINE_COUNT (R)" << std::endl;
+        std::cout << "  0x0100 - QUEUE[0.." << MM_NUM_QUEUES - 1 << "], 0x20 per queue:" << std::endl;
+        std::cout << "           +0x00 SQ_BASE (R/W, 64-bit)  +0x08 CQ_BASE (R/W, 64-bit)" << std::endl;
+        std::cout << "           +0x10 SIZE    (R/W)          +0x14 SQ_TAIL doorbell (R/W)" << std::endl;
+        std::cout << "           +0x18 CQ_HEAD doorbell (R/W) +0x1C SQ_HEAD (R)" << std::endl;
+        std::cout << "  0x0200 - ENGINE[0.." << matrix_device->engine_count() - 1 << "], 0x10 per engine:" << std::endl;
+        std::cout << "           +0x00 BUSY_TIME ns (R, 64-bit) +0x08 JOBS (R)  +0x0C UTIL 1/1000 (R)" << std::endl;
+        std::cout << "  0x0400 - PERF counters, 64-bit (R), PERF_CTRL at +0x00 (W, 1 = snapshot, 2 = clear):" << std::endl;
+        std::cout << "           +0x08 ELAPSED ns  +0x10 JOBS  +0x18 DMA_IN bytes  +0x20 DMA_OUT bytes" << std::endl;
+        std::cout << "           +0x28 DMA_STALL ns  +0x30 BUSY ns  +0x38 IDLE ns  +0x40 INTERRUPTS  +0x48 ERRORS" << std::endl;
+        std::cout << "  0x1000 - MSI-X table, " << MM_MSIX_VECTORS << " vectors (CQ 0.."
+                  << MM_NUM_QUEUES - 1 << ", misc/error)" << std::endl;
+        std::cout << "  0x2000 - MSI-X PBA    (R)" << std::endl;
         std::cout << "==================================================" << std::endl;
         std::cout << "QEMU Connection: Ready for Remote-Port socket" << std::endl;
-        std::cout << "Socket Path: /tmp/qemu-rp-0" << std::endl;
+        std::cout << "Socket Path: " << qemu_bridge->control_descr << std::endl;
         std::cout << "==================================================" << std::endl;
     }
 };
@@ -5,6 +5,18 @@
 #include <tlm>
 #include <tlm_utils/simple_initiator_socket.h>
 #include <tlm_utils/simple_target_socket.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "guest-ram-shm.h"
+#include "mm_log.h"
+#include "mm_profile.h"
 
 // Include remote-port components from libsystemctlm-soc
 #include "remote-port-tlm.h"
@@ -23,6 +35,17 @@ using namespace sc_core;
  * This module encapsulates:
  *   1. remoteport_tlm_pci_ep: Handles socket communication with QEMU
  *   2. pcie_root_port: Adapts Remote-Port protocol to TLM transactions
+ *
+ * Upstream traffic (device DMA and MSI-X writes) enters through tgt_socket.
+ * With batching enabled it is queued in order and forwarded by one thread:
+ * posted writes are acknowledged at once, consecutive transactions to
+ * contiguous addresses are merged into a single remote-port transaction,
+ * and reads stay behind earlier writes as PCIe ordering requires.
+ *
+ * With a "shm:" descriptor, DMA to guest RAM is copied directly through a
+ * shared mapping of QEMU's RAM file (zero-copy for the payload) and is
+ * offered to initiators as DMI. Everything else - config and MMIO from the
+ * guest, MSI-X messages, non-RAM DMA - keeps using the remote-port socket.
  */
 SC_MODULE(PCIeQemuBridge)
 {
@@ -35,6 +58,9 @@ public:
     // Reset signal
     sc_in<bool> rst;
 
+    // Remote-port socket descriptor, without any shm: prefix
+    std::string control_descr;
+
     // Public access to internal components (needed for socket binding)
     remoteport_tlm_pci_ep rp_pci_ep;
     pcie_root_port rootport;
@@ -47,17 +73,23 @@ public:
      * @param sk_descr Socket descriptor string for Remote-Port connection
      *                 Format: "unix:path/to/socket" or "tcp:hostname:port"
      *                 Example: "unix:/tmp/qemu-rp-0"
+     *                 or "shm:<ram-file>[,lowmem=<bytes>][,sk=<descriptor>]"
+     *                 to map guest RAM and keep the socket for control only
+     *                 Example: "shm:/dev/shm/qemu-ram,sk=unix:/tmp/qemu-rp-0"
      */
     PCIeQemuBridge(sc_module_name name, const char *sk_descr) : sc_module(name),
                                                                 init_socket("init_socket"),
                                                                 tgt_socket("tgt_socket"),
                                                                 rst("rst"),
+                                                                control_descr(control_descriptor(sk_descr)),
                                                                 rp_pci_ep("rp-pci-ep",
-                                                                          0,         // Adapters (not used for basic setup)
-                                                                          1,         // Number of devs
-                                                                          0,         // Offset
-                                                                          sk_descr), // Socket descriptor
-                                                                rootport("rootport")
+                                                                          0,                      // Adapters (not used for basic setup)
+                                                                          1,                      // Number of devs
+                                                                          0,                      // Offset
+                                                                          control_descr.c_str()), // Socket descriptor
+                                                                rootport("rootport"),
+                                                                prof_transport(std::string(this->name()) + ".b_transport"),
+                                                                prof_forward(std::string(this->name()) + ".rp_transport")
     {
         // Connect reset signal to remote-port
         rp_pci_ep.rst(rst);
@@ -67,19 +99,321 @@ public:
 
         // Register TLM transport callbacks
         tgt_socket.register_b_transport(this, &PCIeQemuBridge::b_transport);
+        tgt_socket.register_get_direct_mem_ptr(this, &PCIeQemuBridge::get_direct_mem_ptr);
+
+        if (strncmp(sk_descr, "shm:", 4) == 0)
+            map_guest_ram(sk_descr + 4);
+
+        // Upstream requests leave through the root port towards QEMU
+        init_socket.bind(rootport.tgt_socket);
+
+        SC_THREAD(forward_thread);
+    }
+
+    /**
+     * Queue upstream traffic instead of forwarding it one transaction at a
+     * time. max_outstanding is only the queue depth (callers block beyond
+     * it): the single forward_thread still has one remote-port transaction
+     * in flight at a time. max_batch_bytes bounds one merged transaction.
+     */
+    void set_batching(bool enable, unsigned max_outstanding = 16, unsigned max_batch_bytes = 64 * 1024)
+    {
+        batching = enable;
+        outstanding_limit = std::max(1u, max_outstanding);
+        batch_limit = std::max(4u, max_batch_bytes);
+    }
+
+    void end_of_simulation()
+    {
+        if (shm_bytes)
+            MM_INFO("Remote-port bridge: " << std::dec << shm_bytes
+                    << " DMA bytes copied through guest RAM shm");
+        if (requests_in)
+            MM_INFO("Remote-port bridge: " << std::dec << requests_in << " upstream requests in "
+                    << requests_out << " transactions (" << merged << " merged, "
+                    << posted << " posted)");
     }
 
 private:
+    GuestRamShm guest_ram;
+    uint64_t shm_bytes = 0;
+
+    // "shm:<file>,...,sk=<descr>" -> "<descr>"; anything else unchanged
+    static std::string control_descriptor(const char *sk_descr)
+    {
+        std::string d(sk_descr);
+        if (d.compare(0, 4, "shm:") != 0)
+            return d;
+        size_t sk = d.find(",sk=");
+        return sk == std::string::npos ? "unix:/tmp/qemu-rp-0" : d.substr(sk + 4);
+    }
+
+    void map_guest_ram(const std::string &spec)
+    {
+        std::string path = spec.substr(0, spec.find(','));
+        uint64_t lowmem = 0;
+        size_t lm = spec.find(",lowmem=");
+        if (lm != std::string::npos)
+            lowmem = strtoull(spec.c_str() + lm + 8, nullptr, 0);
+
+        if (guest_ram.map(path, lowmem))
+            MM_INFO("Remote-port bridge: guest RAM shm " << path << " (" << std::dec
+                    << (guest_ram.ram_size() >> 20) << " MB), control on " << control_descr);
+        else
+            MM_WARN("WARNING: guest RAM shm unavailable, DMA falls back to " << control_descr);
+    }
+
+    // DMA straight into the shared guest RAM mapping, bypassing the socket
+    bool shm_transport(tlm::tlm_generic_payload &trans)
+    {
+        if (!guest_ram.mapped() || !mergeable(trans))
+            return false;
+
+        unsigned len = trans.get_data_length();
+        unsigned char *host = guest_ram.translate(trans.get_address(), len);
+        if (!host)
+            return false;
+
+        // Posted writes still queued for the socket must land first
+        wait_drained();
+
+        if (trans.get_command() == tlm::TLM_READ_COMMAND)
+        {
+            memcpy(trans.get_data_ptr(), host, len);
+        }
+        else if (trans.get_command() == tlm::TLM_WRITE_COMMAND)
+        {
+            memcpy(host, trans.get_data_ptr(), len);
+            // Publish the data before any later interrupt message
+            std::atomic_thread_fence(std::memory_order_release);
+        }
+
+        shm_bytes += len;
+        trans.set_dmi_allowed(true);
+        trans.set_response_status(tlm::TLM_OK_RESPONSE);
+        return true;
+    }
+
+    bool get_direct_mem_ptr(tlm::tlm_generic_payload & trans, tlm::tlm_dmi & dmi)
+    {
+        uint64_t start, end;
+        unsigned char *host = guest_ram.translate(trans.get_address(), 1, &start, &end);
+        if (!host)
+            return false;
+
+        dmi.set_dmi_ptr(host - (trans.get_address() - start));
+        dmi.set_start_address(start);
+        dmi.set_end_address(end);
+        dmi.allow_read_write();
+        dmi.set_read_latency(SC_ZERO_TIME);
+        dmi.set_write_latency(SC_ZERO_TIME);
+        return true;
+    }
+
+    // One queued upstream request; reads keep the caller's payload
+    struct pending_request
+    {
+        tlm::tlm_command cmd;
+        uint64_t addr;
+        std::vector<unsigned char> data;       // posted write payload (merged)
+        std::vector<tlm::tlm_generic_payload *> reads;
+        std::vector<unsigned> read_offsets;
+        unsigned len;
+        std::shared_ptr<sc_event> done; // shared by all merged readers
+    };
+
+    bool batching = false;
+    unsigned outstanding_limit = 16;
+    unsigned batch_limit = 64 * 1024;
+    std::deque<pending_request> queue;
+    unsigned queued = 0;
+    bool forwarding = false; // forward_thread holds a popped request
+    sc_event work_event;
+    sc_event space_event;
+    sc_event drained_event;
+    uint64_t requests_in = 0;
+    uint64_t requests_out = 0;
+    uint64_t merged = 0;
+    uint64_t posted = 0;
+
+    // Host-side profile (MM_PROFILE): upstream requests as they arrive,
+    // and the remote-port transactions the forwarding thread sends
+    mm_profile_probe prof_transport;
+    mm_profile_probe prof_forward;
+
+    // Requests that can be sent as they are; byte enables and streaming
+    // widths need the payload untouched
+    static bool mergeable(const tlm::tlm_generic_payload &trans)
+    {
+        return !trans.get_byte_enable_ptr() &&
+               trans.get_streaming_width() >= trans.get_data_length();
+    }
+
+    bool can_append(const pending_request &tail, tlm::tlm_command cmd, uint64_t addr, unsigned len)
+    {
+        return tail.cmd == cmd && tail.addr + tail.len == addr && tail.len + len <= batch_limit;
+    }
+
+    // Block until every queued upstream request has been sent
+    void wait_drained()
+    {
+        while (forwarding || !queue.empty())
+            wait(drained_event);
+    }
+
+    void forward_thread()
+    {
+        while (true)
+        {
+            forwarding = false;
+            if (queue.empty())
+                drained_event.notify();
+            while (queue.empty())
+                wait(work_event);
+
+            // Let requests issued in the same delta cycle join the batch
+            wait(SC_ZERO_TIME);
+
+            pending_request req = queue.front();
+            queue.pop_front();
+            queued--;
+            forwarding = true;
+            space_event.notify();
+
+            tlm::tlm_generic_payload trans;
+            sc_time delay = SC_ZERO_TIME;
+            std::vector<unsigned char> buffer;
+            unsigned char *data = req.data.data();
+
+            if (req.cmd == tlm::TLM_READ_COMMAND)
+            {
+                buffer.resize(req.len);
+                data = buffer.data();
+            }
+
+            // Zero-length reads are ordering fences: everything before
+            // them has been forwarded by now
+            if (req.len == 0)
+            {
+                for (tlm::tlm_generic_payload *r : req.reads)
+                    r->set_response_status(tlm::TLM_OK_RESPONSE);
+                req.done->notify();
+                continue;
+            }
+
+            trans.set_command(req.cmd);
+            trans.set_address(req.addr);
+            trans.set_data_ptr(data);
+            trans.set_data_length(req.len);
+            trans.set_streaming_width(req.len);
+            trans.set_byte_enable_ptr(0);
+            trans.set_dmi_allowed(false);
+            trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+
+            {
+                mm_profile_scope prof(prof_forward, &delay);
+                init_socket->b_transport(trans, delay);
+            }
+            requests_out++;
+            wait(delay);
+
+            if (req.cmd == tlm::TLM_READ_COMMAND)
+            {
+                // Scatter the merged read back to the waiting callers
+                for (size_t i = 0; i < req.reads.size(); i++)
+                {
+                    tlm::tlm_generic_payload *r = req.reads[i];
+                    if (trans.is_response_ok())
+                        memcpy(r->get_data_ptr(), data + req.read_offsets[i], r->get_data_length());
+                    r->set_response_status(trans.get_response_status());
+                }
+                req.done->notify();
+            }
+            else if (!trans.is_response_ok())
+            {
+                MM_ERROR("ERROR: Posted write to 0x" << std::hex << req.addr << std::dec
+                         << " (" << req.len << " bytes) failed in QEMU");
+            }
+        }
+    }
+
     /**
      * Handle incoming TLM transactions from PCIeController (device -> QEMU)
      * This handles DMA requests from the device going upstream to host memory
      */
     void b_transport(tlm::tlm_generic_payload & trans, sc_time & delay)
     {
+        mm_profile_scope prof(prof_transport, &delay);
+        tlm::tlm_command cmd = trans.get_command();
+
+        if (shm_transport(trans))
+            return;
+
+        // A zero-length read only orders earlier posted writes; with
+        // nothing queued there is nothing to wait for
+        if (!batching && cmd == tlm::TLM_READ_COMMAND && trans.get_data_length() == 0)
+        {
+            trans.set_response_status(tlm::TLM_OK_RESPONSE);
+            return;
+        }
+
         // Forward DMA transactions to QEMU through the rootport
-        // The rootport init_socket is already connected to QEMU via rp_pci_ep
-        // So we forward to init_socket which will route to QEMU
-        init_socket->b_transport(trans, delay);
+        if (!batching || !mergeable(trans) || cmd == tlm::TLM_IGNORE_COMMAND)
+        {
+            wait_drained();
+            init_socket->b_transport(trans, delay);
+            return;
+        }
+
+        requests_in++;
+        wait(delay);
+        delay = SC_ZERO_TIME;
+
+        uint64_t addr = trans.get_address();
+        unsigned len = trans.get_data_length();
+
+        if (!queue.empty() && can_append(queue.back(), cmd, addr, len))
+        {
+            merged++;
+        }
+        else
+        {
+            while (queued >= outstanding_limit)
+                wait(space_event);
+
+            pending_request req;
+            req.cmd = cmd;
+            req.addr = addr;
+            req.len = 0;
+            queue.push_back(req);
+            queued++;
+        }
+
+        pending_request &tail = queue.back();
+
+        if (cmd == tlm::TLM_WRITE_COMMAND)
+        {
+            // Posted: the data is copied and the caller continues at once
+            tail.data.insert(tail.data.end(), trans.get_data_ptr(), trans.get_data_ptr() + len);
+            tail.len += len;
+            posted++;
+            trans.set_response_status(tlm::TLM_OK_RESPONSE);
+            work_event.notify();
+            return;
+        }
+
+        // Non-posted read: wait for the (possibly merged) completion
+        if (!tail.done)
+            tail.done = std::make_shared<sc_event>();
+        std::shared_ptr<sc_event> completion = tail.done;
+        tail.reads.push_back(&trans);
+        tail.read_offsets.push_back(tail.len);
+        tail.len += len;
+        trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+        work_event.notify();
+
+        while (trans.get_response_status() == tlm::TLM_INCOMPLETE_RESPONSE)
+            wait(*completion);
     }
 };
 
@@ -0,0 +1,323 @@
+#include <systemc.h>
+#include <tlm>
+#include <tlm_utils/simple_initiator_socket.h>
+#include <tlm_utils/simple_target_socket.h>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+#include "matrix_multiplier_pcie.h"
+#include "mm_trace.h"
+
+using namespace sc_core;
+using namespace std;
+
+/**
+ * Trace replay front-end.
+ *
+ * Drives matrix_multiplier_pcie from a trace recorded with MM_TRACE
+ * (ideally with ",payload") instead of from QEMU and the guest driver:
+ *
+ *   pcie_replay <trace>
+ *
+ * BAR0 records are re-issued on the BAR0 socket at their recorded times.
+ * The guest's reaction times are part of the trace, so issuing them any
+ * sooner would run ahead of the completions they waited for; with no
+ * guest or socket in the loop, replay costs only the model's own time.
+ *
+ * Host memory is rebuilt from the DMA records: each DMA access the device
+ * makes is matched to the next recorded access of the same address and
+ * length. For reads its captured payload is applied first, so data the
+ * guest rewrote between reads (SQ slots, fresh buffers) comes back as it
+ * was, and matched accesses get the recorded host latency.
+ *
+ * The device is configured from the same MM_* variables as
+ * pcie_system_top, so use the settings the trace was taken with.
+ */
+
+// Sparse host memory in 4 KB pages, zero until written
+class sparse_memory
+{
+public:
+    void read(uint64_t addr, unsigned char *dst, uint64_t len)
+    {
+        while (len)
+        {
+            uint64_t off = addr & (PAGE - 1);
+            uint64_t n = min(len, PAGE - off);
+            auto it = pages.find(addr - off);
+            if (it == pages.end())
+                memset(dst, 0, n);
+            else
+                memcpy(dst, it->second.data() + off, n);
+            addr += n;
+            dst += n;
+            len -= n;
+        }
+    }
+
+    void write(uint64_t addr, const unsigned char *src, uint64_t len)
+    {
+        while (len)
+        {
+            uint64_t off = addr & (PAGE - 1);
+            uint64_t n = min(len, PAGE - off);
+            vector<unsigned char> &page = pages[addr - off];
+            if (page.empty())
+                page.resize(PAGE, 0);
+            memcpy(page.data() + off, src, n);
+            addr += n;
+            src += n;
+            len -= n;
+        }
+    }
+
+    size_t page_count() const
+    {
+        return pages.size();
+    }
+
+private:
+    static const uint64_t PAGE = 4096;
+    unordered_map<uint64_t, vector<unsigned char>> pages;
+};
+
+SC_MODULE(replay_memory)
+{
+public:
+    tlm_utils::simple_target_socket<replay_memory> target_socket;
+
+    uint64_t served = 0;
+    uint64_t unmatched = 0;
+
+    SC_HAS_PROCESS(replay_memory);
+
+    replay_memory(sc_module_name name, const mm_trace_reader &reader, int dma_port)
+        : sc_module(name), target_socket("target_socket"), trace(reader)
+    {
+        target_socket.register_b_transport(this, &replay_memory::b_transport);
+
+        if (dma_port < 0)
+            return;
+        for (uint64_t i = trace.first(); i < trace.end(); i = trace.next(i))
+        {
+            const mm_trace_record &r = trace.record(i);
+            if (r.port == dma_port)
+                recorded[access_key(r.command, r.address, r.length)].push_back(i);
+        }
+    }
+
+    void b_transport(tlm::tlm_generic_payload & trans, sc_time & delay)
+    {
+        tlm::tlm_command cmd = trans.get_command();
+        uint64_t addr = trans.get_address();
+        unsigned char *ptr = trans.get_data_ptr();
+        unsigned int len = trans.get_data_length();
+        served++;
+
+        // The host state this access saw when it was recorded
+        auto it = recorded.find(access_key(cmd, addr, len));
+        if (it != recorded.end() && !it->second.empty())
+        {
+            uint64_t i = it->second.front();
+            it->second.pop_front();
+            const unsigned char *payload = trace.payload(i);
+            if (cmd == tlm::TLM_READ_COMMAND && payload)
+                memory.write(addr, payload, len);
+            delay += trace.to_time(trace.record(i).latency);
+        }
+        else
+        {
+            unmatched++;
+        }
+
+        if (cmd == tlm::TLM_READ_COMMAND)
+            memory.read(addr, ptr, len);
+        else if (cmd == tlm::TLM_WRITE_COMMAND)
+            memory.write(addr, ptr, len);
+
+        // Keep every access visible to the replayed latencies
+        trans.set_dmi_allowed(false);
+        trans.set_response_status(tlm::TLM_OK_RESPONSE);
+    }
+
+    size_t page_count() const
+    {
+        return memory.page_count();
+    }
+
+private:
+    const mm_trace_reader &trace;
+    sparse_memory memory;
+    map<tuple<int, uint64_t, uint32_t>, deque<uint64_t>> recorded;
+
+    static tuple<int, uint64_t, uint32_t> access_key(int cmd, uint64_t addr, uint32_t len)
+    {
+        return make_tuple(cmd, addr, len);
+    }
+};
+
+SC_MODULE(replay_driver)
+{
+public:
+    tlm_utils::simple_initiator_socket<replay_driver> bar0_socket;
+    sc_in<bool> interrupt_in;
+
+    uint64_t issued = 0;
+    uint64_t read_mismatches = 0;
+    sc_time recorded_end;
+
+    SC_HAS_PROCESS(replay_driver);
+
+    replay_driver(sc_module_name name, const mm_trace_reader &reader, int bar0_port)
+        : sc_module(name), bar0_socket("bar0_socket"), interrupt_in("interrupt_in"),
+          trace(reader), port(bar0_port)
+    {
+        SC_THREAD(replay_sequence);
+    }
+
+private:
+    const mm_trace_reader &trace;
+    int port;
+
+    void replay_sequence()
+    {
+        sc_time start = SC_ZERO_TIME;
+        bool first = true;
+
+        for (uint64_t i = trace.first(); i < trace.end(); i = trace.next(i))
+        {
+            const mm_trace_record &r = trace.record(i);
+            if (r.port != port)
+                continue;
+
+            // Recorded times are relative to the first BAR0 access
+            sc_time when = trace.to_time(r.time);
+            if (first)
+                start = when;
+            first = false;
+            recorded_end = when - start + trace.to_time(r.latency);
+            if (when - start > sc_time_stamp())
+                wait(when - start - sc_time_stamp());
+
+            issue(i, r);
+        }
+
+        MM_INFO("[" << sc_time_stamp() << "] Replay: " << issued << " BAR0 accesses issued");
+    }
+
+    void issue(uint64_t i, const mm_trace_record &r)
+    {
+        tlm::tlm_generic_payload trans;
+        sc_time delay = SC_ZERO_TIME;
+        vector<unsigned char> data(max<uint32_t>(r.length, 8), 0);
+
+        const unsigned char *payload = trace.payload(i);
+        if (payload)
+            memcpy(data.data(), payload, r.length);
+        else
+            memcpy(data.data(), &r.data, min<uint32_t>(r.length, 8));
+
+        trans.set_command((tlm::tlm_command)r.command);
+        trans.set_address(r.address);
+        trans.set_data_ptr(data.data());
+        trans.set_data_length(r.length);
+        trans.set_streaming_width(r.streaming_width ? r.streaming_width : r.length);
+        trans.set_byte_enable_ptr(0);
+        trans.set_dmi_allowed(false);
+        trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
+
+        bar0_socket->b_transport(trans, delay);
+        issued++;
+
+        // A read that returns something else shows where the replay diverged
+        if (r.command == tlm::TLM_READ_COMMAND && r.length <= 8)
+        {
+            uint64_t value = 0;
+            memcpy(&value, data.data(), r.length);
+            if (value != r.data)
+            {
+                if (read_mismatches++ < 10)
+                    MM_WARN("WARNING: Replay read of 0x" << hex << r.address << " returned 0x" << value
+                            << ", recorded 0x" << r.data);
+            }
+        }
+
+        wait(delay);
+    }
+};
+
+int sc_main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " <trace>" << endl;
+        return 1;
+    }
+
+    mm_trace_reader trace;
+    if (!trace.open(argv[1]))
+    {
+        mm_log::flush();
+        return 1;
+    }
+
+    int bar0_port = trace.find_port("bar0_trace");
+    int dma_port = trace.find_port("dma_trace");
+    if (bar0_port < 0)
+    {
+        MM_ERROR("ERROR: " << argv[1] << " has no BAR0 records");
+        mm_log::flush();
+        return 1;
+    }
+    if (dma_port < 0 || !(trace.header().flags & MM_TRACE_PAYLOAD))
+        MM_WARN("WARNING: Trace has no DMA payloads, host memory reads return zeros");
+
+    matrix_multiplier_pcie device("matrix_device");
+    replay_memory memory("replay_memory", trace, dma_port);
+    replay_driver driver("replay_driver", trace, bar0_port);
+
+    sc_signal<bool> irq;
+
+    driver.bar0_socket.bind(device.bar0_target_socket);
+    device.dma_initiator_socket.bind(memory.target_socket);
+    device.interrupt(irq);
+    driver.interrupt_in(irq);
+
+    // Same knobs and defaults as pcie_system_top. MM_PCIE_LINK=off and
+    // MM_DMA_TAGS=0 match the testbench, which has no link model.
+    pcie_link_config link_cfg;
+    const char *link = getenv("MM_PCIE_LINK");
+    if (link && string(link) != "off" && !pcie_link_config::parse(link, link_cfg))
+        MM_WARN("WARNING: Ignoring malformed MM_PCIE_LINK=" << link);
+    if (!link || string(link) != "off")
+        device.set_link_config(link_cfg);
+
+    const char *tags = getenv("MM_DMA_TAGS");
+    device.set_dma_tags(tags ? atoi(tags) : 8);
+
+    if (const char *quantum = getenv("MM_LT_QUANTUM"))
+        device.set_timing_mode(TIMING_LT, sc_time(atof(quantum), SC_NS));
+    if (const char *engines = getenv("MM_ENGINES"))
+        device.set_engine_count(atoi(engines));
+    if (const char *threads = getenv("MM_HOST_THREADS"))
+        device.set_host_threads(atoi(threads));
+
+    auto wall_start = chrono::steady_clock::now();
+    sc_start();
+    double wall = chrono::duration<double>(chrono::steady_clock::now() - wall_start).count();
+    mm_profiler::instance().report("end of replay");
+    mm_log::flush();
+
+    cout << "==================================================" << endl;
+    cout << "Replay of " << argv[1] << endl;
+    cout << "  BAR0 accesses:  " << driver.issued << ", " << driver.read_mismatches << " reads differ" << endl;
+    cout << "  DMA accesses:   " << memory.served << ", " << memory.unmatched << " not in the trace" << endl;
+    cout << "  Host memory:    " << memory.page_count() << " pages touched" << endl;
+    cout << "  Simulated time: " << sc_time_stamp() << " (recorded " << driver.recorded_end << ")" << endl;
+    cout << "  Wall time:      " << wall << " s" << endl;
+    cout << "==================================================" << endl;
+
+    return 0;
+}
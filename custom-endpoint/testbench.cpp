@@ -2,7 +2,9 @@
 #include <tlm>
 #include <tlm_utils/simple_initiator_socket.h>
 #include <tlm_utils/simple_target_socket.h>
+#include <tlm_utils/tlm_quantumkeeper.h>
 #include "matrix_multiplier_pcie.h"
+#include "mm_trace.h"
 
 using namespace sc_core;
 using namespace std;
@@ -15,9 +17,22 @@ public:
     SC_CTOR(host_memory) : target_socket("target_socket")
     {
         target_socket.register_b_transport(this, &host_memory::b_transport);
+        target_socket.register_get_direct_mem_ptr(this, &host_memory::get_direct_mem_ptr);
         memory.resize(16 * 1024 * 1024, 0);
     }
 
+    // The whole memory is one DMI region with the same latency as b_transport
+    bool get_direct_mem_ptr(tlm::tlm_generic_payload & /*trans*/, tlm::tlm_dmi & dmi)
+    {
+        dmi.set_dmi_ptr(memory.data());
+        dmi.set_start_address(0);
+        dmi.set_end_address(memory.size() - 1);
+        dmi.allow_read_write();
+        dmi.set_read_latency(sc_time(20, SC_NS));
+        dmi.set_write_latency(sc_time(20, SC_NS));
+        return true;
+    }
+
     void b_transport(tlm::tlm_generic_payload & trans, sc_time & delay)
     {
         tlm::tlm_command cmd = trans.get_command();
@@ -25,16 +40,16 @@ public:
         unsigned char *ptr = trans.get_data_ptr();
         unsigned int len = trans.get_data_length();
 
-        std::cout << sc_time_stamp() << " [HOST_MEM] trans: cmd="
-                  << (cmd == tlm::TLM_READ_COMMAND ? "R" : "W")
-                  << " addr=0x" << std::hex << addr
-                  << " len=" << std::dec << len << std::endl;
+        MM_VERBOSE(sc_time_stamp() << " [HOST_MEM] trans: cmd="
+                 << (cmd == tlm::TLM_READ_COMMAND ? "R" : "W")
+                 << " addr=0x" << std::hex << addr
+                 << " len=" << std::dec << len);
 
         if (addr + len > memory.size())
         {
-            std::cerr << sc_time_stamp() << " [HOST_MEM] ADDRESS ERROR: addr+len=0x"
-                      << std::hex << (addr + len)
-                      << " memory_size=0x" << memory.size() << std::dec << std::endl;
+            MM_ERROR(sc_time_stamp() << " [HOST_MEM] ADDRESS ERROR: addr+len=0x"
+                     << std::hex << (addr + len)
+                     << " memory_size=0x" << memory.size());
             trans.set_response_status(tlm::TLM_ADDRESS_ERROR_RESPONSE);
             return;
         }
@@ -48,6 +63,7 @@ public:
             memcpy(&memory[addr], ptr, len);
         }
 
+        trans.set_dmi_allowed(true);
         trans.set_response_status(tlm::TLM_OK_RESPONSE);
         delay += sc_time(20, SC_NS);
     }
@@ -78,24 +94,47 @@ public:
     tlm_utils::simple_initiator_socket<test_driver> bar0_socket;
     sc_in<bool> interrupt_in;
 
-    SC_CTOR(test_driver) : bar0_socket("bar0_socket"), interrupt_in("interrupt_in")
+    SC_CTOR(test_driver) : bar0_socket("bar0_socket"), interrupt_in("interrupt_in"), loosely_timed(false)
     {
         SC_THREAD(test_sequence);
         // DO NOT make sensitive to interrupt_in here
     }
 
+    // Keep MMIO time locally and sync once per global quantum
+    void set_loosely_timed(bool enable)
+    {
+        loosely_timed = enable;
+    }
+
 private:
+    tlm_utils::tlm_quantumkeeper qk;
+    bool loosely_timed;
+
+    // Account for one MMIO access returned with the given delay
+    void complete_access(sc_time delay)
+    {
+        if (!loosely_timed)
+        {
+            wait(delay);
+            return;
+        }
+        qk.set(delay);
+        if (qk.need_sync())
+            qk.sync();
+    }
+
     void test_sequence()
     {
-        cout << "\n[TEST] Starting PCIe device test" << endl;
+        MM_INFO("\n[TEST] Starting PCIe device test");
         wait(100, SC_NS);
+        qk.reset();
 
-        cout << "\n[TEST] Reading device status..." << endl;
+        MM_INFO("\n[TEST] Reading device status...");
         uint32_t status = mmio_read32(0x0004);
-        cout << "[TEST] Status = 0x" << hex << status << dec << endl;
+        MM_INFO("[TEST] Status = 0x" << hex << status);
 
         uint32_t n = 4;
-        cout << "\n[TEST] Configuring for " << n << "x" << n << " matrix multiplication" << endl;
+        MM_INFO("\n[TEST] Configuring for " << n << "x" << n << " matrix multiplication");
 
         mmio_write32(0x0008, n);
         mmio_write64(0x0010, 0x1000);
@@ -104,28 +143,40 @@ private:
 
         mmio_write32(0x002C, 0x1);
 
-        cout << "[TEST] Starting computation..." << endl;
+        MM_INFO("[TEST] Starting computation...");
         mmio_write32(0x0000, 0x1);
 
-        cout << "[TEST] Waiting for completion..." << endl;
+        MM_INFO("[TEST] Waiting for completion...");
 
-        // Wait for interrupt to go high
-        while (interrupt_in.read() == false)
+        // Wait for interrupt to go high. In LT mode sleep on the line
+        // instead of polling it every 10 ns.
+        if (loosely_timed)
         {
-            wait(10, SC_NS);
+            qk.sync();
+            while (interrupt_in.read() == false)
+                wait(interrupt_in.value_changed_event());
+        }
+        else
+        {
+            while (interrupt_in.read() == false)
+            {
+                wait(10, SC_NS);
+            }
         }
 
-        cout << "\n[TEST] Interrupt received!" << endl;
+        MM_INFO("\n[TEST] Interrupt received!");
 
         status = mmio_read32(0x0004);
-        cout << "[TEST] Final status = 0x" << hex << status << dec << endl;
+        MM_INFO("[TEST] Final status = 0x" << hex << status);
 
         uint32_t int_status = mmio_read32(0x0028);
-        cout << "[TEST] Interrupt status = 0x" << hex << int_status << dec << endl;
+        MM_INFO("[TEST] Interrupt status = 0x" << hex << int_status);
 
         mmio_write32(0x0028, int_status);
 
-        cout << "\n[TEST] Test completed successfully!" << endl;
+        MM_INFO("\n[TEST] Test completed successfully!");
+        if (loosely_timed)
+            qk.sync();
         wait(100, SC_NS);
         sc_stop();
     }
@@ -133,7 +184,7 @@ private:
     uint32_t mmio_read32(uint64_t addr)
     {
         tlm::tlm_generic_payload trans;
-        sc_time delay = SC_ZERO_TIME;
+        sc_time delay = loosely_timed ? qk.get_local_time() : SC_ZERO_TIME;
         uint32_t data;
 
         trans.set_command(tlm::TLM_READ_COMMAND);
@@ -146,7 +197,7 @@ private:
         trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
 
         bar0_socket->b_transport(trans, delay);
-        wait(delay);
+        complete_access(delay);
 
         return data;
     }
@@ -154,7 +205,7 @@ private:
     void mmio_write32(uint64_t addr, uint32_t data)
     {
         tlm::tlm_generic_payload trans;
-        sc_time delay = SC_ZERO_TIME;
+        sc_time delay = loosely_timed ? qk.get_local_time() : SC_ZERO_TIME;
 
         trans.set_command(tlm::TLM_WRITE_COMMAND);
         trans.set_address(addr);
@@ -166,13 +217,13 @@ private:
         trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
 
         bar0_socket->b_transport(trans, delay);
-        wait(delay);
+        complete_access(delay);
     }
 
     void mmio_write64(uint64_t addr, uint64_t data)
     {
         tlm::tlm_generic_payload trans;
-        sc_time delay = SC_ZERO_TIME;
+        sc_time delay = loosely_timed ? qk.get_local_time() : SC_ZERO_TIME;
 
         trans.set_command(tlm::TLM_WRITE_COMMAND);
         trans.set_address(addr);
@@ -184,7 +235,7 @@ private:
         trans.set_response_status(tlm::TLM_INCOMPLETE_RESPONSE);
 
         bar0_socket->b_transport(trans, delay);
-        wait(delay);
+        complete_access(delay);
     }
 };
 
@@ -196,11 +247,49 @@ int sc_main(int argc, char *argv[])
 
     sc_signal<bool> irq;
 
-    driver.bar0_socket.bind(device.bar0_target_socket);
-    device.dma_initiator_socket.bind(memory.target_socket);
+    // Optional transaction trace, e.g. MM_TRACE=/tmp/mm.trace,payload
+    mm_trace_recorder trace;
+    std::unique_ptr<mm_trace_tap> bar0_tap, dma_tap;
+    bool trace_dmi = false;
+    const char *trace_spec = getenv("MM_TRACE");
+    if (trace_spec && trace.open_spec(trace_spec, &trace_dmi))
+    {
+        bar0_tap.reset(new mm_trace_tap("bar0_trace", trace, trace_dmi));
+        dma_tap.reset(new mm_trace_tap("dma_trace", trace, trace_dmi));
+        driver.bar0_socket.bind(bar0_tap->target_socket);
+        bar0_tap->initiator_socket.bind(device.bar0_target_socket);
+        device.dma_initiator_socket.bind(dma_tap->target_socket);
+        dma_tap->initiator_socket.bind(memory.target_socket);
+    }
+    else
+    {
+        driver.bar0_socket.bind(device.bar0_target_socket);
+        device.dma_initiator_socket.bind(memory.target_socket);
+    }
     device.interrupt(irq);
     driver.interrupt_in(irq);
 
+    // Optional link timing, e.g. MM_PCIE_LINK=gen3x8,mps=256
+    if (const char *link = getenv("MM_PCIE_LINK"))
+    {
+        pcie_link_config link_cfg;
+        if (pcie_link_config::parse(link, link_cfg))
+            device.set_link_config(link_cfg);
+        else
+            MM_WARN("WARNING: Ignoring malformed MM_PCIE_LINK=" << link);
+    }
+
+    // Optional loosely-timed mode, e.g. MM_LT_QUANTUM=1000 (ns)
+    if (const char *quantum = getenv("MM_LT_QUANTUM"))
+    {
+        device.set_timing_mode(TIMING_LT, sc_time(atof(quantum), SC_NS));
+        driver.set_loosely_timed(true);
+    }
+
+    // Optional split-transaction DMA, e.g. MM_DMA_TAGS=8
+    if (const char *tags = getenv("MM_DMA_TAGS"))
+        device.set_dma_tags(atoi(tags));
+
     float matrix_a[16] = {
         1, 0, 0, 0,
         0, 1, 0, 0,
@@ -214,11 +303,14 @@ int sc_main(int argc, char *argv[])
     memory.write_data(0x1000, matrix_a, sizeof(matrix_a));
     memory.write_data(0x2000, matrix_b, sizeof(matrix_b));
 
+    mm_log::flush();
     cout << "==================================================" << endl;
     cout << "Starting SystemC Simulation" << endl;
     cout << "==================================================" << endl;
 
     sc_start();
+    trace.close();
+    mm_log::flush();
 
     float matrix_c[16];
     memory.read_data(0x3000, matrix_c, sizeof(matrix_c));
@@ -0,0 +1,129 @@
+#ifndef CPCIDEV_UAPI_H
+#define CPCIDEV_UAPI_H
+
+/* Interface shared by the cpcidev driver and user-space applications. */
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define CPCIDEV_MAGIC 'c'
+
+/* Largest N accepted by the device (REG_DIM_N) */
+#define CPCIDEV_MAX_DIM 16384
+
+/* Jobs accepted by one IOCTL_GEMM_BATCH call */
+#define CPCIDEV_MAX_BATCH 1024
+
+/*
+ * One C = A * B job on N x N row-major float matrices.
+ * a, b and c are user-space pointers. status is filled in by the driver:
+ * 0 on success, the device completion status code otherwise.
+ */
+struct cpcidev_gemm_job {
+	__u64 a;
+	__u64 b;
+	__u64 c;
+	__u32 n;
+	__s32 status;
+};
+
+/*
+ * Batch of jobs pushed through the device submission queue with a single
+ * doorbell write. jobs points to an array of count entries; completed is
+ * set to the number of jobs the device finished.
+ */
+struct cpcidev_gemm_batch {
+	__u64 jobs;
+	__u32 count;
+	__u32 completed;
+};
+
+#define IOCTL_GEMM_BATCH _IOWR(CPCIDEV_MAGIC, 5, struct cpcidev_gemm_batch)
+
+/*
+ * One C = A * B job on operands already in the caller's mapping of the
+ * device node. mmap() of /dev/cpcidev_pci at offset 0 returns a coherent
+ * DMA buffer; the first mapping of an open file sets its size. a_off,
+ * b_off and c_off are byte offsets of the N x N row-major float matrices
+ * in that buffer, and C is written there. status is 0 on success, nonzero
+ * if the device flagged an error.
+ */
+struct cpcidev_gemm_mapped {
+	__u64 a_off;
+	__u64 b_off;
+	__u64 c_off;
+	__u32 n;
+	__s32 status;
+};
+
+#define IOCTL_GEMM_MAPPED _IOWR(CPCIDEV_MAGIC, 7, struct cpcidev_gemm_mapped)
+
+/*
+ * Asynchronous jobs. IOCTL_GEMM_SUBMIT queues one job and returns at once
+ * with id set, or fails with EAGAIN while every job slot of the device is
+ * taken. a, b and c are user pointers, or with CPCIDEV_SUBMIT_MAPPED byte
+ * offsets into the caller's mapping, as for IOCTL_GEMM_MAPPED.
+ *
+ * Completions are collected by read() on the device node, which returns
+ * whole struct cpcidev_completion records and copies each result to its
+ * job's c first. poll()/epoll report POLLIN while any are waiting, and an
+ * eventfd set with IOCTL_SET_EVENTFD (-1 to remove) is signalled once per
+ * completion.
+ */
+#define CPCIDEV_SUBMIT_MAPPED (1 << 0)
+
+struct cpcidev_gemm_submit {
+	__u64 a;
+	__u64 b;
+	__u64 c;
+	__u32 n;
+	__u32 flags;
+	__u64 id;
+};
+
+/*
+ * status is 0 on success, the device completion status code, or a
+ * negative errno: the result could not be copied to c, or ENODEV if the
+ * device was removed before the job completed.
+ */
+struct cpcidev_completion {
+	__u64 id;
+	__s32 status;
+	__u32 rsvd;
+};
+
+#define IOCTL_GEMM_SUBMIT _IOWR(CPCIDEV_MAGIC, 8, struct cpcidev_gemm_submit)
+#define IOCTL_SET_EVENTFD _IOW(CPCIDEV_MAGIC, 9, __s32)
+
+/*
+ * io_uring passthrough: IORING_OP_URING_CMD with this cmd_op on a ring
+ * set up with IORING_SETUP_SQE128. The SQE command area holds a struct
+ * cpcidev_gemm_submit with CPCIDEV_SUBMIT_MAPPED set; id is not used.
+ * The CQE res is the status as in struct cpcidev_completion, or a
+ * negative errno (EBUSY while every job slot is taken).
+ */
+#define CPCIDEV_URING_CMD_GEMM _IOWR(CPCIDEV_MAGIC, 0x80, struct cpcidev_gemm_submit)
+
+/*
+ * Device performance counters, latched together. Times are in ns and
+ * cover elapsed_ns since the counters were last cleared, so utilisation
+ * is busy_ns / elapsed_ns and throughput dma_*_bytes / elapsed_ns. Set
+ * clear to restart the counters after reading them.
+ */
+struct cpcidev_perf {
+	__u64 elapsed_ns;
+	__u64 jobs;
+	__u64 dma_in_bytes;
+	__u64 dma_out_bytes;
+	__u64 dma_stall_ns;
+	__u64 busy_ns;
+	__u64 idle_ns;
+	__u64 interrupts;
+	__u64 errors;
+	__u32 clear;
+	__u32 rsvd;
+};
+
+#define IOCTL_GET_PERF _IOWR(CPCIDEV_MAGIC, 6, struct cpcidev_perf)
+
+#endif
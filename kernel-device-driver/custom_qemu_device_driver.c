@@ -1,14 +1,40 @@
 #include <asm/uaccess.h> /* put_user */
 #include <linux/cdev.h>	 /* cdev_ */
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/eventfd.h>
 #include <linux/fs.h>
 #include <linux/init.h>
 #include <linux/interrupt.h>
+#include <linux/io-64-nonatomic-lo-hi.h>
+#include <linux/io_uring.h>
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/pci.h>
+#include <linux/poll.h>
 #include <linux/device.h>
+#include <linux/mm.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/slab.h>
 #include <linux/version.h>
 #include "chardev.h"
+#include "cpcidev_uapi.h"
+
+/* Renamed from PCI_IRQ_LEGACY in 6.8 */
+#ifndef PCI_IRQ_INTX
+#define PCI_IRQ_INTX PCI_IRQ_LEGACY
+#endif
+
+/* io_uring passthrough; the uring_cmd helpers used here appeared in 6.5
+ * and moved to their own header in 6.10 */
+#if IS_ENABLED(CONFIG_IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+#define CPCIDEV_URING 1
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+#include <linux/io_uring/cmd.h>
+#endif
+#endif
 
 /* Each PCI device has 6 BAR IOs (base address register) as per the PCI spec.
  *
@@ -34,21 +60,185 @@
 #define BAR 0
 #define CDEV_NAME "cpcidev_pci"
 #define EDU_DEVICE_ID 0xabcd
-#define IO_IRQ_ACK 0x64
-#define IO_IRQ_STATUS 0x24
 #define QEMU_VENDOR_ID 0x1234
 
-// #define IOCTL_SET_OP1_MATRIX 0x01
-// #define IOCTL_SET_OP2_MATRIX 0x02
-// #define IOCTL_GET_RESULT 0x03
-// #define IOCTL_SET_OPCODE 0x04
+/* Matrix multiplier endpoint register map (BAR0), see
+ * custom-endpoint/matrix_multiplier_pcie.h */
+#define REG_CONTROL 0x0000
+#define REG_STATUS 0x0004
+#define REG_DIM_N 0x0008
+#define REG_MATRIX_A_PTR 0x0010
+#define REG_MATRIX_B_PTR 0x0018
+#define REG_MATRIX_C_PTR 0x0020
+#define REG_INT_STATUS 0x0028 /* write 1 to clear */
+#define REG_INT_ENABLE 0x002C
+#define REG_MSIX_CTRL 0x0030 /* the model's view of the MSI-X enable bit */
+#define CTRL_START (1 << 0)
+#define CTRL_RESET (1 << 1)
+#define STATUS_DONE (1 << 2)
+#define STATUS_ERROR (1 << 3)
+#define INT_DONE (1 << 0)
+#define INT_CQ (1 << 1)
+#define INT_ERROR (1 << 2)
+#define MSIX_CTRL_ENABLE (1 << 0)
+
+/* MSI-X table layout: one vector per queue, then one for register-interface
+ * completion and errors */
+#define CPCIDEV_NUM_QUEUES 4
+#define CPCIDEV_MSIX_VECTORS (CPCIDEV_NUM_QUEUES + 1)
+#define CPCIDEV_VEC_MISC CPCIDEV_NUM_QUEUES
+
+/* Submission/completion queue pairs, 0x20 of registers per queue */
+#define REG_QUEUE_BASE 0x0100
+#define REG_QUEUE_STRIDE 0x0020
+#define QREG_SQ_BASE 0x00
+#define QREG_CQ_BASE 0x08
+#define QREG_SIZE 0x10
+#define QREG_SQ_TAIL 0x14
+#define QREG_CQ_HEAD 0x18
+
+/* Performance counters, 64-bit, latched by a PERF_SNAPSHOT write */
+#define REG_PERF_BASE 0x0400
+#define PREG_CTRL 0x00
+#define PREG_ELAPSED 0x08
+#define PREG_JOBS 0x10
+#define PREG_DMA_IN_BYTES 0x18
+#define PREG_DMA_OUT_BYTES 0x20
+#define PREG_DMA_STALL 0x28
+#define PREG_BUSY 0x30
+#define PREG_IDLE 0x38
+#define PREG_INTERRUPTS 0x40
+#define PREG_ERRORS 0x48
+#define PERF_SNAPSHOT (1 << 0)
+#define PERF_CLEAR (1 << 1)
+
+#define CPCIDEV_QUEUE_DEPTH 256
+#define CPCIDEV_CQ_TIMEOUT_MS 30000
+
+/* Blocking batches use queue 0; queues 1 to 3 are hardware queue contexts
+ * for asynchronous jobs, each CPU submitting to one of them. One job slot
+ * per SQ entry, less the one that tells a full ring from an empty one,
+ * so a job that got a slot always fits in its SQ. */
+#define CPCIDEV_BATCH_QID 0
+#define CPCIDEV_FIRST_HWQ 1
+#define CPCIDEV_NR_HWQ (CPCIDEV_NUM_QUEUES - CPCIDEV_FIRST_HWQ)
+#define CPCIDEV_ASYNC_SLOTS (CPCIDEV_QUEUE_DEPTH - 1)
+
+/* Descriptor layouts shared with the device model */
+struct mm_sq_entry {
+	__le64 a_ptr;
+	__le64 b_ptr;
+	__le64 c_ptr;
+	__le32 dim_n;
+	__le16 cid;
+	__le16 flags;
+};
+
+struct mm_cq_entry {
+	__le32 result;
+	__le16 sq_head;
+	__le16 sq_id;
+	__le16 cid;
+	__le16 status; /* bit 0: phase tag, bits 15:1: status code */
+	__le32 rsvd;
+};
+
+/* Host side of one submission/completion queue pair */
+struct cpcidev_queue {
+	struct mm_sq_entry *sq;
+	struct mm_cq_entry *cq;
+	dma_addr_t sq_dma;
+	dma_addr_t cq_dma;
+	void __iomem *regs;
+	u16 qid;
+	u16 depth;
+	u16 sq_tail;
+	u16 sq_head; /* last SQ head reported by the device */
+	u16 cq_head;
+	u8 cq_phase;
+};
+
+/* Coherent staging buffer holding A, B and C of one job */
+struct cpcidev_job_buf {
+	void *cpu;
+	dma_addr_t dma;
+	size_t mat_bytes;
+};
+
+struct cpcidev_dev;
+struct cpcidev_hwq;
+
+/*
+ * Per-open state: the coherent buffer mapped into the caller by mmap(),
+ * and the asynchronous jobs it submitted. done and eventfd are protected
+ * by done_lock, taken inside a queue's lock.
+ */
+struct cpcidev_file {
+	struct cpcidev_dev *cd;
+	struct mutex lock;
+	void *cpu;
+	dma_addr_t dma;
+	size_t size;
+	bool dma_busy; /* a job timed out and may still access the buffer */
+
+	spinlock_t done_lock;
+	struct list_head done; /* completed jobs not read() yet */
+	wait_queue_head_t wait;
+	struct eventfd_ctx *eventfd;
+};
+
+/* One asynchronous job, indexed by the command ID it has in the SQ */
+struct cpcidev_async_job {
+	struct cpcidev_hwq *hwq;
+	struct cpcidev_file *owner; /* NULL once the submitter closed the file */
+	struct cpcidev_job_buf buf; /* staging; cpu is NULL for mapped jobs */
+	struct list_head node;		/* on owner->done once completed */
+	struct io_uring_cmd *ioucmd; /* completed through io_uring instead */
+	u64 id;
+	u64 c; /* user pointer the result is copied to */
+	s32 status;
+};
+
+/*
+ * One hardware queue context: an SQ/CQ pair with its own job slots and
+ * MSI-X vector. Submitters claim a slot with an atomic bit operation and
+ * hold sq_lock only to fill the descriptor and ring the doorbell. lock
+ * orders the CQ reaper against release() detaching jobs from a file.
+ */
+struct cpcidev_hwq {
+	struct cpcidev_dev *cd;
+	struct cpcidev_queue q;
+	spinlock_t sq_lock;
+	spinlock_t lock;
+	unsigned long slots[BITS_TO_LONGS(CPCIDEV_ASYNC_SLOTS)];
+	struct cpcidev_async_job jobs[CPCIDEV_ASYNC_SLOTS];
+	char irq_name[16];
+};
+
+/*
+ * Per-device state. Open files hold a reference, so it outlives
+ * pci_remove(); entry points that touch the device hold remove_sem for
+ * reading and fail once removed is set.
+ */
+struct cpcidev_dev {
+	struct kref ref;
+	struct rw_semaphore remove_sem;
+	bool removed;
 
-#define CPCIDEV_MAGIC 'c'
+	struct pci_dev *pdev;
+	void __iomem *mmio;
+	struct cdev *cdev;
+	bool use_msix;
 
-#define IOCTL_SET_OP1_MATRIX _IOW(CPCIDEV_MAGIC, 1, uint32_t[4][4])
-#define IOCTL_SET_OP2_MATRIX _IOW(CPCIDEV_MAGIC, 2, uint32_t[4][4])
-#define IOCTL_GET_RESULT _IOR(CPCIDEV_MAGIC, 3, uint32_t[4][4])
-#define IOCTL_SET_OPCODE _IOW(CPCIDEV_MAGIC, 4, uint32_t)
+	struct cpcidev_queue batch_q;
+	struct mutex batch_lock;
+	struct mutex perf_lock;
+	struct mutex reg_job_lock;
+
+	struct cpcidev_hwq hwq[CPCIDEV_NR_HWQ];
+	u8 *cpu_hwq; /* hardware queue each CPU submits to */
+	atomic64_t next_id;
+};
 
 MODULE_LICENSE("GPL");
 
@@ -66,110 +256,980 @@ static struct pci_device_id pci_ids[] = {
 // hardware device.
 MODULE_DEVICE_TABLE(pci, pci_ids);
 
-static int pci_irq;
 static int major;
-static struct pci_dev *pdev;
-static void __iomem *mmio;
 
 /* Device class and device for automatic /dev node creation */
 static struct class *cpcidev_class;
 static struct device *cpcidev_device;
-static struct cdev cpcidev_cdev;
 static dev_t dev_num;
+
+/* The bound device, NULL while none is ready; open() takes a reference */
+static struct cpcidev_dev *cpcidev;
+static DEFINE_MUTEX(cpcidev_open_lock);
+
+static void cpcidev_dev_release(struct kref *ref)
+{
+	struct cpcidev_dev *cd = container_of(ref, struct cpcidev_dev, ref);
+
+	kfree(cd->cpu_hwq);
+	pci_dev_put(cd->pdev);
+	kvfree(cd);
+}
+
+/* Keep pci_remove() out while touching the device */
+static int cpcidev_enter(struct cpcidev_dev *cd)
+{
+	down_read(&cd->remove_sem);
+	if (cd->removed)
+	{
+		up_read(&cd->remove_sem);
+		return -ENODEV;
+	}
+	return 0;
+}
+
+static void cpcidev_exit(struct cpcidev_dev *cd)
+{
+	up_read(&cd->remove_sem);
+}
+
+static int cpcidev_queue_init(struct cpcidev_dev *cd, struct cpcidev_queue *q, u16 qid, u16 depth)
+{
+	struct pci_dev *dev = cd->pdev;
+
+	q->sq = dma_alloc_coherent(&dev->dev, depth * sizeof(*q->sq), &q->sq_dma, GFP_KERNEL);
+	if (!q->sq)
+		return -ENOMEM;
+
+	q->cq = dma_alloc_coherent(&dev->dev, depth * sizeof(*q->cq), &q->cq_dma, GFP_KERNEL);
+	if (!q->cq)
+	{
+		dma_free_coherent(&dev->dev, depth * sizeof(*q->sq), q->sq, q->sq_dma);
+		q->sq = NULL;
+		return -ENOMEM;
+	}
+
+	q->regs = cd->mmio + REG_QUEUE_BASE + qid * REG_QUEUE_STRIDE;
+	q->qid = qid;
+	q->depth = depth;
+	q->sq_tail = 0;
+	q->sq_head = 0;
+	q->cq_head = 0;
+	q->cq_phase = 1;
+
+	iowrite32(lower_32_bits(q->sq_dma), q->regs + QREG_SQ_BASE);
+	iowrite32(upper_32_bits(q->sq_dma), q->regs + QREG_SQ_BASE + 4);
+	iowrite32(lower_32_bits(q->cq_dma), q->regs + QREG_CQ_BASE);
+	iowrite32(upper_32_bits(q->cq_dma), q->regs + QREG_CQ_BASE + 4);
+	/* Writing the size enables the queue and resets the device indices */
+	iowrite32(depth | (depth << 16), q->regs + QREG_SIZE);
+
+	return 0;
+}
+
+static void cpcidev_queue_free(struct cpcidev_dev *cd, struct cpcidev_queue *q)
+{
+	struct pci_dev *dev = cd->pdev;
+
+	if (!q->sq)
+		return;
+
+	iowrite32(0, q->regs + QREG_SIZE);
+	dma_free_coherent(&dev->dev, q->depth * sizeof(*q->cq), q->cq, q->cq_dma);
+	dma_free_coherent(&dev->dev, q->depth * sizeof(*q->sq), q->sq, q->sq_dma);
+	q->sq = NULL;
+	q->cq = NULL;
+}
+
+static bool cpcidev_sq_full(struct cpcidev_queue *q)
+{
+	return (q->sq_tail + 1) % q->depth == q->sq_head;
+}
+
+/* Fill the next SQ slot. The doorbell is rung separately so a whole batch
+ * costs one MMIO write. */
+static void cpcidev_sq_push(struct cpcidev_queue *q, dma_addr_t a, dma_addr_t b, dma_addr_t c, u32 n, u16 cid)
+{
+	struct mm_sq_entry *e = &q->sq[q->sq_tail];
+
+	e->a_ptr = cpu_to_le64(a);
+	e->b_ptr = cpu_to_le64(b);
+	e->c_ptr = cpu_to_le64(c);
+	e->dim_n = cpu_to_le32(n);
+	e->cid = cpu_to_le16(cid);
+	e->flags = 0;
+
+	q->sq_tail = (q->sq_tail + 1) % q->depth;
+}
+
+static void cpcidev_sq_ring(struct cpcidev_queue *q)
+{
+	/* Descriptors must be visible before the device sees the new tail */
+	wmb();
+	iowrite32(q->sq_tail, q->regs + QREG_SQ_TAIL);
+}
+
 /*
-	Following function is calling in our case since in the user-space is calling the ioctl funtion, not read/write funtions
-*/
+ * Take the next completion the device posted, if any. The CQ head
+ * doorbell is left to cpcidev_cq_ring so a run of entries costs one write.
+ */
+static bool cpcidev_cq_pop(struct cpcidev_queue *q, u16 *cid, u16 *status)
+{
+	struct mm_cq_entry *e = &q->cq[q->cq_head];
+	u16 st = le16_to_cpu(READ_ONCE(e->status));
 
-static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+	if ((st & 1) != q->cq_phase)
+		return false;
+
+	/* Read the rest of the entry only after the phase tag */
+	dma_rmb();
+	*cid = le16_to_cpu(e->cid);
+	*status = st >> 1;
+	q->sq_head = le16_to_cpu(e->sq_head);
+
+	q->cq_head = (q->cq_head + 1) % q->depth;
+	if (q->cq_head == 0)
+		q->cq_phase ^= 1;
+	return true;
+}
+
+static void cpcidev_cq_ring(struct cpcidev_queue *q)
 {
-	uint32_t kbuf[4][4];
-	uint32_t opcode;
-	int i, j;
-	void __user *uarg = (void __user *)arg;
+	iowrite32(q->cq_head, q->regs + QREG_CQ_HEAD);
+}
 
-	printk(KERN_INFO "dev_ioctl() cmd: %u\n", cmd);
+/*
+ * Collect every completion the device has posted so far, then release the
+ * CQ slots with one head doorbell. Returns the number of entries reaped.
+ */
+static int cpcidev_cq_reap(struct cpcidev_queue *q, struct cpcidev_gemm_job *jobs, u32 count)
+{
+	u16 cid, status;
+	int reaped = 0;
 
-	switch (cmd)
+	while (cpcidev_cq_pop(q, &cid, &status))
+	{
+		if (cid < count)
+			jobs[cid].status = status;
+		reaped++;
+	}
+
+	if (reaped)
+		cpcidev_cq_ring(q);
+
+	return reaped;
+}
+
+static long cpcidev_gemm_batch(struct cpcidev_dev *cd, struct cpcidev_gemm_batch __user *ubatch)
+{
+	struct cpcidev_queue *q = &cd->batch_q;
+	struct cpcidev_gemm_batch batch;
+	struct cpcidev_gemm_job *jobs;
+	struct cpcidev_job_buf *bufs;
+	u32 submitted = 0, completed = 0;
+	unsigned long deadline;
+	long ret = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	if (batch.count == 0 || batch.count > CPCIDEV_MAX_BATCH)
+		return -EINVAL;
+	if (!q->sq)
+		return -ENODEV;
+
+	jobs = kvmalloc_array(batch.count, sizeof(*jobs), GFP_KERNEL);
+	bufs = kvcalloc(batch.count, sizeof(*bufs), GFP_KERNEL);
+	if (!jobs || !bufs)
 	{
+		ret = -ENOMEM;
+		goto out_free;
+	}
 
-	case IOCTL_SET_OP1_MATRIX:
-		printk(KERN_INFO "IOCTL_SET_OP1_MATRIX\n");
-		if (copy_from_user(kbuf, uarg, sizeof(kbuf)))
-			return -EFAULT;
+	if (copy_from_user(jobs, u64_to_user_ptr(batch.jobs), batch.count * sizeof(*jobs)))
+	{
+		ret = -EFAULT;
+		goto out_free;
+	}
+
+	/* Stage every operand pair in coherent memory the device can reach */
+	for (i = 0; i < batch.count; i++)
+	{
+		u32 n = jobs[i].n;
 
-		for (i = 0; i < 4; i++)
+		if (n == 0 || n > CPCIDEV_MAX_DIM)
 		{
-			for (j = 0; j < 4; j++)
-			{
-				iowrite32(kbuf[i][j],
-						  mmio + 0x10 + ((i * 4 + j) * sizeof(uint32_t)));
-			}
+			ret = -EINVAL;
+			goto out_bufs;
 		}
 
-		printk(KERN_INFO "OP1 matrix written\n");
-		break;
+		bufs[i].mat_bytes = (size_t)n * n * sizeof(u32);
+		bufs[i].cpu = dma_alloc_coherent(&cd->pdev->dev, 3 * bufs[i].mat_bytes, &bufs[i].dma, GFP_KERNEL);
+		if (!bufs[i].cpu)
+		{
+			ret = -ENOMEM;
+			goto out_bufs;
+		}
 
-	case IOCTL_SET_OP2_MATRIX:
-		printk(KERN_INFO "IOCTL_SET_OP2_MATRIX\n");
-		if (copy_from_user(kbuf, uarg, sizeof(kbuf)))
-			return -EFAULT;
+		if (copy_from_user(bufs[i].cpu, u64_to_user_ptr(jobs[i].a), bufs[i].mat_bytes) ||
+			copy_from_user(bufs[i].cpu + bufs[i].mat_bytes, u64_to_user_ptr(jobs[i].b), bufs[i].mat_bytes))
+		{
+			ret = -EFAULT;
+			goto out_bufs;
+		}
+		jobs[i].status = -1;
+	}
 
-		for (i = 0; i < 4; i++)
+	mutex_lock(&cd->batch_lock);
+	while (completed < batch.count)
+	{
+		u32 queued = 0;
+		int reaped;
+
+		while (submitted < batch.count && !cpcidev_sq_full(q))
 		{
-			for (j = 0; j < 4; j++)
+			struct cpcidev_job_buf *buf = &bufs[submitted];
+
+			cpcidev_sq_push(q, buf->dma, buf->dma + buf->mat_bytes, buf->dma + 2 * buf->mat_bytes,
+							jobs[submitted].n, submitted);
+			submitted++;
+			queued++;
+		}
+		if (queued)
+			cpcidev_sq_ring(q);
+
+		/* Completions land in host memory, so waiting costs no MMIO */
+		deadline = jiffies + msecs_to_jiffies(CPCIDEV_CQ_TIMEOUT_MS);
+		while ((reaped = cpcidev_cq_reap(q, jobs, batch.count)) == 0)
+		{
+			if (time_after(jiffies, deadline))
 			{
-				iowrite32(kbuf[i][j],
-						  mmio + 0x50 + ((i * 4 + j) * sizeof(uint32_t)));
+				dev_err(&cd->pdev->dev, "queue %u: completion timeout\n", q->qid);
+				ret = -ETIMEDOUT;
+				break;
 			}
+			usleep_range(20, 100);
 		}
+		if (ret)
+			break;
+		completed += reaped;
+	}
+	mutex_unlock(&cd->batch_lock);
 
-		printk(KERN_INFO "OP2 matrix written\n");
-		break;
+	if (ret)
+		goto out_bufs;
 
-	case IOCTL_SET_OPCODE:
-		printk(KERN_INFO "IOCTL_SET_OPCODE\n");
-		if (copy_from_user(&opcode, uarg, sizeof(opcode)))
-			return -EFAULT;
+	for (i = 0; i < batch.count; i++)
+	{
+		if (jobs[i].status == 0 &&
+			copy_to_user(u64_to_user_ptr(jobs[i].c), bufs[i].cpu + 2 * bufs[i].mat_bytes, bufs[i].mat_bytes))
+		{
+			ret = -EFAULT;
+			goto out_bufs;
+		}
+	}
 
-		iowrite32(opcode, mmio + 0x90);
-		printk(KERN_INFO "Opcode set to %u\n", opcode);
-		break;
+	batch.completed = completed;
+	if (copy_to_user(u64_to_user_ptr(batch.jobs), jobs, batch.count * sizeof(*jobs)) ||
+		copy_to_user(ubatch, &batch, sizeof(batch)))
+		ret = -EFAULT;
 
-	case IOCTL_GET_RESULT:
-		/*
-		 * Reading result triggers matrix multiplication in device
-		 * Result matrix starts at 0xA0
-		 */
-		printk(KERN_INFO "IOCTL_GET_RESULT\n");
-		for (i = 0; i < 4; i++)
+out_bufs:
+	/* A timed-out job may still be DMAing into its buffer, so leak it */
+	for (i = 0; i < batch.count && ret != -ETIMEDOUT; i++)
+	{
+		if (bufs[i].cpu)
+			dma_free_coherent(&cd->pdev->dev, 3 * bufs[i].mat_bytes, bufs[i].cpu, bufs[i].dma);
+	}
+out_free:
+	kvfree(bufs);
+	kvfree(jobs);
+	return ret;
+}
+
+/* True if an N x N matrix at off lies inside the mapping */
+static bool cpcidev_map_fits(struct cpcidev_file *cf, u64 off, size_t mat_bytes)
+{
+	return IS_ALIGNED(off, sizeof(u32)) && off <= cf->size && mat_bytes <= cf->size - off;
+}
+
+/*
+ * Run one job on operands the caller wrote into its mapping. The device
+ * fetches A and B and stores C by DMA, so the job costs the pointer,
+ * dimension and start writes plus the status polls.
+ */
+static long cpcidev_gemm_mapped(struct cpcidev_file *cf, struct cpcidev_gemm_mapped __user *ujob)
+{
+	struct cpcidev_dev *cd = cf->cd;
+	void __iomem *mmio = cd->mmio;
+	struct cpcidev_gemm_mapped job;
+	unsigned long deadline;
+	size_t mat_bytes;
+	long ret = 0;
+	u32 status;
+
+	if (copy_from_user(&job, ujob, sizeof(job)))
+		return -EFAULT;
+	if (job.n == 0 || job.n > CPCIDEV_MAX_DIM)
+		return -EINVAL;
+
+	mutex_lock(&cf->lock);
+	mat_bytes = (size_t)job.n * job.n * sizeof(u32);
+	if (!cf->cpu || cf->dma_busy)
+	{
+		ret = -ENXIO;
+		goto out_unlock;
+	}
+	if (!cpcidev_map_fits(cf, job.a_off, mat_bytes) ||
+		!cpcidev_map_fits(cf, job.b_off, mat_bytes) ||
+		!cpcidev_map_fits(cf, job.c_off, mat_bytes))
+	{
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	mutex_lock(&cd->reg_job_lock);
+	writeq(cf->dma + job.a_off, mmio + REG_MATRIX_A_PTR);
+	writeq(cf->dma + job.b_off, mmio + REG_MATRIX_B_PTR);
+	writeq(cf->dma + job.c_off, mmio + REG_MATRIX_C_PTR);
+	iowrite32(job.n, mmio + REG_DIM_N);
+	/* iowrite32 orders the caller's stores to the buffer before the start */
+	iowrite32(CTRL_START, mmio + REG_CONTROL);
+
+	deadline = jiffies + msecs_to_jiffies(CPCIDEV_CQ_TIMEOUT_MS);
+	while (!((status = ioread32(mmio + REG_STATUS)) & (STATUS_DONE | STATUS_ERROR)))
+	{
+		if (time_after(jiffies, deadline))
 		{
-			for (j = 0; j < 4; j++)
-			{
-				kbuf[i][j] =
-					ioread32(mmio + 0xA0 + ((i * 4 + j) * sizeof(uint32_t)));
-			}
+			dev_err(&cd->pdev->dev, "mapped job: completion timeout\n");
+			cf->dma_busy = true;
+			ret = -ETIMEDOUT;
+			break;
 		}
+		usleep_range(20, 100);
+	}
+	mutex_unlock(&cd->reg_job_lock);
+
+	if (ret)
+		goto out_unlock;
+
+	/* C is read by the caller straight from the mapping */
+	dma_rmb();
+	job.status = (status & STATUS_ERROR) ? 1 : 0;
+	if (copy_to_user(ujob, &job, sizeof(job)))
+		ret = -EFAULT;
+
+out_unlock:
+	mutex_unlock(&cf->lock);
+	return ret;
+}
+
+static void cpcidev_eventfd_signal(struct eventfd_ctx *ctx)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+	eventfd_signal(ctx);
+#else
+	eventfd_signal(ctx, 1);
+#endif
+}
+
+/* Free a job's staging buffer and slot; called without the queue's lock */
+static void cpcidev_async_put(struct cpcidev_async_job *job)
+{
+	struct cpcidev_hwq *hwq = job->hwq;
+
+	if (job->buf.cpu)
+		dma_free_coherent(&hwq->cd->pdev->dev, 3 * job->buf.mat_bytes, job->buf.cpu, job->buf.dma);
+	job->buf.cpu = NULL;
+	job->owner = NULL;
+
+	/* Orders the stores above before the slot can be claimed again */
+	clear_bit_unlock(job - hwq->jobs, hwq->slots);
+}
 
-		if (copy_to_user(uarg, kbuf, sizeof(kbuf)))
+/* Claim a free job slot without a lock; NULL if the queue has none */
+static struct cpcidev_async_job *cpcidev_slot_get(struct cpcidev_hwq *hwq)
+{
+	unsigned long slot;
+
+	do
+	{
+		slot = find_first_zero_bit(hwq->slots, CPCIDEV_ASYNC_SLOTS);
+		if (slot >= CPCIDEV_ASYNC_SLOTS)
+			return NULL;
+	} while (test_and_set_bit_lock(slot, hwq->slots));
+
+	return &hwq->jobs[slot];
+}
+
+/*
+ * Claim a slot on the calling CPU's hardware queue, or on the next one
+ * with room when that queue is full. The CPU may change under us; that
+ * only costs locality, not correctness.
+ */
+static struct cpcidev_async_job *cpcidev_job_get(struct cpcidev_dev *cd)
+{
+	unsigned int first = cd->cpu_hwq[raw_smp_processor_id()];
+	struct cpcidev_async_job *job;
+	unsigned int i;
+
+	for (i = 0; i < CPCIDEV_NR_HWQ; i++)
+	{
+		job = cpcidev_slot_get(&cd->hwq[(first + i) % CPCIDEV_NR_HWQ]);
+		if (job)
+			return job;
+	}
+	return NULL;
+}
+
+/*
+ * Queue one job on a hardware queue and set sub->id without waiting.
+ * Operands are staged in coherent memory, or with CPCIDEV_SUBMIT_MAPPED
+ * taken from the caller's mapping in place. With ioucmd the completion
+ * goes to io_uring rather than to read().
+ */
+static int cpcidev_async_queue(struct cpcidev_file *cf, struct cpcidev_gemm_submit *sub,
+							   struct io_uring_cmd *ioucmd)
+{
+	struct cpcidev_dev *cd = cf->cd;
+	struct cpcidev_job_buf buf = {0};
+	struct cpcidev_async_job *job;
+	struct cpcidev_hwq *hwq;
+	dma_addr_t a, b, c;
+	size_t mat_bytes;
+
+	if (sub->n == 0 || sub->n > CPCIDEV_MAX_DIM || (sub->flags & ~CPCIDEV_SUBMIT_MAPPED))
+		return -EINVAL;
+	if (!cd->cpu_hwq)
+		return -ENODEV;
+
+	mat_bytes = (size_t)sub->n * sub->n * sizeof(u32);
+	if (sub->flags & CPCIDEV_SUBMIT_MAPPED)
+	{
+		bool ok;
+
+		/* The mapping stays until release, which orphans our jobs first */
+		mutex_lock(&cf->lock);
+		ok = cf->cpu && !cf->dma_busy && cpcidev_map_fits(cf, sub->a, mat_bytes) &&
+			 cpcidev_map_fits(cf, sub->b, mat_bytes) && cpcidev_map_fits(cf, sub->c, mat_bytes);
+		a = cf->dma + sub->a;
+		b = cf->dma + sub->b;
+		c = cf->dma + sub->c;
+		mutex_unlock(&cf->lock);
+		if (!ok)
+			return -EINVAL;
+	}
+	else
+	{
+		buf.mat_bytes = mat_bytes;
+		buf.cpu = dma_alloc_coherent(&cd->pdev->dev, 3 * mat_bytes, &buf.dma, GFP_KERNEL);
+		if (!buf.cpu)
+			return -ENOMEM;
+		if (copy_from_user(buf.cpu, u64_to_user_ptr(sub->a), mat_bytes) ||
+			copy_from_user(buf.cpu + mat_bytes, u64_to_user_ptr(sub->b), mat_bytes))
+		{
+			dma_free_coherent(&cd->pdev->dev, 3 * mat_bytes, buf.cpu, buf.dma);
 			return -EFAULT;
+		}
+		a = buf.dma;
+		b = buf.dma + mat_bytes;
+		c = buf.dma + 2 * mat_bytes;
+	}
+
+	job = cpcidev_job_get(cd);
+	if (!job)
+	{
+		if (buf.cpu)
+			dma_free_coherent(&cd->pdev->dev, 3 * mat_bytes, buf.cpu, buf.dma);
+		return -EAGAIN;
+	}
+
+	/* The slot is ours: the reaper ignores it until its CQ entry arrives */
+	hwq = job->hwq;
+	job->owner = cf;
+	job->buf = buf;
+	job->ioucmd = ioucmd;
+	job->id = atomic64_inc_return(&cd->next_id);
+	job->c = sub->c;
+	job->status = -1;
+	INIT_LIST_HEAD(&job->node);
+	sub->id = job->id;
+
+	spin_lock(&hwq->sq_lock);
+	cpcidev_sq_push(&hwq->q, a, b, c, sub->n, job - hwq->jobs);
+	cpcidev_sq_ring(&hwq->q);
+	spin_unlock(&hwq->sq_lock);
+	return 0;
+}
+
+static long cpcidev_gemm_submit(struct cpcidev_file *cf, struct cpcidev_gemm_submit __user *usub)
+{
+	struct cpcidev_gemm_submit sub;
+	int ret;
+
+	if (copy_from_user(&sub, usub, sizeof(sub)))
+		return -EFAULT;
+
+	ret = cpcidev_async_queue(cf, &sub, NULL);
+	if (ret)
+		return ret;
+
+	/* The job runs either way; its completion still carries the ID */
+	if (put_user(sub.id, &usub->id))
+		return -EFAULT;
+	return 0;
+}
+
+#ifdef CPCIDEV_URING
+/* Completion status, kept in the command's pdu until task work runs */
+static s32 *cpcidev_uring_status(struct io_uring_cmd *ioucmd)
+{
+	return (s32 *)ioucmd->pdu;
+}
+
+/* Runs in the submitter's task with the issue_flags io_uring hands us */
+static void cpcidev_uring_finish(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 18, 0)
+	io_uring_cmd_done(ioucmd, *cpcidev_uring_status(ioucmd), issue_flags);
+#else
+	io_uring_cmd_done(ioucmd, *cpcidev_uring_status(ioucmd), 0, issue_flags);
+#endif
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 16, 0)
+static void cpcidev_uring_task_cb(struct io_uring_cmd *ioucmd, io_tw_token_t tw)
+{
+	cpcidev_uring_finish(ioucmd, IO_URING_CMD_TASK_WORK_ISSUE_FLAGS);
+}
+#else
+static void cpcidev_uring_task_cb(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	cpcidev_uring_finish(ioucmd, issue_flags);
+}
+#endif
+
+/*
+ * Complete a command from the bottom half. io_uring_cmd_done() must not
+ * run here: we hold no ring lock, so it is deferred to the submitter's
+ * task the way nvme does it.
+ */
+static void cpcidev_uring_done(struct io_uring_cmd *ioucmd, s32 status)
+{
+	*cpcidev_uring_status(ioucmd) = status;
+	io_uring_cmd_complete_in_task(ioucmd, cpcidev_uring_task_cb);
+}
+
+/*
+ * IORING_OP_URING_CMD on the device node. The SQE (IORING_SETUP_SQE128)
+ * carries a struct cpcidev_gemm_submit for a mapped job; its CQE holds
+ * the completion status in res. Only mapped jobs are accepted: the bottom half completes the command
+ * and cannot copy a staged result into the submitter's memory.
+ */
+static int dev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+	struct cpcidev_file *cf = ioucmd->file->private_data;
+	struct cpcidev_gemm_submit sub;
+	int ret;
+
+	if (ioucmd->cmd_op != CPCIDEV_URING_CMD_GEMM)
+		return -ENOTTY;
+	if (!(issue_flags & IO_URING_F_SQE128))
+		return -EINVAL;
+
+	/* The SQE stays writable by user space: read it once */
+	memcpy(&sub, io_uring_sqe_cmd(ioucmd->sqe), sizeof(sub));
+	if (!(sub.flags & CPCIDEV_SUBMIT_MAPPED))
+		return -EINVAL;
+
+	ret = cpcidev_enter(cf->cd);
+	if (ret)
+		return ret;
+	ret = cpcidev_async_queue(cf, &sub, ioucmd);
+	cpcidev_exit(cf->cd);
+	if (ret == -EAGAIN)
+		ret = -EBUSY; /* slots are freed by completions, not by a retry */
+	return ret ? ret : -EIOCBQUEUED;
+}
+#endif
+
+/*
+ * Hand a finished job to the file that submitted it, waking a reader only
+ * when its list goes from empty to non-empty. Orphans and io_uring
+ * commands go on unread instead. Called with hwq->lock held.
+ */
+static void cpcidev_job_done(struct cpcidev_async_job *job, s32 status, struct list_head *unread)
+{
+	struct cpcidev_file *cf = job->owner;
+
+	job->status = status;
+	if (!cf || job->ioucmd)
+	{
+		list_add_tail(&job->node, unread);
+		return;
+	}
+
+	spin_lock(&cf->done_lock);
+	if (list_empty(&cf->done))
+		wake_up_interruptible(&cf->wait);
+	list_add_tail(&job->node, &cf->done);
+	if (cf->eventfd)
+		cpcidev_eventfd_signal(cf->eventfd);
+	spin_unlock(&cf->done_lock);
+}
+
+/* Complete the io_uring commands and free the orphans on unread */
+static void cpcidev_job_put_list(struct list_head *unread)
+{
+	struct cpcidev_async_job *job, *tmp;
+
+	list_for_each_entry_safe(job, tmp, unread, node)
+	{
+		list_del_init(&job->node);
+#ifdef CPCIDEV_URING
+		if (job->ioucmd)
+			cpcidev_uring_done(job->ioucmd, job->status);
+		job->ioucmd = NULL;
+#endif
+		cpcidev_async_put(job);
+	}
+}
+
+/*
+ * Bottom half of a queue's completion interrupt: hand every completion
+ * the device posted to its submitter. The whole run costs one CQ doorbell.
+ */
+static void cpcidev_hwq_reap(struct cpcidev_hwq *hwq)
+{
+	LIST_HEAD(unread); /* orphaned jobs and io_uring commands */
+	u16 cid, status;
+	int reaped = 0;
+
+	spin_lock(&hwq->lock);
+	while (cpcidev_cq_pop(&hwq->q, &cid, &status))
+	{
+		reaped++;
+		if (cid >= CPCIDEV_ASYNC_SLOTS || !test_bit(cid, hwq->slots))
+			continue;
+		cpcidev_job_done(&hwq->jobs[cid], status, &unread);
+	}
+	if (reaped)
+		cpcidev_cq_ring(&hwq->q);
+	spin_unlock(&hwq->lock);
+
+	cpcidev_job_put_list(&unread);
+}
+
+/*
+ * Stop a queue for pci_remove(): take what the device already posted,
+ * then fail every job still in flight with ENODEV so its submitter gets
+ * a completion and its staging buffer is freed. Submitters and the
+ * interrupt are shut out by then.
+ */
+static void cpcidev_hwq_cancel(struct cpcidev_hwq *hwq)
+{
+	LIST_HEAD(unread);
+	unsigned long slot;
+
+	iowrite32(0, hwq->q.regs + QREG_SIZE);
+	cpcidev_hwq_reap(hwq);
+
+	spin_lock(&hwq->lock);
+	for_each_set_bit(slot, hwq->slots, CPCIDEV_ASYNC_SLOTS)
+	{
+		/* Completed jobs keep their slot until read() frees it */
+		if (hwq->jobs[slot].status == -1)
+			cpcidev_job_done(&hwq->jobs[slot], -ENODEV, &unread);
+	}
+	spin_unlock(&hwq->lock);
+
+	cpcidev_job_put_list(&unread);
+}
+
+/* Register an eventfd signalled once per completion; -1 removes it */
+static long cpcidev_set_eventfd(struct cpcidev_file *cf, __s32 __user *ufd)
+{
+	struct eventfd_ctx *ctx = NULL, *old;
+	__s32 fd;
+
+	if (get_user(fd, ufd))
+		return -EFAULT;
+	if (fd >= 0)
+	{
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+
+	spin_lock(&cf->done_lock);
+	old = cf->eventfd;
+	cf->eventfd = ctx;
+	spin_unlock(&cf->done_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+	return 0;
+}
+
+static bool cpcidev_done_pending(struct cpcidev_file *cf)
+{
+	bool pending;
+
+	spin_lock(&cf->done_lock);
+	pending = !list_empty(&cf->done);
+	spin_unlock(&cf->done_lock);
+	return pending;
+}
+
+static u64 cpcidev_perf_read(struct cpcidev_dev *cd, unsigned int offset)
+{
+	void __iomem *reg = cd->mmio + REG_PERF_BASE + offset;
+
+	return ioread32(reg) | ((u64)ioread32(reg + 4) << 32);
+}
+
+/* Latch the counter bank so the values read belong together */
+static long cpcidev_get_perf(struct cpcidev_dev *cd, struct cpcidev_perf __user *uperf)
+{
+	struct cpcidev_perf perf;
+	u32 ctrl = PERF_SNAPSHOT;
+
+	if (copy_from_user(&perf, uperf, sizeof(perf)))
+		return -EFAULT;
+	if (perf.clear)
+		ctrl |= PERF_CLEAR;
+
+	mutex_lock(&cd->perf_lock);
+	iowrite32(ctrl, cd->mmio + REG_PERF_BASE + PREG_CTRL);
+	perf.elapsed_ns = cpcidev_perf_read(cd, PREG_ELAPSED);
+	perf.jobs = cpcidev_perf_read(cd, PREG_JOBS);
+	perf.dma_in_bytes = cpcidev_perf_read(cd, PREG_DMA_IN_BYTES);
+	perf.dma_out_bytes = cpcidev_perf_read(cd, PREG_DMA_OUT_BYTES);
+	perf.dma_stall_ns = cpcidev_perf_read(cd, PREG_DMA_STALL);
+	perf.busy_ns = cpcidev_perf_read(cd, PREG_BUSY);
+	perf.idle_ns = cpcidev_perf_read(cd, PREG_IDLE);
+	perf.interrupts = cpcidev_perf_read(cd, PREG_INTERRUPTS);
+	perf.errors = cpcidev_perf_read(cd, PREG_ERRORS);
+	mutex_unlock(&cd->perf_lock);
+
+	if (copy_to_user(uperf, &perf, sizeof(perf)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+	Following function is calling in our case since in the user-space is calling the ioctl funtion, not read/write funtions
+*/
 
-		printk(KERN_INFO "Result matrix read\n");
+static long dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct cpcidev_file *cf = file->private_data;
+	void __user *uarg = (void __user *)arg;
+	long ret;
+
+	ret = cpcidev_enter(cf->cd);
+	if (ret)
+		return ret;
+
+	switch (cmd)
+	{
+	case IOCTL_GEMM_BATCH:
+		ret = cpcidev_gemm_batch(cf->cd, uarg);
+		break;
+
+	case IOCTL_GET_PERF:
+		ret = cpcidev_get_perf(cf->cd, uarg);
+		break;
+
+	case IOCTL_GEMM_MAPPED:
+		ret = cpcidev_gemm_mapped(cf, uarg);
+		break;
+
+	case IOCTL_GEMM_SUBMIT:
+		ret = cpcidev_gemm_submit(cf, uarg);
+		break;
+
+	case IOCTL_SET_EVENTFD:
+		ret = cpcidev_set_eventfd(cf, uarg);
 		break;
 
 	default:
-		return -EINVAL;
+		ret = -EINVAL;
+		break;
 	}
 
+	cpcidev_exit(cf->cd);
+	return ret;
+}
+
+static int dev_open(struct inode *inode, struct file *filp)
+{
+	struct cpcidev_file *cf = kzalloc(sizeof(*cf), GFP_KERNEL);
+
+	if (!cf)
+		return -ENOMEM;
+
+	mutex_lock(&cpcidev_open_lock);
+	cf->cd = cpcidev;
+	if (cf->cd)
+		kref_get(&cf->cd->ref);
+	mutex_unlock(&cpcidev_open_lock);
+	if (!cf->cd)
+	{
+		kfree(cf);
+		return -ENODEV;
+	}
+
+	mutex_init(&cf->lock);
+	spin_lock_init(&cf->done_lock);
+	INIT_LIST_HEAD(&cf->done);
+	init_waitqueue_head(&cf->wait);
+	filp->private_data = cf;
 	return 0;
 }
 
-//Not using this function from the use-space
-static ssize_t read(struct file *filp, char __user *buf, size_t len, loff_t *off)
+/* Runs after the last munmap, since a mapping holds a file reference */
+static int dev_release(struct inode *inode, struct file *filp)
 {
-	//not using this 
+	struct cpcidev_file *cf = filp->private_data;
+	struct cpcidev_dev *cd = cf->cd;
+	struct cpcidev_async_job *job, *tmp;
+	struct cpcidev_hwq *hwq;
+	LIST_HEAD(unread);
+	unsigned long slot;
+	unsigned int i;
+
+	/* Jobs still running are freed by the bottom half when they complete */
+	for (i = 0; i < CPCIDEV_NR_HWQ; i++)
+	{
+		hwq = &cd->hwq[i];
+		spin_lock(&hwq->lock);
+		for_each_set_bit(slot, hwq->slots, CPCIDEV_ASYNC_SLOTS)
+		{
+			job = &hwq->jobs[slot];
+			if (job->owner != cf)
+				continue;
+			job->owner = NULL;
+			if (list_empty(&job->node))
+				cf->dma_busy = true;
+		}
+		spin_unlock(&hwq->lock);
+	}
+
+	/* No reaper adds to done any more */
+	spin_lock(&cf->done_lock);
+	list_splice_init(&cf->done, &unread);
+	spin_unlock(&cf->done_lock);
+
+	list_for_each_entry_safe(job, tmp, &unread, node)
+	{
+		list_del_init(&job->node);
+		cpcidev_async_put(job);
+	}
+	if (cf->eventfd)
+		eventfd_ctx_put(cf->eventfd);
+
+	/* A timed-out or running job may still be DMAing into the buffer, so leak it */
+	if (cf->cpu && !cf->dma_busy)
+		dma_free_coherent(&cd->pdev->dev, cf->size, cf->cpu, cf->dma);
+	kfree(cf);
+	kref_put(&cd->ref, cpcidev_dev_release);
 	return 0;
 }
 
+/*
+ * Map a coherent DMA buffer into the caller. The first mmap() of an open
+ * file allocates it with the mapping's size; later ones must match it.
+ */
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct cpcidev_file *cf = filp->private_data;
+	size_t size = vma->vm_end - vma->vm_start;
+	int ret;
+
+	if (vma->vm_pgoff != 0)
+		return -EINVAL;
+
+	mutex_lock(&cf->lock);
+	if (!cf->cpu)
+	{
+		cf->cpu = dma_alloc_coherent(&cf->cd->pdev->dev, size, &cf->dma, GFP_KERNEL);
+		if (!cf->cpu)
+		{
+			ret = -ENOMEM;
+			goto out_unlock;
+		}
+		cf->size = size;
+	}
+	else if (size != cf->size)
+	{
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	ret = dma_mmap_coherent(&cf->cd->pdev->dev, vma, cf->cpu, cf->dma, cf->size);
+
+out_unlock:
+	mutex_unlock(&cf->lock);
+	return ret;
+}
+
+/*
+ * Return completion records of asynchronous jobs, as many as fit in len.
+ * A staged job's result is copied to its C pointer first. Blocks until one
+ * is available unless the file is O_NONBLOCK.
+ */
+static ssize_t read(struct file *filp, char __user *buf, size_t len, loff_t *off)
+{
+	struct cpcidev_file *cf = filp->private_data;
+	struct cpcidev_completion comp;
+	struct cpcidev_async_job *job;
+	size_t done = 0;
+	int ret;
+
+	if (len < sizeof(comp))
+		return -EINVAL;
+	if (!(filp->f_flags & O_NONBLOCK))
+	{
+		ret = wait_event_interruptible(cf->wait, cpcidev_done_pending(cf));
+		if (ret)
+			return ret;
+	}
+
+	while (done + sizeof(comp) <= len)
+	{
+		spin_lock(&cf->done_lock);
+		job = list_first_entry_or_null(&cf->done, struct cpcidev_async_job, node);
+		if (job)
+			list_del_init(&job->node);
+		spin_unlock(&cf->done_lock);
+		if (!job)
+			break;
+
+		comp.id = job->id;
+		comp.status = job->status;
+		comp.rsvd = 0;
+		if (job->status == 0 && job->buf.cpu &&
+			copy_to_user(u64_to_user_ptr(job->c), job->buf.cpu + 2 * job->buf.mat_bytes, job->buf.mat_bytes))
+			comp.status = -EFAULT;
+		cpcidev_async_put(job);
+
+		if (copy_to_user(buf + done, &comp, sizeof(comp)))
+			return done ? done : -EFAULT;
+		done += sizeof(comp);
+	}
+
+	return done ? done : -EAGAIN;
+}
+
+static __poll_t dev_poll(struct file *filp, poll_table *wait)
+{
+	struct cpcidev_file *cf = filp->private_data;
+
+	poll_wait(filp, &cf->wait, wait);
+	return cpcidev_done_pending(cf) ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
 //Not using this function from the use-space
 static ssize_t write(struct file *filp, const char __user *buf, size_t len, loff_t *off)
 {
@@ -192,65 +1252,276 @@ static loff_t llseek(struct file *filp, loff_t off, int whence)
  * We use the fact that every IO is aligned to 4 bytes. Misaligned reads means EOF. */
 static struct file_operations fops = {
 	.owner = THIS_MODULE,
+	.open = dev_open,
+	.release = dev_release,
+	.mmap = dev_mmap,
+	.poll = dev_poll,
+#ifdef CPCIDEV_URING
+	.uring_cmd = dev_uring_cmd,
+#endif
 	.llseek = llseek,
-	.read = read,				 // it will be called when the user-space called read(fd, buf, count) [not using at this point of time]
+	.read = read,				 // it will be called when the user-space called read(fd, buf, count) to collect completions
 	.unlocked_ioctl = dev_ioctl, // it will be called when the user-space called the ioctl(fd, cmd, arg) funtion
 	.write = write,				 // it will be called when the user-space called write(fd, buf, count) [not using at this point of time]
 };
 
-static irqreturn_t irq_handler(int irq, void *dev)
+/* Threaded half of a queue vector: complete what that CQ holds */
+static irqreturn_t cpcidev_hwq_irq_thread(int irq, void *data)
+{
+	cpcidev_hwq_reap(data);
+	return IRQ_HANDLED;
+}
+
+/* Threaded half of the INTx line, which all queues share */
+static irqreturn_t cpcidev_intx_irq_thread(int irq, void *data)
+{
+	struct cpcidev_dev *cd = data;
+	unsigned int i;
+
+	for (i = 0; i < CPCIDEV_NR_HWQ; i++)
+		cpcidev_hwq_reap(&cd->hwq[i]);
+	return IRQ_HANDLED;
+}
+
+static void cpcidev_misc_events(struct cpcidev_dev *cd, u32 irq_status)
+{
+	if (irq_status & INT_ERROR)
+		dev_err_ratelimited(&cd->pdev->dev, "device reported an error\n");
+}
+
+/* MSI-X misc vector: register-interface completion and errors */
+static irqreturn_t cpcidev_misc_irq(int irq, void *data)
+{
+	struct cpcidev_dev *cd = data;
+	u32 irq_status = ioread32(cd->mmio + REG_INT_STATUS) & (INT_DONE | INT_ERROR);
+
+	iowrite32(irq_status, cd->mmio + REG_INT_STATUS);
+	cpcidev_misc_events(cd, irq_status);
+	return IRQ_HANDLED;
+}
+
+/* Legacy INTx fallback: one shared level-triggered line for everything */
+static irqreturn_t cpcidev_intx_irq(int irq, void *data)
 {
-	int devi;
-	irqreturn_t ret;
+	struct cpcidev_dev *cd = data;
 	u32 irq_status;
 
-	devi = *(int *)dev;
-	if (devi == major)
+	/* The line is shared: nothing pending means another device raised it */
+	irq_status = ioread32(cd->mmio + REG_INT_STATUS);
+	if (!irq_status)
+		return IRQ_NONE;
+
+	/* Must do this ACK, or else the interrupts just keeps firing. */
+	iowrite32(irq_status, cd->mmio + REG_INT_STATUS);
+	cpcidev_misc_events(cd, irq_status);
+
+	return (irq_status & INT_CQ) ? IRQ_WAKE_THREAD : IRQ_HANDLED;
+}
+
+/*
+ * Point every CPU at a hardware queue. Round robin by default; with MSI-X
+ * a CPU submits to the queue whose vector is affine to it, so its
+ * completions are reaped on the same CPU.
+ */
+static void cpcidev_map_cpus(struct cpcidev_dev *cd)
+{
+	const struct cpumask *mask;
+	unsigned int cpu, i;
+
+	for_each_possible_cpu(cpu)
+		cd->cpu_hwq[cpu] = cpu % CPCIDEV_NR_HWQ;
+
+	if (!cd->use_msix)
+		return;
+	for (i = 0; i < CPCIDEV_NR_HWQ; i++)
 	{
-		irq_status = ioread32(mmio + IO_IRQ_STATUS);
-		pr_info("interrupt irq = %d dev = %d irq_status = %llx\n",
-				irq, devi, (unsigned long long)irq_status);
-		/* Must do this ACK, or else the interrupts just keeps firing. */
-		iowrite32(irq_status, mmio + IO_IRQ_ACK);
-		ret = IRQ_HANDLED;
+		mask = pci_irq_get_affinity(cd->pdev, cd->hwq[i].q.qid);
+		if (!mask)
+			continue;
+		for_each_cpu(cpu, mask)
+			cd->cpu_hwq[cpu] = i;
 	}
-	else
+}
+
+static void cpcidev_free_hwq_irqs(struct cpcidev_dev *cd, unsigned int count)
+{
+	while (count--)
+		free_irq(pci_irq_vector(cd->pdev, cd->hwq[count].q.qid), &cd->hwq[count]);
+}
+
+/*
+ * Prefer MSI-X with the device's full table: the hardware queues' vectors
+ * spread over the CPUs by the affinity code, the batch queue and misc
+ * vectors left out of the spreading. The batch queue is polled, so its
+ * vector stays masked. The endpoint model does not see the capability's
+ * enable bit, so it is mirrored into REG_MSIX_CTRL. Without MSI-X, fall
+ * back to INTx.
+ */
+static int cpcidev_setup_irqs(struct cpcidev_dev *cd)
+{
+	struct irq_affinity affd = {
+		.pre_vectors = CPCIDEV_FIRST_HWQ,
+		.post_vectors = 1,
+	};
+	struct pci_dev *dev = cd->pdev;
+	struct cpcidev_hwq *hwq;
+	unsigned int i;
+	int ret;
+
+	ret = pci_alloc_irq_vectors_affinity(dev, CPCIDEV_MSIX_VECTORS, CPCIDEV_MSIX_VECTORS,
+										 PCI_IRQ_MSIX | PCI_IRQ_AFFINITY, &affd);
+	if (ret == CPCIDEV_MSIX_VECTORS)
 	{
-		ret = IRQ_NONE;
+		cd->use_msix = true;
+		for (i = 0; i < CPCIDEV_NR_HWQ; i++)
+		{
+			hwq = &cd->hwq[i];
+			snprintf(hwq->irq_name, sizeof(hwq->irq_name), "cpcidev-q%u", hwq->q.qid);
+			ret = request_threaded_irq(pci_irq_vector(dev, hwq->q.qid), NULL, cpcidev_hwq_irq_thread,
+									   IRQF_ONESHOT, hwq->irq_name, hwq);
+			if (ret)
+			{
+				cpcidev_free_hwq_irqs(cd, i);
+				goto error_vectors;
+			}
+		}
+
+		ret = request_irq(pci_irq_vector(dev, CPCIDEV_VEC_MISC), cpcidev_misc_irq, 0, "cpcidev-misc", cd);
+		if (ret)
+		{
+			cpcidev_free_hwq_irqs(cd, CPCIDEV_NR_HWQ);
+			goto error_vectors;
+		}
+
+		iowrite32(MSIX_CTRL_ENABLE, cd->mmio + REG_MSIX_CTRL);
+		dev_info(&dev->dev, "MSI-X, %d vectors\n", CPCIDEV_MSIX_VECTORS);
+		return 0;
 	}
+
+	ret = pci_alloc_irq_vectors(dev, 1, 1, PCI_IRQ_INTX);
+	if (ret < 0)
+		return ret;
+
+	cd->use_msix = false;
+	ret = request_threaded_irq(pci_irq_vector(dev, 0), cpcidev_intx_irq, cpcidev_intx_irq_thread,
+							   IRQF_SHARED, "cpcidev-intx", cd);
+	if (ret)
+		goto error_vectors;
+
+	/* Completions of asynchronous jobs are reaped from the interrupt */
+	iowrite32(INT_CQ | INT_ERROR, cd->mmio + REG_INT_ENABLE);
+	dev_info(&dev->dev, "legacy INTx, irq %d\n", pci_irq_vector(dev, 0));
+	return 0;
+
+error_vectors:
+	pci_free_irq_vectors(dev);
 	return ret;
 }
 
+static void cpcidev_free_irqs(struct cpcidev_dev *cd)
+{
+	struct pci_dev *dev = cd->pdev;
+
+	iowrite32(0, cd->mmio + REG_INT_ENABLE);
+	iowrite32(0, cd->mmio + REG_MSIX_CTRL);
+
+	if (cd->use_msix)
+	{
+		free_irq(pci_irq_vector(dev, CPCIDEV_VEC_MISC), cd);
+		cpcidev_free_hwq_irqs(cd, CPCIDEV_NR_HWQ);
+	}
+	else
+	{
+		free_irq(pci_irq_vector(dev, 0), cd);
+	}
+	pci_free_irq_vectors(dev);
+}
+
+/* Set up the hardware queue contexts and the CPU to queue map */
+static int cpcidev_hwq_init(struct cpcidev_dev *cd)
+{
+	struct cpcidev_hwq *hwq;
+	unsigned int i, j;
+	int ret;
+
+	for (i = 0; i < CPCIDEV_NR_HWQ; i++)
+	{
+		hwq = &cd->hwq[i];
+		hwq->cd = cd;
+		spin_lock_init(&hwq->sq_lock);
+		spin_lock_init(&hwq->lock);
+		for (j = 0; j < CPCIDEV_ASYNC_SLOTS; j++)
+		{
+			hwq->jobs[j].hwq = hwq;
+			INIT_LIST_HEAD(&hwq->jobs[j].node);
+		}
+		ret = cpcidev_queue_init(cd, &hwq->q, CPCIDEV_FIRST_HWQ + i, CPCIDEV_QUEUE_DEPTH);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void cpcidev_hwq_free(struct cpcidev_dev *cd)
+{
+	unsigned int i;
+
+	for (i = 0; i < CPCIDEV_NR_HWQ; i++)
+		cpcidev_queue_free(cd, &cd->hwq[i].q);
+}
+
 /**
  * Called just after insmod if the hardware device is connected,
  * not called otherwise.
  *
  * 0: all good
- * 1: failed
+ * negative errno: failed, everything set up so far is undone
  */
 static int pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
 {
+	struct cpcidev_dev *cd;
 	u8 val;
 	int ret;
 
 	pr_info("pci_probe\n");
 
+	cd = kvzalloc(sizeof(*cd), GFP_KERNEL);
+	if (!cd)
+	{
+		ret = -ENOMEM;
+		goto error;
+	}
+	kref_init(&cd->ref);
+	init_rwsem(&cd->remove_sem);
+	cd->pdev = pci_dev_get(dev);
+	mutex_init(&cd->batch_lock);
+	mutex_init(&cd->perf_lock);
+	mutex_init(&cd->reg_job_lock);
+	pci_set_drvdata(dev, cd);
+
 	/* Allocate device number dynamically */
 	ret = alloc_chrdev_region(&dev_num, 0, 1, CDEV_NAME);
 	if (ret < 0)
 	{
 		dev_err(&(dev->dev), "alloc_chrdev_region failed\n");
-		goto error;
+		goto error_chrdev;
 	}
 	major = MAJOR(dev_num);
 
-	/* Initialize and add character device */
-	cdev_init(&cpcidev_cdev, &fops);
-	cpcidev_cdev.owner = THIS_MODULE;
-	ret = cdev_add(&cpcidev_cdev, dev_num, 1);
+	/* Allocate and add character device; it lives until its last open file closes */
+	cd->cdev = cdev_alloc();
+	if (!cd->cdev)
+	{
+		ret = -ENOMEM;
+		goto error_cdev_add;
+	}
+	cd->cdev->ops = &fops;
+	cd->cdev->owner = THIS_MODULE;
+	ret = cdev_add(cd->cdev, dev_num, 1);
 	if (ret < 0)
 	{
 		dev_err(&(dev->dev), "cdev_add failed\n");
+		kobject_put(&cd->cdev->kobj); /* never added, so no cdev_del */
 		goto error_cdev_add;
 	}
 
@@ -278,30 +1549,63 @@ static int pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
 		goto error_device;
 	}
 
-	pdev = dev;
-
-	if (pci_enable_device(dev) < 0)
+	ret = pci_enable_device(dev);
+	if (ret < 0)
 	{
-		dev_err(&(pdev->dev), "pci_enable_device\n");
+		dev_err(&(dev->dev), "pci_enable_device\n");
 		goto error_pci;
 	}
 
-	if (pci_request_region(dev, BAR, "myregion0"))
+	ret = pci_request_region(dev, BAR, "myregion0");
+	if (ret)
 	{
-		dev_err(&(pdev->dev), "pci_request_region\n");
-		goto error_pci;
+		dev_err(&(dev->dev), "pci_request_region\n");
+		goto error_enable;
+	}
+	cd->mmio = pci_iomap(dev, BAR, pci_resource_len(dev, BAR));
+	if (!cd->mmio)
+	{
+		dev_err(&(dev->dev), "pci_iomap\n");
+		ret = -ENOMEM;
+		goto error_region;
+	}
+	/* Drop queues and interrupt state left behind by a previous binding */
+	iowrite32(CTRL_RESET, cd->mmio + REG_CONTROL);
+
+	/* The device fetches descriptors and operands by DMA */
+	pci_set_master(dev);
+	ret = dma_set_mask_and_coherent(&dev->dev, DMA_BIT_MASK(64));
+	if (ret)
+	{
+		dev_err(&(dev->dev), "dma_set_mask_and_coherent\n");
+		goto error_iomap;
+	}
+
+	ret = cpcidev_queue_init(cd, &cd->batch_q, CPCIDEV_BATCH_QID, CPCIDEV_QUEUE_DEPTH);
+	if (!ret)
+		ret = cpcidev_hwq_init(cd);
+	if (ret)
+	{
+		dev_err(&(dev->dev), "cpcidev_queue_init\n");
+		goto error_queues;
 	}
-	mmio = pci_iomap(pdev, BAR, pci_resource_len(pdev, BAR));
 
 	/* IRQ setup. */
-	pci_read_config_byte(dev, PCI_INTERRUPT_LINE, &val);
-	pci_irq = val;
+	ret = cpcidev_setup_irqs(cd);
+	if (ret)
+	{
+		dev_err(&(dev->dev), "cpcidev_setup_irqs\n");
+		goto error_queues;
+	}
 
-	if (request_irq(pci_irq, irq_handler, IRQF_SHARED, "pci_irq_handler0", &major) < 0)
+	/* Asynchronous submission fails with ENODEV until this is set */
+	cd->cpu_hwq = kcalloc(nr_cpu_ids, sizeof(*cd->cpu_hwq), GFP_KERNEL);
+	if (!cd->cpu_hwq)
 	{
-		dev_err(&(dev->dev), "request_irq\n");
-		goto error_pci;
+		ret = -ENOMEM;
+		goto error_irqs;
 	}
+	cpcidev_map_cpus(cd);
 
 	/* Optional sanity checks. The PCI is ready now, all of this could also be called from fops. */
 	{
@@ -317,27 +1621,21 @@ static int pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
 		if ((pci_resource_flags(dev, BAR) & IORESOURCE_MEM) != IORESOURCE_MEM)
 		{
 			dev_err(&(dev->dev), "pci_resource_flags\n");
-			goto error_pci;
+			ret = -ENODEV;
+			goto error_irqs;
 		}
 
 		/* 1Mb, as defined by the "1 << 20" in QEMU's memory_region_init_io. Same as pci_resource_len. */
-		resource_size_t start = pci_resource_start(pdev, BAR);
-		resource_size_t end = pci_resource_end(pdev, BAR);
+		resource_size_t start = pci_resource_start(dev, BAR);
+		resource_size_t end = pci_resource_end(dev, BAR);
 		pr_info("length %llx\n", (unsigned long long)(end + 1 - start));
 
 		/* The PCI standardized 64 bytes of the configuration space, see LDD3. */
 		for (i = 0; i < 64u; ++i)
 		{
-			pci_read_config_byte(pdev, i, &val);
+			pci_read_config_byte(dev, i, &val);
 			pr_info("config %x %x\n", i, val);
 		}
-		pr_info("irq %x\n", pci_irq);
-
-		// /* Initial value of the IO memory. */
-		// for (i = 0; i < 0x28; i += 4)
-		// {
-			iowrite32(0xAB, mmio);
-		// }
 
 		// /* Read again values of the IO memory. */
 		// for (i = 0; i < 0x28; i += 4)
@@ -345,35 +1643,75 @@ static int pci_probe(struct pci_dev *dev, const struct pci_device_id *id)
 		// 	pr_info("io %x %x\n", i, ioread32((void *)(mmio + i)));
 		// }
 	}
+	/* Let open() find the device */
+	mutex_lock(&cpcidev_open_lock);
+	cpcidev = cd;
+	mutex_unlock(&cpcidev_open_lock);
+
 	printk(KERN_INFO "CPCIDEV: /dev/%s created automatically (major=%d, minor=%d)\n",
 		   CDEV_NAME, MAJOR(dev_num), MINOR(dev_num));
 	printk(KERN_INFO "pci_probe() returns\n");
 	return 0;
 
+error_irqs:
+	cpcidev_free_irqs(cd);
+error_queues:
+	cpcidev_hwq_free(cd);
+	cpcidev_queue_free(cd, &cd->batch_q);
+error_iomap:
+	pci_iounmap(dev, cd->mmio);
+error_region:
+	pci_release_region(dev, BAR);
+error_enable:
+	pci_disable_device(dev);
 error_pci:
 	device_destroy(cpcidev_class, dev_num);
 error_device:
 	class_destroy(cpcidev_class);
 error_class:
-	cdev_del(&cpcidev_cdev);
+	cdev_del(cd->cdev);
 error_cdev_add:
 	unregister_chrdev_region(dev_num, 1);
+error_chrdev:
+	kref_put(&cd->ref, cpcidev_dev_release);
 error:
-	return 1;
+	return ret;
 }
 
 static void pci_remove(struct pci_dev *dev)
 {
+	struct cpcidev_dev *cd = pci_get_drvdata(dev);
+
+	unsigned int i;
+
 	pr_info("pci_remove\n");
-	free_irq(pci_irq, &major);
-	pci_iounmap(pdev, mmio);
+
+	/* No new opens; files already open keep cd, but not the device */
+	mutex_lock(&cpcidev_open_lock);
+	cpcidev = NULL;
+	mutex_unlock(&cpcidev_open_lock);
+
+	/* Waits for ioctls and submissions in progress */
+	down_write(&cd->remove_sem);
+	cd->removed = true;
+	up_write(&cd->remove_sem);
+
+	/* Jobs still in flight complete with ENODEV before their rings go */
+	cpcidev_free_irqs(cd);
+	for (i = 0; i < CPCIDEV_NR_HWQ; i++)
+		cpcidev_hwq_cancel(&cd->hwq[i]);
+	cpcidev_hwq_free(cd);
+	cpcidev_queue_free(cd, &cd->batch_q);
+	pci_iounmap(dev, cd->mmio);
 	pci_release_region(dev, BAR);
+	pci_disable_device(dev);
 
 	/* Destroy device and class - this removes /dev/cpcidev_pci */
 	device_destroy(cpcidev_class, dev_num);
 	class_destroy(cpcidev_class);
-	cdev_del(&cpcidev_cdev);
+	cdev_del(cd->cdev);
 	unregister_chrdev_region(dev_num, 1);
+	kref_put(&cd->ref, cpcidev_dev_release);
 
 	pr_info("CPCIDEV: /dev/%s removed\n", CDEV_NAME);
 }
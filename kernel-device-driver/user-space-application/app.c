@@ -1,42 +1,124 @@
 /*
  * Minimal userspace application for CPCIDEV
- * Demonstrates 4x4 matrix multiplication
+ * Demonstrates a 4x4 matrix multiplication on operands written in place
+ * into the mmap'd device buffer (IOCTL_GEMM_MAPPED) and a batched float
+ * GEMM submitted through the device queue (IOCTL_GEMM_BATCH), then keeps
+ * many asynchronous jobs in flight from one thread (IOCTL_GEMM_SUBMIT),
+ * and with -DCPCIDEV_URING through io_uring passthrough
  */
 
 #include <stdio.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
 
-// #define IOCTL_SET_OP1_MATRIX 0x01
-// #define IOCTL_SET_OP2_MATRIX 0x02
-// #define IOCTL_GET_RESULT 0x03
-// #define IOCTL_SET_OPCODE 0x04
+#include "cpcidev.h"
 
-#define CPCIDEV_MAGIC 'c'
+#define MAP_BYTES 4096
 
-#define IOCTL_SET_OP1_MATRIX _IOW(CPCIDEV_MAGIC, 1, uint32_t[4][4])
-#define IOCTL_SET_OP2_MATRIX _IOW(CPCIDEV_MAGIC, 2, uint32_t[4][4])
-#define IOCTL_GET_RESULT _IOR(CPCIDEV_MAGIC, 3, uint32_t[4][4])
-#define IOCTL_SET_OPCODE _IOW(CPCIDEV_MAGIC, 4, uint32_t)
+#define ASYNC_JOBS 256
+#define ASYNC_DIM 16
+#define URING_DEPTH 128
 
-int main(void)
+#define BATCH_JOBS 4
+#define BATCH_DIM 64
+
+/* Submit BATCH_JOBS N x N float multiplications with a single ioctl */
+static int run_batch(int fd)
 {
-    int fd;
-    int ret;
-    printf("[APP]: IOCTL_SET_OP1_MATRIX = 0x%x\n", IOCTL_SET_OP1_MATRIX);
-    printf("[APP]: IOCTL_SET_OP2_MATRIX = 0x%x\n", IOCTL_SET_OP2_MATRIX);
-    printf("[APP]: IOCTL_GET_RESULT     = 0x%x\n", IOCTL_GET_RESULT);
-    printf("[APP]: IOCTL_SET_OPCODE     = 0x%x\n", IOCTL_SET_OPCODE);
+    struct cpcidev_gemm_job jobs[BATCH_JOBS];
+    struct cpcidev_gemm_batch batch;
+    size_t elems = (size_t)BATCH_DIM * BATCH_DIM;
+    float *mem = malloc(3 * elems * BATCH_JOBS * sizeof(float));
+    int errors = 0;
+
+    if (!mem)
+    {
+        perror("[APP]: malloc");
+        return -1;
+    }
+
+    for (int j = 0; j < BATCH_JOBS; j++)
+    {
+        float *a = mem + (3 * j + 0) * elems;
+        float *b = mem + (3 * j + 1) * elems;
+        float *c = mem + (3 * j + 2) * elems;
+
+        for (size_t i = 0; i < elems; i++)
+        {
+            a[i] = (float)((i + j) % 7);
+            b[i] = (float)((i * 3 + j) % 5);
+            c[i] = 0.0f;
+        }
+
+        jobs[j].a = (uintptr_t)a;
+        jobs[j].b = (uintptr_t)b;
+        jobs[j].c = (uintptr_t)c;
+        jobs[j].n = BATCH_DIM;
+        jobs[j].status = -1;
+    }
+
+    batch.jobs = (uintptr_t)jobs;
+    batch.count = BATCH_JOBS;
+    batch.completed = 0;
+
+    if (ioctl(fd, IOCTL_GEMM_BATCH, &batch) < 0)
+    {
+        perror("[APP]: IOCTL_GEMM_BATCH failed");
+        free(mem);
+        return -1;
+    }
+    printf("[APP]: Batch completed %u/%u jobs\n", batch.completed, batch.count);
+
+    for (int j = 0; j < BATCH_JOBS; j++)
+    {
+        const float *a = mem + (3 * j + 0) * elems;
+        const float *b = mem + (3 * j + 1) * elems;
+        const float *c = mem + (3 * j + 2) * elems;
+
+        if (jobs[j].status != 0)
+        {
+            printf("[APP]: Job %d failed with status %d\n", j, jobs[j].status);
+            errors++;
+            continue;
+        }
+
+        for (int r = 0; r < BATCH_DIM; r++)
+        {
+            for (int col = 0; col < BATCH_DIM; col++)
+            {
+                float ref = 0.0f;
+                for (int k = 0; k < BATCH_DIM; k++)
+                    ref += a[r * BATCH_DIM + k] * b[k * BATCH_DIM + col];
+                if (fabsf(ref - c[r * BATCH_DIM + col]) > 1e-3f * fabsf(ref) + 1e-3f)
+                    errors++;
+            }
+        }
+    }
+
+    printf("[APP]: Batch check: %s\n", errors ? "MISMATCH" : "OK");
+    free(mem);
+    return errors ? -1 : 0;
+}
 
-    uint32_t A[4][4] = {
+/*
+ * 4x4 multiplication without copies: A and B are written straight into
+ * the coherent buffer the driver maps, and C is read back from it
+ */
+static int run_mapped(int fd)
+{
+    static const float A[4][4] = {
         {122, 2, 3, 4},
         {57, 6, 7, 82},
         {9, 171, 252, 37},
         {4, 52, 6, 7}};
 
-    uint32_t B[4][4] = {
+    static const float B[4][4] = {
         {1, 100, 0, 0},
         {100, 1, 0, 0},
         {0, 20, 1, 0},
@@ -44,81 +126,228 @@ int main(void)
 
     /*
     RESULT MUST BE...
-        uint32_t C[4][4] = {
+        float C[4][4] = {
     {  322, 12262,   3,  1204},
     {  657,  5846,   7, 24682},
     {17109,  6111, 252, 11137},
     { 5204,   572,   6,  2107}
 };
+    */
 
+    struct cpcidev_gemm_mapped job;
+    float (*buf)[4][4];
 
-    */
+    buf = mmap(NULL, MAP_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (buf == MAP_FAILED)
+    {
+        perror("[APP]: mmap failed");
+        return -1;
+    }
 
-    uint32_t C[4][4] = {0};
-    uint32_t opcode = 1; // matrix multiplication
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            buf[0][i][j] = A[i][j];
+            buf[1][i][j] = B[i][j];
+            buf[2][i][j] = 0.0f;
+        }
+    }
 
-    fd = open("/dev/cpcidev_pci", O_RDWR);
-    if (fd < 0)
+    job.a_off = 0 * sizeof(buf[0]);
+    job.b_off = 1 * sizeof(buf[0]);
+    job.c_off = 2 * sizeof(buf[0]);
+    job.n = 4;
+    job.status = -1;
+
+    if (ioctl(fd, IOCTL_GEMM_MAPPED, &job) < 0)
     {
-        perror("open");
-        return 1;
+        perror("[APP]: IOCTL_GEMM_MAPPED failed");
+        munmap(buf, MAP_BYTES);
+        return -1;
+    }
+    if (job.status != 0)
+    {
+        printf("[APP]: Mapped job failed with status %d\n", job.status);
+        munmap(buf, MAP_BYTES);
+        return -1;
+    }
+    printf("[APP]: Result matrix:\n");
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 4; j++)
+        {
+            printf("%6.0f ", buf[2][i][j]);
+        }
+        printf("\n");
     }
 
-    printf("[APP]: Device opened\n");
+    munmap(buf, MAP_BYTES);
+    return 0;
+}
+
+/*
+ * Submit ASYNC_JOBS jobs without waiting for each, reaping completions
+ * whenever the device runs out of job slots
+ */
+static int run_async(void)
+{
+    size_t elems = (size_t)ASYNC_DIM * ASYNC_DIM;
+    float *a = malloc(elems * sizeof(float));
+    float *b = malloc(elems * sizeof(float));
+    float *c = calloc(ASYNC_JOBS * elems, sizeof(float));
+    struct cpcidev_completion comp[32];
+    struct cpcidev dev;
+    int submitted = 0, completed = 0, errors = 0;
 
-    /* Write OP1 matrix */
-    ret = ioctl(fd, IOCTL_SET_OP1_MATRIX, A);
-    if (ret < 0)
+    if (!a || !b || !c || cpcidev_open(&dev, NULL) < 0)
     {
-        perror("[APP]: IOCTL_SET_OP1_MATRIX failed");
-        close(fd);
-        return 1;
+        perror("[APP]: async setup");
+        free(a);
+        free(b);
+        free(c);
+        return -1;
     }
-    printf("[APP]: OP1 matrix written\n");
 
-    /* Write OP2 matrix */
-    printf("[APP]: About to call IOCTL_SET_OP2_MATRIX with cmd=0x%x\n", IOCTL_SET_OP2_MATRIX);
-    ret = ioctl(fd, IOCTL_SET_OP2_MATRIX, B);
-    printf("[APP]: ioctl returned: %d\n", ret);
-    if (ret < 0)
+    /* Identity B, so job j returns A unchanged */
+    for (size_t i = 0; i < elems; i++)
     {
-        perror("[APP]: IOCTL_SET_OP2_MATRIX failed");
-        close(fd);
-        return 1;
+        a[i] = (float)(i % 11);
+        b[i] = (i / ASYNC_DIM == i % ASYNC_DIM) ? 1.0f : 0.0f;
     }
-    printf("[APP]: OP2 matrix written\n");
 
-    /* Set opcode */
-    ret = ioctl(fd, IOCTL_SET_OPCODE, &opcode);
-    if (ret < 0)
+    while (completed < ASYNC_JOBS)
     {
-        perror("[APP]: IOCTL_SET_OPCODE failed");
-        close(fd);
-        return 1;
+        uint64_t id;
+        int n;
+
+        while (submitted < ASYNC_JOBS &&
+               cpcidev_submit(&dev, a, b, c + submitted * elems, ASYNC_DIM, &id) == 0)
+            submitted++;
+        if (submitted < ASYNC_JOBS && errno != EAGAIN)
+        {
+            perror("[APP]: IOCTL_GEMM_SUBMIT failed");
+            break;
+        }
+
+        n = cpcidev_reap(&dev, comp, 32, 30000);
+        if (n <= 0)
+        {
+            printf("[APP]: Async jobs stalled after %d completions\n", completed);
+            break;
+        }
+        for (int i = 0; i < n; i++)
+            errors += comp[i].status != 0;
+        completed += n;
     }
-    printf("[APP]: Opcode set to %u\n", opcode);
 
-    /* Read result */
-    ret = ioctl(fd, IOCTL_GET_RESULT, C);
-    if (ret < 0)
+    for (int j = 0; j < completed; j++)
+        for (size_t i = 0; i < elems; i++)
+            errors += c[j * elems + i] != a[i];
+
+    printf("[APP]: Async completed %d/%d jobs: %s\n", completed, ASYNC_JOBS,
+           errors || completed < ASYNC_JOBS ? "MISMATCH" : "OK");
+    cpcidev_close(&dev);
+    free(a);
+    free(b);
+    free(c);
+    return errors || completed < ASYNC_JOBS ? -1 : 0;
+}
+
+#ifdef CPCIDEV_URING
+/*
+ * The same stream through io_uring with a kernel submission thread:
+ * operands live in the mapped buffer, A and B shared by every job
+ */
+static int run_uring(void)
+{
+    size_t elems = (size_t)ASYNC_DIM * ASYNC_DIM;
+    size_t mat_bytes = elems * sizeof(float);
+    struct cpcidev_completion comp[32];
+    struct cpcidev dev;
+    float *map;
+    int submitted = 0, completed = 0, errors = 0;
+
+    if (cpcidev_open(&dev, NULL) < 0)
     {
-        perror("[APP]: IOCTL_GET_RESULT failed");
-        close(fd);
-        return 1;
+        perror("[APP]: open");
+        return -1;
+    }
+    map = cpcidev_map(&dev, (ASYNC_JOBS + 2) * mat_bytes);
+    if (!map || cpcidev_uring_setup(&dev, URING_DEPTH, 1) < 0)
+    {
+        perror("[APP]: io_uring setup");
+        cpcidev_close(&dev);
+        return -1;
     }
-    printf("[APP]: Result matrix retrieved\n");
 
-    /* Print result */
-    printf("[APP]: Result matrix:\n");
-    for (int i = 0; i < 4; i++)
+    for (size_t i = 0; i < elems; i++)
     {
-        for (int j = 0; j < 4; j++)
+        map[i] = (float)(i % 11);
+        map[elems + i] = (i / ASYNC_DIM == i % ASYNC_DIM) ? 1.0f : 0.0f;
+    }
+
+    while (completed < ASYNC_JOBS)
+    {
+        uint64_t id;
+        int n;
+
+        while (submitted < ASYNC_JOBS && submitted - completed < URING_DEPTH &&
+               cpcidev_submit_mapped(&dev, 0, mat_bytes, (submitted + 2) * mat_bytes, ASYNC_DIM, &id) == 0)
+            submitted++;
+
+        n = cpcidev_reap(&dev, comp, 32, 30000);
+        if (n <= 0)
         {
-            printf("%6u ", C[i][j]);
+            printf("[APP]: io_uring jobs stalled after %d completions\n", completed);
+            break;
         }
-        printf("\n");
+        for (int i = 0; i < n; i++)
+            errors += comp[i].status != 0;
+        completed += n;
     }
 
+    for (int j = 0; j < completed; j++)
+        for (size_t i = 0; i < elems; i++)
+            errors += map[(j + 2) * elems + i] != map[i];
+
+    printf("[APP]: io_uring completed %d/%d jobs: %s\n", completed, ASYNC_JOBS,
+           errors || completed < ASYNC_JOBS ? "MISMATCH" : "OK");
+    cpcidev_close(&dev);
+    return errors || completed < ASYNC_JOBS ? -1 : 0;
+}
+#endif
+
+int main(void)
+{
+    int fd;
+    int ret;
+
+    fd = open("/dev/cpcidev_pci", O_RDWR);
+    if (fd < 0)
+    {
+        perror("open");
+        return 1;
+    }
+
+    printf("[APP]: Device opened\n");
+
+    /* 4x4 job on operands in the mapped DMA buffer */
+    ret = run_mapped(fd);
+
+    /* Batched float GEMM through the submission queue */
+    if (ret == 0)
+        ret = run_batch(fd);
+
+    /* Many jobs in flight from one thread */
+    if (ret == 0)
+        ret = run_async();
+
+#ifdef CPCIDEV_URING
+    if (ret == 0)
+        ret = run_uring();
+#endif
+
     close(fd);
-    return 0;
-}
\ No newline at end of file
+    return ret < 0 ? 1 : 0;
+}
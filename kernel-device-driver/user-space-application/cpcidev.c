@@ -0,0 +1,217 @@
+/*
+ * CPCIDEV user-space library, see cpcidev.h
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "cpcidev.h"
+
+int cpcidev_open(struct cpcidev *dev, const char *path)
+{
+    memset(dev, 0, sizeof(*dev));
+
+    /* Non-blocking, so reap can drain completions without a stray wait */
+    dev->fd = open(path ? path : "/dev/cpcidev_pci", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    return dev->fd < 0 ? -1 : 0;
+}
+
+void cpcidev_close(struct cpcidev *dev)
+{
+#ifdef CPCIDEV_URING
+    if (dev->uring)
+        io_uring_queue_exit(&dev->ring);
+    dev->uring = 0;
+#endif
+    if (dev->map)
+        munmap(dev->map, dev->map_bytes);
+    dev->map = NULL;
+    if (dev->fd >= 0)
+        close(dev->fd);
+    dev->fd = -1;
+}
+
+void *cpcidev_map(struct cpcidev *dev, size_t bytes)
+{
+    void *p;
+
+    if (dev->map)
+    {
+        errno = EBUSY;
+        return NULL;
+    }
+
+    p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, dev->fd, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    dev->map = p;
+    dev->map_bytes = bytes;
+    return p;
+}
+
+static int submit_ioctl(struct cpcidev *dev, struct cpcidev_gemm_submit *sub, uint64_t *id)
+{
+    if (ioctl(dev->fd, IOCTL_GEMM_SUBMIT, sub) < 0)
+        return -1;
+    *id = sub->id;
+    return 0;
+}
+
+int cpcidev_submit(struct cpcidev *dev, const float *a, const float *b, float *c, uint32_t n, uint64_t *id)
+{
+    struct cpcidev_gemm_submit sub = {
+        .a = (uintptr_t)a,
+        .b = (uintptr_t)b,
+        .c = (uintptr_t)c,
+        .n = n,
+        .flags = 0,
+    };
+
+#ifdef CPCIDEV_URING
+    /* The driver completes commands from its bottom half and cannot copy
+     * results into this process, so io_uring takes mapped jobs only */
+    if (dev->uring)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+#endif
+    return submit_ioctl(dev, &sub, id);
+}
+
+#ifdef CPCIDEV_URING
+int cpcidev_uring_setup(struct cpcidev *dev, unsigned entries, int sqpoll)
+{
+    struct io_uring_params p;
+    int ret;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SQE128;
+    if (sqpoll)
+    {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+
+    ret = io_uring_queue_init_params(entries, &dev->ring, &p);
+    if (ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
+    dev->uring = 1;
+    return 0;
+}
+
+static int submit_uring(struct cpcidev *dev, const struct cpcidev_gemm_submit *sub, uint64_t *id)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&dev->ring);
+
+    /* SQ ring full: hand what is queued to the kernel and retry */
+    if (!sqe)
+    {
+        io_uring_submit(&dev->ring);
+        sqe = io_uring_get_sqe(&dev->ring);
+        if (!sqe)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    io_uring_prep_rw(IORING_OP_URING_CMD, sqe, dev->fd, NULL, 0, 0);
+    sqe->cmd_op = CPCIDEV_URING_CMD_GEMM;
+    memcpy(sqe->cmd, sub, sizeof(*sub));
+    *id = ++dev->next_id;
+    io_uring_sqe_set_data64(sqe, *id);
+    return 0;
+}
+
+static int reap_uring(struct cpcidev *dev, struct cpcidev_completion *comp, int max, int timeout_ms)
+{
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int n = 0;
+
+    io_uring_submit(&dev->ring);
+    if (io_uring_cq_ready(&dev->ring) == 0 && timeout_ms != 0)
+    {
+        struct __kernel_timespec ts = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = (timeout_ms % 1000) * 1000000LL,
+        };
+        int ret = io_uring_wait_cqe_timeout(&dev->ring, &cqe, timeout_ms < 0 ? NULL : &ts);
+
+        if (ret == -ETIME)
+            return 0;
+        if (ret < 0)
+        {
+            errno = -ret;
+            return -1;
+        }
+    }
+
+    io_uring_for_each_cqe(&dev->ring, head, cqe)
+    {
+        if (n == max)
+            break;
+        comp[n].id = io_uring_cqe_get_data64(cqe);
+        comp[n].status = cqe->res;
+        comp[n].rsvd = 0;
+        n++;
+    }
+    io_uring_cq_advance(&dev->ring, n);
+    return n;
+}
+#endif
+
+int cpcidev_submit_mapped(struct cpcidev *dev, uint64_t a_off, uint64_t b_off, uint64_t c_off, uint32_t n,
+                          uint64_t *id)
+{
+    struct cpcidev_gemm_submit sub = {
+        .a = a_off,
+        .b = b_off,
+        .c = c_off,
+        .n = n,
+        .flags = CPCIDEV_SUBMIT_MAPPED,
+    };
+
+#ifdef CPCIDEV_URING
+    if (dev->uring)
+        return submit_uring(dev, &sub, id);
+#endif
+    return submit_ioctl(dev, &sub, id);
+}
+
+int cpcidev_reap(struct cpcidev *dev, struct cpcidev_completion *comp, int max, int timeout_ms)
+{
+    struct pollfd pfd = {.fd = dev->fd, .events = POLLIN};
+    ssize_t len;
+
+    if (max <= 0)
+        return 0;
+#ifdef CPCIDEV_URING
+    if (dev->uring)
+        return reap_uring(dev, comp, max, timeout_ms);
+#endif
+
+    len = read(dev->fd, comp, max * sizeof(*comp));
+    if (len < 0 && errno == EAGAIN && timeout_ms != 0)
+    {
+        int ret = poll(&pfd, 1, timeout_ms);
+
+        if (ret <= 0)
+            return ret;
+        len = read(dev->fd, comp, max * sizeof(*comp));
+    }
+
+    if (len < 0)
+        return errno == EAGAIN ? 0 : -1;
+    return len / sizeof(*comp);
+}
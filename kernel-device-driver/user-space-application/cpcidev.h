@@ -0,0 +1,81 @@
+/*
+ * Small user-space library for CPCIDEV: asynchronous GEMM submission on
+ * top of IOCTL_GEMM_SUBMIT and completion records read from the device.
+ *
+ * Built with -DCPCIDEV_URING (and -luring), jobs on the mapped buffer can
+ * go through io_uring instead: submissions are queued as SQEs and reaped
+ * from the CQ ring, so a stream of jobs costs few or, with SQPOLL, no
+ * system calls.
+ */
+
+#ifndef CPCIDEV_H
+#define CPCIDEV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#ifdef CPCIDEV_URING
+#include <liburing.h>
+#endif
+
+#include "cpcidev_uapi.h"
+
+struct cpcidev
+{
+    int fd;
+    void *map;
+    size_t map_bytes;
+#ifdef CPCIDEV_URING
+    int uring; /* set by cpcidev_uring_setup */
+    struct io_uring ring;
+    uint64_t next_id;
+#endif
+};
+
+/* Open the device node (NULL for /dev/cpcidev_pci); -1 with errno set on failure */
+int cpcidev_open(struct cpcidev *dev, const char *path);
+void cpcidev_close(struct cpcidev *dev);
+
+/*
+ * Map bytes of coherent DMA memory from the device (once per handle).
+ * Jobs given to cpcidev_submit_mapped address it by byte offset.
+ */
+void *cpcidev_map(struct cpcidev *dev, size_t bytes);
+
+/*
+ * Queue C = A * B on N x N float matrices and return without waiting.
+ * c must stay valid until the job's completion has been reaped. Returns
+ * 0 and the job ID in *id, or -1 with errno set (EAGAIN: too many jobs
+ * in flight, reap some first). Not available on the io_uring backend.
+ */
+int cpcidev_submit(struct cpcidev *dev, const float *a, const float *b, float *c, uint32_t n, uint64_t *id);
+
+/* Same for matrices at byte offsets in the mapping; the device works on them in place */
+int cpcidev_submit_mapped(struct cpcidev *dev, uint64_t a_off, uint64_t b_off, uint64_t c_off, uint32_t n,
+                          uint64_t *id);
+
+/*
+ * Collect up to max completions, waiting up to timeout_ms for the first
+ * (-1: forever, 0: do not wait). Returns the number collected or -1.
+ */
+int cpcidev_reap(struct cpcidev *dev, struct cpcidev_completion *comp, int max, int timeout_ms);
+
+#ifdef CPCIDEV_URING
+/*
+ * Switch the handle to io_uring with an entries-deep ring; sqpoll starts
+ * a kernel submission thread. Submissions are handed to the kernel by
+ * the next cpcidev_reap.
+ */
+int cpcidev_uring_setup(struct cpcidev *dev, unsigned entries, int sqpoll);
+#endif
+
+/* Descriptor to watch with poll/epoll; readable while completions wait */
+static inline int cpcidev_fd(const struct cpcidev *dev)
+{
+#ifdef CPCIDEV_URING
+    if (dev->uring)
+        return dev->ring.ring_fd;
+#endif
+    return dev->fd;
+}
+
+#endif